@@ -7,6 +7,7 @@
 #include <sisocks.h>
 #ifdef unix
 #include <sys/un.h> /* needed for unix sockets */
+#include <sys/uio.h>
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -192,6 +193,69 @@ int server_stack_size(server_stack_t *s) {
 	return n;
 }
 
+#ifdef unix
+/* passes the descriptor fd along with len bytes of data over the unix
+   socket via (len must be at least 1). Returns the number of bytes sent
+   or -1 on error */
+int send_fd(int via, int fd, const void *data, int len) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cm, 0, sizeof(cm));
+	iov.iov_base = (void*) data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+#ifdef MSG_NOSIGNAL
+	return sendmsg(via, &msg, MSG_NOSIGNAL);
+#else
+	return sendmsg(via, &msg, 0);
+#endif
+}
+
+/* receives a message sent by send_fd(). *fd is set to the received
+   descriptor or -1 if the message didn't carry any. Returns the number
+   of data bytes received, 0 on EOF and -1 on error */
+int recv_fd(int via, int *fd, void *data, int len) {
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	struct cmsghdr *cmsg;
+	int n;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	if ((n = recvmsg(via, &msg, 0)) < 1)
+		return n;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return n;
+}
+#endif
+
 /*--- The following makes the indenting behavior of emacs compatible
       with Xcode's 4/4 setting ---*/
 /* Local Variables: */
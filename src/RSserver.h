@@ -17,6 +17,7 @@ typedef void (*send_fn_t)(args_t *arg, int rsp, rlen_t len, const void *buf);
 typedef int  (*buf_fn_t) (args_t *arg, void *buf, rlen_t len);
 typedef int  (*cbuf_fn_t) (args_t *arg, const void *buf, rlen_t len);
 typedef int  (*fork_fn_t) (args_t *arg);
+typedef int  (*flush_fn_t)(args_t *arg);
 
 /* definition of a server */
 typedef struct server {
@@ -28,6 +29,7 @@ typedef struct server {
 	send_fn_t send_resp;  /* send response */
 	cbuf_fn_t send;       /* direct send */
 	buf_fn_t  recv;       /* direct receive */
+	flush_fn_t flush;     /* optional: send buffered output, called at the end of each message */
     fork_fn_t fork;       /* fork */
 	struct server *parent;/* parent server - used only by multi-layer servers */
 } server_t;
@@ -51,6 +53,8 @@ void release_server_stack(server_stack_t *s);
 void server_fin(void *x);
 int server_recv(args_t *arg, void *buf, rlen_t len);
 int server_send(args_t *arg, const void *buf, rlen_t len);
+/* calls srv->flush if the server has one */
+int server_flush(args_t *arg);
 
 void stop_server_loop();
 void serverLoop();
@@ -64,6 +68,24 @@ int Rserve_prepare_child(args_t *arg);
 /* this one is called by the former to close all server sockets in the child */
 void close_all_srv_sockets();
 
+/* maximal number of workers for asynchronous OC calls (oc.workers) */
+#define OC_MAX_WORKERS 32
+
+#ifdef unix
+/* passing of descriptors between processes over unix sockets */
+int send_fd(int via, int fd, const void *data, int len);
+int recv_fd(int via, int *fd, void *data, int len);
+
+/* asynchronous OC calls: while a connection is waiting for input it
+   also polls the workers evaluating its calls. oc_async_fds() sets up
+   pfd (at most max entries) with descriptors of busy workers and
+   returns their number, oc_async_forward() sends results of ready
+   workers to the client. */
+struct pollfd;
+int  oc_async_fds(struct pollfd *pfd, int max);
+void oc_async_forward(args_t *arg, struct pollfd *pfd, int n);
+#endif
+
 #endif
 
 /*--- The following makes the indenting behavior of emacs compatible
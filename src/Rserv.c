@@ -188,6 +188,11 @@ typedef int socklen_t;
 #include <sys/signal.h>
 #include <unistd.h>
 #include <sys/un.h> /* needed for unix sockets */
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/resource.h>
 #endif
 #ifdef FORKED
 #include <sys/wait.h>
@@ -263,6 +268,9 @@ void sha1hash(const char *buf, int len, unsigned char hash[20]);
 #include "http.h"
 #include "tls.h"
 #include "oc.h"
+#include "hub.h"
+#include "json_encode.h"
+#include "session.h"
 
 struct args {
 	server_t *srv; /* server that instantiated this connection */
@@ -279,10 +287,16 @@ struct args {
 #ifdef unix
     struct sockaddr_un su;
 #endif
-	char res[128]; /* reserved space for server-specific fields */
+	char res[256]; /* reserved space for server-specific fields */
 };
 
 static int port = default_Rsrv_port;
+static int session_wait = 100;   /* how long to wait for a session key on new connections (in ms) */
+static long session_timeout = 0; /* detached sessions idle for longer are closed (in s, 0 = never) */
+static long session_hibernate = 0; /* detached sessions idle for longer are saved to disk (in s, 0 = never) */
+static int job_max = 0;            /* maximal number of jobs running at the same time (0 = no limit) */
+static long job_retention = 86400; /* results of finished jobs not polled for longer are removed (in s, 0 = never) */
+static int oc_workers = 0;         /* number of workers for asynchronous OC calls (0 = disabled) */
 static int tls_port = -1;
 static int active = 1; /* 1 = server loop is active, 0 = shutdown */
 static int UCIX   = 1; /* unique connection index */
@@ -679,6 +693,7 @@ void Rserve_QAP1_send_resp(args_t *arg, int rsp, rlen_t len, const void *buf) {
 			break;
 		i += rs;
 	}
+	server_flush(arg);
 }
 
 /* initial ID string */
@@ -727,6 +742,7 @@ struct source_entry {
 } *src_list=0, *src_tail=0;
 
 static int ws_port = -1, enable_qap = 1, enable_ws_qap = 0, enable_ws_text = 0, wss_port = 0;
+static int ws_text_json = 0; /* results of the WS text protocol are sent as JSON instead of text */
 static int ws_qap_oc = 0, qap_oc = 0;
 /* FIXME: self.* commands can be loaded either from Rserve.so or from stand-alone binary.
    This will cause a mess since some things are private and some are not - we have to sort that out.
@@ -822,6 +838,16 @@ static int setConfig(const char *c, const char *p) {
 		ws_qap_oc = (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0;
 		return 1;
 	}
+	if (!strcmp(c, "oc.workers")) {
+		oc_workers = satoi(p);
+		if (oc_workers > OC_MAX_WORKERS)
+			oc_workers = OC_MAX_WORKERS;
+		return 1;
+	}
+	if (!strcmp(c, "oc.stats")) {
+		oc_stats_enabled = (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0;
+		return 1;
+	}
 	if (!strcmp(c, "random.uid")) {
 		random_uid = (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0;
 		return 1;
@@ -885,6 +911,46 @@ static int setConfig(const char *c, const char *p) {
 		http_raw_body = (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0;
 		return 1;
 	}
+	if (!strcmp(c, "http.workers")) {
+		if (*p)
+			set_http_workers(satoi(p));
+		return 1;
+	}
+	if (!strcmp(c, "http.keepalive.timeout")) { /* in s */
+		if (*p)
+			set_http_keepalive_timeout(satoi(p));
+		return 1;
+	}
+	if (!strcmp(c, "http.h2")) {
+		set_http_h2((*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0);
+		return 1;
+	}
+	if (!strcmp(c, "http.cache")) { /* in kB */
+		if (*p)
+			set_http_cache(((unsigned long) atol(p)) * 1024);
+		return 1;
+	}
+	if (!strcmp(c, "http.compress")) { /* compression level 0..9, 0 = off */
+		if (*p)
+			set_http_compression(satoi(p), -1);
+		return 1;
+	}
+	if (!strcmp(c, "http.compress.min")) { /* in bytes */
+		if (*p) {
+			long ns = atol(p);
+			if (ns >= 0)
+				set_http_compression(-1, ns);
+		}
+		return 1;
+	}
+	if (!strcmp(c, "http.body.tmpfile")) { /* in kB, 0 = keep all bodies in memory */
+		if (*p) {
+			long ns = atol(p);
+			if (ns >= 0)
+				set_http_body_tmpfile(ns * 1024);
+		}
+		return 1;
+	}
 	if (!strcmp(c,"websockets.port")) {
 		if (*p) {
 			int np = satoi(p);
@@ -903,7 +969,8 @@ static int setConfig(const char *c, const char *p) {
 		tls_t *tls = shared_tls(0);
 		if (!tls)
 			tls = shared_tls(new_tls());
-		set_tls_pk(tls, p);
+		if (set_tls_pk(tls, p) != 1)
+			RSEprintf("WARNING: cannot load TLS private key from '%s'\n", p);
 		return 1;
 	}
 	if (!strcmp(c, "tls.ca")) {
@@ -917,7 +984,115 @@ static int setConfig(const char *c, const char *p) {
 		tls_t *tls = shared_tls(0);
 		if (!tls)
 			tls = shared_tls(new_tls());
-		set_tls_cert(tls, p);
+		if (set_tls_cert(tls, p) != 1)
+			RSEprintf("WARNING: cannot load TLS certificate from '%s'\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "tls.tickets")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		set_tls_tickets(tls, (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0);
+		return 1;
+	}
+	if (!strcmp(c, "tls.ticket.key")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_ticket_key(tls, p))
+			RSEprintf("WARNING: cannot read TLS ticket key from '%s' (it must have at least 32 bytes), using a random key\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "tls.ticket.lifetime")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (*p)
+			set_tls_ticket_lifetime(tls, satoi(p));
+		return 1;
+	}
+	if (!strcmp(c, "tls.cache")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (*p && set_tls_cache(tls, satoi(p)))
+			RSEprintf("WARNING: cannot create TLS session cache\n");
+		return 1;
+	}
+	if (!strcmp(c, "tls.record.size")) {
+		set_tls_record_size(satoi(p));
+		return 1;
+	}
+	if (!strcmp(c, "tls.ktls")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_ktls(tls, (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0))
+			RSEprintf("WARNING: kernel TLS is not supported by this build of OpenSSL\n");
+		return 1;
+	}
+	if (!strcmp(c, "tls.min.version") || !strcmp(c, "tls.max.version")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_version(tls, p, strcmp(c, "tls.max.version") ? 0 : 1))
+			RSEprintf("WARNING: unsupported TLS version '%s' in %s\n", p, c);
+		return 1;
+	}
+	if (!strcmp(c, "tls.ciphers")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_ciphers(tls, p))
+			RSEprintf("WARNING: invalid TLS cipher list '%s'\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "tls.ciphersuites")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_ciphersuites(tls, p))
+			RSEprintf("WARNING: invalid or unsupported TLS 1.3 cipher suites '%s'\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "tls.groups") || !strcmp(c, "tls.curves")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		if (set_tls_groups(tls, p))
+			RSEprintf("WARNING: invalid or unsupported TLS groups '%s'\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "tls.prefer.server.ciphers")) {
+		tls_t *tls = shared_tls(0);
+		if (!tls)
+			tls = shared_tls(new_tls());
+		set_tls_server_preference(tls, (*p == '1' || *p == 'y' || *p == 'e' || *p == 'T') ? 1 : 0);
+		return 1;
+	}
+	if (!strcmp(c, "tls.alpn")) {
+		if (set_tls_alpn(p))
+			RSEprintf("WARNING: invalid ALPN protocol list '%s'\n", p);
+		return 1;
+	}
+	if (!strcmp(c, "session.wait")) {
+		session_wait = satoi(p);
+		return 1;
+	}
+	if (!strcmp(c, "session.timeout")) {
+		session_timeout = satoi(p);
+		return 1;
+	}
+	if (!strcmp(c, "session.hibernate")) {
+		session_hibernate = satoi(p);
+		return 1;
+	}
+	if (!strcmp(c, "job.max")) {
+		job_max = satoi(p);
+		return 1;
+	}
+	if (!strcmp(c, "job.retention")) {
+		job_retention = satoi(p);
 		return 1;
 	}
 	if (!strcmp(c, "pid.file") && *p) {
@@ -977,10 +1152,31 @@ static int setConfig(const char *c, const char *p) {
 		enable_ws_qap = (p[0] == 'e' || p[0] == 'y' || p[0] == '1' || p[0] == 'T') ? 1 : 0;
 		return 1;
 	}
+	if (!strcmp(c, "websockets.deflate")) { /* compression level 0..9, 0 = off */
+		if (*p)
+			set_ws_deflate(satoi(p), -1);
+		return 1;
+	}
+	if (!strcmp(c, "websockets.deflate.min")) { /* in bytes */
+		if (*p) {
+			long ns = atol(p);
+			if (ns >= 0)
+				set_ws_deflate(-1, ns);
+		}
+		return 1;
+	}
+	if (!strcmp(c, "hub")) { /* pub/sub hub for broadcasting to WebSocket clients */
+		hub_enable((p[0] == 'e' || p[0] == 'y' || p[0] == '1' || p[0] == 'T') ? 1 : 0);
+		return 1;
+	}
 	if (!strcmp(c, "websockets.text")) {
 		enable_ws_text = (p[0] == 'e' || p[0] == 'y' || p[0] == '1' || p[0] == 'T') ? 1 : 0;
 		return 1;
 	}
+	if (!strcmp(c, "websockets.text.format")) { /* text or json */
+		ws_text_json = strcmp(p, "json") ? 0 : 1;
+		return 1;
+	}
 	if (!strcmp(c, "websockets") && (p[0] == 'e' || p[0] == 'y' || p[0] == '1' || p[0] == 'T')) {
 		enable_ws_qap = 1;
 		enable_ws_text = 1;
@@ -1338,25 +1534,196 @@ void voidEval(char *cmd) {
 #define sendRespData(A, C, L, D) srv->send_resp(A, C, L, D)
 #define sendResp(A,C) srv->send_resp(A, C, 0, 0)
 
+#ifdef unix
+/* Detached sessions are resumed through the regular QAP port: the
+   detaching child creates a socket pair and registers one end with its
+   session key at the master (over session_sv which is shared by all
+   children). When a new connection sends a session key, the master
+   passes the connected socket to the detached child over that pair, so
+   no port or listening socket per session is needed. */
+static int session_sv[2] = { -1, -1 }; /* [0] master end, [1] used by all children */
+
+/* message types on session_sv */
+#define SREG_SESSION 1 /* registers a detached session */
+#define SREG_JOB     2 /* registers a job */
+#define SREG_QUERY   3 /* asks for the state of a job, the master replies with job_info_t */
+
+typedef struct session_reg {
+	unsigned char key[SESSION_KEY_LEN];
+	unsigned int peer;
+	int type;
+} session_reg_t;
+
+/* job states */
+#define JOB_QUEUED  1
+#define JOB_RUNNING 2
+#define JOB_DONE    3
+#define JOB_FAILED  4
+
+/* state of a job, sent by the master in reply to SREG_QUERY and by
+   the job to the master when it is finished */
+typedef struct job_info {
+	int state; /* 0 = no such job */
+	double cpu, wall;
+} job_info_t;
+
+/* random bytes for session keys */
+static void session_random(unsigned char *buf, int len) {
+	int i = 0, f = open("/dev/urandom", O_RDONLY);
+	if (f != -1) {
+		i = read(f, buf, len);
+		close(f);
+		if (i < 0) i = 0;
+	}
+	while (i < len)
+		buf[i++] = (unsigned char) random();
+}
+#else
 struct sockaddr_in session_peer_sa;
-SOCKET session_socket;
-unsigned char session_key[32];
+#endif
+SOCKET session_socket = -1;
+unsigned char session_key[SESSION_KEY_LEN];
+
+#ifdef unix
+static unsigned int session_peer; /* address of the client that detached the session */
+
+/* Hibernated sessions are stored in <workdir>/sessions/<key>.rds and
+   job results in <workdir>/jobs/<key>.rds (the directories are only
+   accessible by the owner since the file name is the key) */
+static int session_file(char *fn, int len, const char *dir, const unsigned char *key) {
+	int i, n;
+	if (!workdir)
+		return -1;
+	n = snprintf(fn, len, "%s/%s/", workdir, dir);
+	if (n < 0 || n + SESSION_KEY_LEN * 2 + 5 > len)
+		return -1;
+	for (i = 0; i < SESSION_KEY_LEN; i++)
+		n += snprintf(fn + n, len - n, "%02x", (unsigned int) key[i]);
+	strcpy(fn + n, ".rds");
+	return 0;
+}
+
+/* IPv4 address of the client connected on s (0 if not an IPv4 socket).
+   Unlike the informational sa field this works for all transports */
+static unsigned int socket_peer(SOCKET s) {
+	SAIN peer;
+	socklen_t sl = sizeof(peer);
+	memset(&peer, 0, sizeof(peer));
+	if (!getpeername(s, (SA*) &peer, &sl) && peer.sin_family == AF_INET)
+		return peer.sin_addr.s_addr;
+	return 0;
+}
+
+static double wall_time() {
+	struct timeval t;
+	gettimeofday(&t, 0);
+	return (double) t.tv_sec + ((double) t.tv_usec) / 1000000.0;
+}
+
+static double time_diff(struct timeval *t0) {
+	struct timeval t1;
+	gettimeofday(&t1, 0);
+	return (double) (t1.tv_sec - t0->tv_sec) + ((double) (t1.tv_usec - t0->tv_usec)) / 1000000.0;
+}
+
+/* saves the global environment and the attached packages of the
+   detached session into its session file. Returns 0 on success. */
+static int hibernate_session() {
+	char fn[1024], tmp[1100];
+	int err = 0;
+	struct timeval t0;
+	struct stat st;
+	mode_t om;
+	SEXP sv, nm, call;
+
+	if (session_file(fn, sizeof(fn), "sessions", session_key))
+		return -1;
+	gettimeofday(&t0, 0);
+	snprintf(tmp, sizeof(tmp), "%s/sessions", workdir);
+	mkdir(tmp, 0700);
+	snprintf(tmp, sizeof(tmp), "%s.%d", fn, (int) getpid());
+
+	sv = PROTECT(allocVector(VECSXP, 3));
+	nm = allocVector(STRSXP, 3);
+	setAttrib(sv, R_NamesSymbol, nm);
+	SET_STRING_ELT(nm, 0, mkChar("globals"));
+	SET_STRING_ELT(nm, 1, mkChar("packages"));
+	SET_STRING_ELT(nm, 2, mkChar("peer"));
+	/* as.list(.GlobalEnv, all.names = TRUE) forces promises as well */
+	call = PROTECT(lang3(install("as.list"), R_GlobalEnv, ScalarLogical(1)));
+	SET_TAG(CDDR(call), install("all.names"));
+	SET_VECTOR_ELT(sv, 0, R_tryEval(call, R_GlobalEnv, &err));
+	UNPROTECT(1);
+	if (!err)
+		SET_VECTOR_ELT(sv, 1, R_tryEval(lang1(install(".packages")), R_GlobalEnv, &err));
+	SET_VECTOR_ELT(sv, 2, ScalarReal((double) session_peer));
+	if (!err) {
+		om = umask(077);
+		R_tryEval(lang3(install("saveRDS"), sv, mkString(tmp)), R_GlobalEnv, &err);
+		umask(om);
+	}
+	UNPROTECT(1);
+	if (err || stat(tmp, &st) || rename(tmp, fn)) {
+		unlink(tmp);
+		RSEprintf("WARNING: cannot hibernate session into '%s'\n", fn);
+		return -1;
+	}
+	RSEprintf("session %d: hibernated (%ld bytes) in %.3fs\n", (int) getpid(), (long) st.st_size, time_diff(&t0));
+	return 0;
+}
+#endif
 
 /* detach session and setup everything such that in can be resumed at some point */
 int detach_session(args_t *arg) {
-    SAIN ssa;
 	SOCKET s = arg->s;
 	server_t *srv = arg->srv;
-	int port = 32768;
-	SOCKET ss = FCF("open socket",socket(AF_INET,SOCK_STREAM,0));
-    int reuse = 1; /* enable socket address reusage */
-	socklen_t sl = sizeof(session_peer_sa);
 	struct dsresp {
 		int pt1;
 		int port;
 		int pt2;
-		unsigned char key[32];
+		unsigned char key[SESSION_KEY_LEN];
 	} dsr;
+#ifdef unix
+	int ch[2];
+	session_reg_t reg;
+
+	/* the resumed connection is a plain socket, so only plain QAP can be detached */
+	if (session_sv[1] == -1 || srv->send != server_send) {
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_detach_failed));
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.peer = socket_peer(s);
+	reg.type = SREG_SESSION;
+	session_peer = reg.peer;
+	session_random(session_key, SESSION_KEY_LEN);
+	memcpy(reg.key, session_key, SESSION_KEY_LEN);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ch)) {
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_detach_failed));
+		return -1;
+	}
+	if (send_fd(session_sv[1], ch[0], &reg, sizeof(reg)) != sizeof(reg)) {
+#ifdef RSERV_DEBUG
+		printf("session: cannot register the session with the server\n");
+#endif
+		close(ch[0]);
+		close(ch[1]);
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_detach_failed));
+		return -1;
+	}
+	close(ch[0]);
+	session_socket = ch[1];
+
+	dsr.pt1  = itop(SET_PAR(DT_INT,sizeof(int)));
+	dsr.port = itop(port);
+	dsr.pt2  = itop(SET_PAR(DT_BYTESTREAM,SESSION_KEY_LEN));
+	memcpy(dsr.key, session_key, SESSION_KEY_LEN);
+#else
+	SAIN ssa;
+	int port = 32768;
+	SOCKET ss = FCF("open socket",socket(AF_INET,SOCK_STREAM,0));
+    int reuse = 1; /* enable socket address reusage */
+	socklen_t sl = sizeof(session_peer_sa);
 
 	if (getpeername(s, (SA*) &session_peer_sa, &sl)) {
 		sendResp(arg, SET_STAT(RESP_ERR,ERR_detach_failed));
@@ -1365,11 +1732,7 @@ int detach_session(args_t *arg) {
 
     setsockopt(ss,SOL_SOCKET,SO_REUSEADDR,(const char*)&reuse,sizeof(reuse));
 
-#ifdef WIN32
 	while ((port = (((int) rand()) & 0x7fff)+32768)>65000) {};
-#else
-	while ((port = (((int) random()) & 0x7fff)+32768)>65000) {};
-#endif
 
 	while (bind(ss,build_sin(&ssa,0,port),sizeof(ssa))) {
 		if (errno!=EADDRINUSE) {
@@ -1402,7 +1765,7 @@ int detach_session(args_t *arg) {
 
 	{
 		int i=0;
-		while (i<32) session_key[i++]=(unsigned char) rand();
+		while (i<SESSION_KEY_LEN) session_key[i++]=(unsigned char) rand();
 	}
 
 #ifdef RSERV_DEBUG
@@ -1411,15 +1774,17 @@ int detach_session(args_t *arg) {
 
 	dsr.pt1  = itop(SET_PAR(DT_INT,sizeof(int)));
 	dsr.port = itop(port);
-	dsr.pt2  = itop(SET_PAR(DT_BYTESTREAM,32));
-	memcpy(dsr.key, session_key, 32);							
-	
-	sendRespData(arg, RESP_OK, 3*sizeof(int)+32, &dsr);
+	dsr.pt2  = itop(SET_PAR(DT_BYTESTREAM,SESSION_KEY_LEN));
+	memcpy(dsr.key, session_key, SESSION_KEY_LEN);
+	session_socket = ss;
+#endif
+
+	sendRespData(arg, RESP_OK, 3*sizeof(int)+SESSION_KEY_LEN, &dsr);
 	closesocket(s);
+	arg->s = -1;
 #ifdef RSERV_DEBUG
 	printf("session: detached, closing connection.\n");
 #endif
-	session_socket = ss;
 	return 0;
 }
 
@@ -1428,42 +1793,720 @@ int detach_session(args_t *arg) {
 /* resume detached session. return the new socket after resume is complete, but don't send the response message */
 SOCKET resume_session() {
 	SOCKET s=-1;
+#ifdef unix
+	char c;
+#ifdef RSERV_DEBUG
+	printf("session: resuming session, waiting for the server to pass a connection.\n");
+#endif
+	/* the master has checked the key and the peer address already */
+	while (s == -1) {
+		int n;
+		if (session_hibernate > 0 && workdir) {
+			struct pollfd pfd;
+			pfd.fd = session_socket;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			n = poll(&pfd, 1, (session_hibernate > 86400) ? 86400000 : (int) session_hibernate * 1000);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n == 0) {
+				if (hibernate_session()) /* try again later */
+					continue;
+				/* stop the server from passing connections, but pick up
+				   a connection that may have been passed in the meantime */
+				shutdown(session_socket, SHUT_RD);
+				n = recv_fd(session_socket, &s, &c, 1);
+				if (s != -1) {
+					char fn[1024];
+					if (!session_file(fn, sizeof(fn), "sessions", session_key))
+						unlink(fn);
+				}
+				break;
+			}
+		}
+		n = recv_fd(session_socket, &s, &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) { /* the server is gone or the session has expired */
+#ifdef RSERV_DEBUG
+			printf("session: connection to the server closed\n");
+#endif
+			break;
+		}
+	}
+	close(session_socket);
+	session_socket = -1;
+#ifdef RSERV_DEBUG
+	if (s != -1) printf("session: accepted\n");
+#endif
+	return s;
+#else
 	SAIN lsa;
 	socklen_t al=sizeof(lsa);
-	char clk[32];
+	char clk[SESSION_KEY_LEN];
 
 #ifdef RSERV_DEBUG
 	printf("session: resuming session, waiting for connections.\n");
 #endif
 
-	while ((s=accept(session_socket, (SA*)&lsa,&al))>1) {
-		if (lsa.sin_addr.s_addr != session_peer_sa.sin_addr.s_addr) {
-#ifdef RSERV_DEBUG
-			printf("session: different IP, rejecting\n");
-#endif
-			closesocket(s);
-		} else {
-			int n=0;
-			if ((n=recv(s, (char*)clk, 32, 0)) != 32) {
-#ifdef RSERV_DEBUG
-				printf("session: expected 32, got %d = closing\n", n);
-#endif
-				closesocket(s);
-			} else if (memcmp(clk, session_key, 32)) {
+	while ((s=accept(session_socket, (SA*)&lsa,&al))>1) {
+		if (lsa.sin_addr.s_addr != session_peer_sa.sin_addr.s_addr) {
+#ifdef RSERV_DEBUG
+			printf("session: different IP, rejecting\n");
+#endif
+			closesocket(s);
+		} else {
+			int n=0;
+			if ((n=recv(s, (char*)clk, SESSION_KEY_LEN, 0)) != SESSION_KEY_LEN) {
+#ifdef RSERV_DEBUG
+				printf("session: expected %d, got %d = closing\n", SESSION_KEY_LEN, n);
+#endif
+				closesocket(s);
+			} else if (memcmp(clk, session_key, SESSION_KEY_LEN)) {
+#ifdef RSERV_DEBUG
+				printf("session: wrong key, closing\n");
+#endif
+				closesocket(s);
+			} else {
+#ifdef RSERV_DEBUG
+				printf("session: accepted\n");
+#endif
+				closesocket(session_socket);
+				return s;
+			}
+		}
+	}
+	return -1;
+#endif
+}
+
+#ifdef unix
+/* restores a hibernated session into this process and removes its
+   session file. Sends the response. */
+static void attach_session(args_t *arg, const unsigned char *key) {
+	server_t *srv = arg->srv;
+	char fn[1024], tmp[1100];
+	int err = 0;
+	struct timeval t0;
+	SEXP sv, gl, nm, pkg;
+
+	if (session_file(fn, sizeof(fn), "sessions", key)) {
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_unavailable));
+		return;
+	}
+	/* claim the file so the session is restored only once */
+	snprintf(tmp, sizeof(tmp), "%s.%d", fn, (int) getpid());
+	if (rename(fn, tmp)) {
+#ifdef RSERV_DEBUG
+		printf("session: no hibernated session with that key\n");
+#endif
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_inv_par));
+		return;
+	}
+	gettimeofday(&t0, 0);
+	sv = PROTECT(R_tryEval(lang2(install("readRDS"), mkString(tmp)), R_GlobalEnv, &err));
+	if (err || TYPEOF(sv) != VECSXP || LENGTH(sv) != 3 || TYPEOF(VECTOR_ELT(sv, 0)) != VECSXP ||
+		TYPEOF(VECTOR_ELT(sv, 1)) != STRSXP || TYPEOF(VECTOR_ELT(sv, 2)) != REALSXP) {
+		UNPROTECT(1);
+		rename(tmp, fn);
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_IOerror));
+		return;
+	}
+	if (REAL(VECTOR_ELT(sv, 2))[0] != 0.0 &&
+		(srv->unix_socket || (double) arg->sa.sin_addr.s_addr != REAL(VECTOR_ELT(sv, 2))[0])) {
+#ifdef RSERV_DEBUG
+		printf("session: different IP, rejecting\n");
+#endif
+		UNPROTECT(1);
+		rename(tmp, fn);
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_accessDenied));
+		return;
+	}
+	unlink(tmp);
+
+	/* attach packages in the reverse order of the search path */
+	pkg = VECTOR_ELT(sv, 1);
+	if (LENGTH(pkg)) {
+		int i = LENGTH(pkg);
+		SEXP call = PROTECT(lang3(install("library"), R_NilValue, ScalarLogical(1)));
+		SET_TAG(CDDR(call), install("character.only"));
+		while (i-- > 0) {
+			SETCADR(call, ScalarString(STRING_ELT(pkg, i)));
+			R_tryEval(call, R_GlobalEnv, &err);
+		}
+		UNPROTECT(1);
+	}
+	gl = VECTOR_ELT(sv, 0);
+	nm = getAttrib(gl, R_NamesSymbol);
+	if (TYPEOF(nm) == STRSXP) {
+		int i, n = LENGTH(gl);
+		for (i = 0; i < n; i++)
+			defineVar(install(translateChar(STRING_ELT(nm, i))), VECTOR_ELT(gl, i), R_GlobalEnv);
+	}
+	UNPROTECT(1);
+	RSEprintf("session %d: restored in %.3fs\n", (int) getpid(), time_diff(&t0));
+	sendResp(arg, RESP_OK);
+}
+
+/* --- asynchronous jobs ---
+
+   A job is submitted by a child like a detached session: it registers
+   the job key and one end of a socket pair with the master, sends the
+   key to the client and closes the connection. The master starts the
+   job by sending a byte on the pair (see job.max) and the job reports
+   back the result state and CPU time once it has stored the result in
+   <workdir>/jobs. Other connections ask the master for the job state
+   by sending SREG_QUERY with a socket for the reply. */
+
+static double cpu_time() {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0.0;
+	return (double) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+		((double) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)) / 1000000.0;
+}
+
+/* submits the parsed expression(s) xp as a job. On success the
+   connection is closed and this process evaluates the job once the
+   server starts it. Returns 0 on success or -1 (after sending the error
+   response) if the job cannot be submitted. */
+static int submit_job(args_t *arg, SEXP xp) {
+	server_t *srv = arg->srv;
+	session_reg_t reg;
+	job_info_t ji;
+	struct jsresp {
+		int pt;
+		unsigned char key[SESSION_KEY_LEN];
+	} jsr;
+	char fn[1024], tmp[1100], c;
+	int ch[2], n, err = 0;
+	double cpu0;
+	SEXP res = R_NilValue;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.type = SREG_JOB;
+	reg.peer = socket_peer(arg->s);
+	session_random(reg.key, SESSION_KEY_LEN);
+	if (session_sv[1] == -1 || session_file(fn, sizeof(fn), "jobs", reg.key)) {
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_unavailable));
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ch)) {
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_IOerror));
+		return -1;
+	}
+	if (send_fd(session_sv[1], ch[0], &reg, sizeof(reg)) != sizeof(reg)) {
+		close(ch[0]);
+		close(ch[1]);
+		sendResp(arg, SET_STAT(RESP_ERR, ERR_unavailable));
+		return -1;
+	}
+	close(ch[0]);
+	close(session_sv[1]); /* this process belongs to the job now */
+	session_sv[1] = -1;
+
+	jsr.pt = itop(SET_PAR(DT_BYTESTREAM, SESSION_KEY_LEN));
+	memcpy(jsr.key, reg.key, SESSION_KEY_LEN);
+	sendRespData(arg, RESP_OK, sizeof(jsr), &jsr);
+	server_flush(arg);
+	closesocket(arg->s);
+	arg->s = -1;
+
+	/* wait for the server to start the job (EOF = cancelled) */
+	while ((n = recv(ch[1], &c, 1, 0)) < 0 && errno == EINTR) {}
+	if (n != 1) {
+		close(ch[1]);
+		return 0;
+	}
+#ifdef RSERV_DEBUG
+	printf("job: started\n");
+#endif
+	cpu0 = cpu_time();
+	if (TYPEOF(xp) == EXPRSXP) {
+		int i;
+		for (i = 0; i < LENGTH(xp) && !err; i++)
+			res = R_tryEval(VECTOR_ELT(xp, i), R_GlobalEnv, &err);
+	} else
+		res = R_tryEval(xp, R_GlobalEnv, &err);
+	if (err) { /* the result of a failed job is the error message as "try-error" like try() */
+		int err2 = 0;
+		res = R_tryEval(lang1(install("geterrmessage")), R_GlobalEnv, &err2);
+		if (err2 || TYPEOF(res) != STRSXP)
+			res = mkString("");
+		PROTECT(res);
+		setAttrib(res, R_ClassSymbol, mkString("try-error"));
+		UNPROTECT(1);
+	}
+	PROTECT(res);
+	ji.state = err ? JOB_FAILED : JOB_DONE;
+	ji.cpu = cpu_time() - cpu0;
+	ji.wall = 0.0;
+	snprintf(tmp, sizeof(tmp), "%s/jobs", workdir);
+	mkdir(tmp, 0700);
+	snprintf(tmp, sizeof(tmp), "%s.%d", fn, (int) getpid());
+	{
+		mode_t om = umask(077);
+		int err2 = 0;
+		R_tryEval(lang3(install("saveRDS"), res, mkString(tmp)), R_GlobalEnv, &err2);
+		umask(om);
+		if (err2 || rename(tmp, fn)) {
+			RSEprintf("WARNING: cannot store the job result in '%s'\n", fn);
+			unlink(tmp);
+			ji.state = 0;
+		}
+	}
+	UNPROTECT(1);
+#ifdef RSERV_DEBUG
+	printf("job: finished (state %d, %.3fs CPU)\n", ji.state, ji.cpu);
+#endif
+#ifdef MSG_NOSIGNAL
+	send(ch[1], (char*) &ji, sizeof(ji), MSG_NOSIGNAL);
+#else
+	send(ch[1], (char*) &ji, sizeof(ji), 0);
+#endif
+	close(ch[1]);
+	return 0;
+}
+
+/* asks the server for the state of the job with the given key */
+static int query_job(args_t *arg, const unsigned char *key, job_info_t *ji) {
+	session_reg_t reg;
+	struct pollfd pfd;
+	int q[2], n;
+
+	memset(ji, 0, sizeof(*ji));
+	if (session_sv[1] == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, q))
+		return -1;
+	memset(&reg, 0, sizeof(reg));
+	memcpy(reg.key, key, SESSION_KEY_LEN);
+	reg.peer = socket_peer(arg->s);
+	reg.type = SREG_QUERY;
+	n = send_fd(session_sv[1], q[0], &reg, sizeof(reg));
+	close(q[0]);
+	pfd.fd = q[1];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (n != sizeof(reg) || poll(&pfd, 1, 10000) < 1 ||
+		recv(q[1], (char*) ji, sizeof(*ji), MSG_WAITALL) != sizeof(*ji))
+		n = -1;
+	close(q[1]);
+	return (n == -1) ? -1 : 0;
+}
+
+/* list(state, cpu, wall) as returned by CMD_jobPoll */
+static SEXP job_state(job_info_t *ji) {
+	static const char *state_names[] = { "unknown", "queued", "running", "done", "failed" };
+	SEXP res = PROTECT(allocVector(VECSXP, 3)), nm = allocVector(STRSXP, 3);
+	setAttrib(res, R_NamesSymbol, nm);
+	SET_STRING_ELT(nm, 0, mkChar("state"));
+	SET_STRING_ELT(nm, 1, mkChar("cpu"));
+	SET_STRING_ELT(nm, 2, mkChar("wall"));
+	SET_VECTOR_ELT(res, 0, mkString(state_names[(ji->state >= 0 && ji->state <= JOB_FAILED) ? ji->state : 0]));
+	SET_VECTOR_ELT(res, 1, ScalarReal((ji->state == JOB_DONE || ji->state == JOB_FAILED) ? ji->cpu : NA_REAL));
+	SET_VECTOR_ELT(res, 2, ScalarReal((ji->state == JOB_QUEUED) ? NA_REAL : ji->wall));
+	UNPROTECT(1);
+	return res;
+}
+
+/* reads the stored result of a finished job, NULL on error */
+static SEXP fetch_job(const unsigned char *key) {
+	char fn[1024];
+	int err = 0;
+	SEXP res;
+	if (session_file(fn, sizeof(fn), "jobs", key))
+		return 0;
+	res = R_tryEval(lang2(install("readRDS"), mkString(fn)), R_GlobalEnv, &err);
+	return err ? 0 : res;
+}
+
+/* --- master side of session resumption --- */
+
+/* connections held back while waiting for a session key */
+typedef struct pending_conn {
+	struct args *a;
+	struct timeval deadline;
+	struct pending_conn *next;
+} pending_conn_t;
+
+static pending_conn_t *pending;
+
+/* the registry holds both detached sessions and jobs */
+static int detached_sessions, queued_jobs, running_jobs;
+
+void Rserve_QAP1_connected(void *thp);
+
+/* creates the channel children use to register detached sessions */
+static void session_init() {
+	if (session_sv[0] == -1 && !is_child && !socketpair(AF_UNIX, SOCK_DGRAM, 0, session_sv))
+		fcntl(session_sv[0], F_SETFL, fcntl(session_sv[0], F_GETFL) | O_NONBLOCK);
+}
+
+/* closes all descriptors only the master should hold, called in new children */
+static void session_child_init() {
+	struct sSession *ss;
+	if (session_sv[0] != -1) {
+		close(session_sv[0]);
+		session_sv[0] = -1;
+	}
+	while ((ss = first_session())) {
+		if (ss->s != -1)
+			close(ss->s);
+		free_session((char*) ss->key);
+	}
+	detached_sessions = queued_jobs = running_jobs = 0;
+	while (pending) {
+		pending_conn_t *p = pending;
+		pending = p->next;
+		closesocket(p->a->s);
+		free(p->a);
+		free(p);
+	}
+}
+
+static void job_send(int fd, const void *buf, int len) {
+#ifdef MSG_NOSIGNAL
+	send(fd, (const char*) buf, len, MSG_NOSIGNAL);
+#else
+	send(fd, (const char*) buf, len, 0);
+#endif
+}
+
+/* starts queued jobs in the order of submission while fewer than
+   job_max jobs are running */
+static void job_start_queued() {
+	struct sSession *ss = first_session();
+	while (ss && queued_jobs > 0 && (job_max <= 0 || running_jobs < job_max)) {
+		if (ss->job == JOB_QUEUED) {
+			job_send(ss->s, "S", 1);
+			ss->job = JOB_RUNNING;
+			ss->started = wall_time();
+			queued_jobs--;
+			running_jobs++;
+		}
+		ss = next_session(ss);
+	}
+}
+
+/* checks whether a queued or running job has finished: the job sends
+   job_info_t when it is done, EOF alone means that it has died */
+static void job_update(struct sSession *ss) {
+	job_info_t ji;
+	struct pollfd pfd;
+	int n;
+	if (ss->job != JOB_QUEUED && ss->job != JOB_RUNNING)
+		return;
+	pfd.fd = ss->s;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) < 1)
+		return;
+	n = recv(ss->s, (char*) &ji, sizeof(ji), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ss->job == JOB_RUNNING)
+		running_jobs--;
+	else
+		queued_jobs--;
+	ss->finished = wall_time();
+	if (!ss->started)
+		ss->started = ss->finished;
+	ss->job = (n == sizeof(ji) && ji.state == JOB_DONE) ? JOB_DONE : JOB_FAILED;
+	ss->cpu = (n == sizeof(ji)) ? ji.cpu : 0.0;
+	ss->last_used = time(0); /* the result is kept for job_retention from now */
+	close(ss->s);
+	ss->s = -1;
+#ifdef RSERV_DEBUG
+	printf("job: finished with state %d\n", ss->job);
+#endif
+	job_start_queued();
+}
+
+/* replies to SREG_QUERY */
+static void job_reply(int fd, const session_reg_t *reg) {
+	job_info_t ji;
+	struct sSession *ss = find_session((char*) reg->key);
+	memset(&ji, 0, sizeof(ji));
+	if (ss && ss->job && (!ss->peer || ss->peer == reg->peer)) {
+		job_update(ss);
+		ji.state = ss->job;
+		ji.cpu = ss->cpu;
+		if (ss->job == JOB_RUNNING)
+			ji.wall = wall_time() - ss->started;
+		else if (ss->job != JOB_QUEUED) {
+			char fn[1024];
+			ji.wall = ss->finished - ss->started;
+			/* the file sweep goes by the time of the last poll as well */
+			if (!session_file(fn, sizeof(fn), "jobs", ss->key))
+				utimes(fn, 0);
+		}
+	}
+	job_send(fd, &ji, sizeof(ji));
+}
+
+/* reads registrations of detached sessions and jobs and job queries */
+static void session_register() {
+	session_reg_t reg;
+	int fd, n;
+	if (session_sv[0] == -1)
+		return;
+	while ((n = recv_fd(session_sv[0], &fd, &reg, sizeof(reg))) > 0) {
+		struct sSession *ss;
+		if (fd == -1)
+			continue;
+		if (n == sizeof(reg) && reg.type == SREG_QUERY) {
+			job_reply(fd, &reg);
+			close(fd);
+			continue;
+		}
+		if (n != sizeof(reg) || !(ss = new_session((char*) reg.key))) {
+			close(fd);
+			continue;
+		}
+		ss->s = fd;
+		ss->peer = reg.peer;
+		if (reg.type == SREG_JOB) {
+			ss->job = JOB_QUEUED;
+			queued_jobs++;
+			job_start_queued();
+		} else
+			detached_sessions++;
+#ifdef RSERV_DEBUG
+		printf("session: registered %s (%d total)\n", ss->job ? "job" : "detached session", total_sessions());
+#endif
+	}
+}
+
+/* called for expired sessions and jobs */
+static void session_close(struct sSession *ss) {
+	if (ss->s != -1)
+		close(ss->s);
+	if (!ss->job)
+		detached_sessions--;
+	else if (ss->job == JOB_QUEUED)
+		queued_jobs--;
+	else if (ss->job == JOB_RUNNING)
+		running_jobs--;
+	else {
+		char fn[1024];
+		if (!session_file(fn, sizeof(fn), "jobs", ss->key))
+			unlink(fn);
+	}
+}
+
+/* removes files in <workdir>/<dir> older than age seconds: hibernated
+   sessions that have not been attached and job results that have not
+   been polled (including those left over from a previous server) */
+static void session_expire_files(const char *dir, long age) {
+	char path[1100];
+	struct dirent *de;
+	struct stat st;
+	time_t now = time(0);
+	DIR *d;
+	int n;
+	if (!workdir)
+		return;
+	n = snprintf(path, sizeof(path), "%s/%s/", workdir, dir);
+	if (n < 0 || n >= sizeof(path) - 1 || !(d = opendir(path)))
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) + n >= sizeof(path))
+			continue;
+		strcpy(path + n, de->d_name);
+		if (!stat(path, &st) && S_ISREG(st.st_mode) && now - st.st_mtime > age)
+			unlink(path);
+	}
+	closedir(d);
+}
+
+/* removes sessions whose child is gone (the child never writes to
+   the pair, so the descriptor only becomes readable on EOF) and sessions
+   that have been idle for too long (which makes their child exit) as
+   well as finished jobs that have not been polled for job_retention
+   seconds. It is done at most every 5 seconds. */
+static void session_sweep() {
+	static time_t last_sweep, last_file_sweep;
+	struct sSession *ss = first_session();
+	time_t now = time(0);
+	if (now - last_file_sweep >= 60) {
+		last_file_sweep = now;
+		if (session_hibernate > 0 && session_timeout > 0)
+			session_expire_files("sessions", session_timeout);
+		/* with some slack so the table entry goes first */
+		if (job_retention > 0)
+			session_expire_files("jobs", job_retention + 60);
+	}
+	if (!ss || now - last_sweep < 5)
+		return;
+	last_sweep = now;
+	while (ss) {
+		struct sSession *next = next_session(ss);
+		struct pollfd pfd;
+		if (ss->job) {
+			job_update(ss);
+			if (ss->job != JOB_QUEUED && ss->job != JOB_RUNNING &&
+				job_retention > 0 && now - ss->last_used > job_retention) {
+				session_close(ss);
+				free_session((char*) ss->key);
+			}
+			ss = next;
+			continue;
+		}
+		pfd.fd = ss->s;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0) {
+			close(ss->s);
+			free_session((char*) ss->key);
+			detached_sessions--;
+		} else if (session_timeout > 0 && now - ss->last_used > session_timeout) {
+			session_close(ss);
+			free_session((char*) ss->key);
+		}
+		ss = next;
+	}
+}
+
+/* While there are detached sessions, new plain QAP connections are held
+   back for up to session_wait ms since a resuming client sends its key
+   right away, while regular clients wait for the ID string. Returns 1
+   if the connection was held back. */
+static int session_hold(struct args *a) {
+	pending_conn_t *p;
+	session_register(); /* the session may have been detached just now */
+	if (!detached_sessions || session_wait <= 0 || a->srv->connected != Rserve_QAP1_connected ||
+		(a->srv->flags & (SRV_TLS | SRV_QAP_OC)) || !(p = (pending_conn_t*) malloc(sizeof(pending_conn_t))))
+		return 0;
+	gettimeofday(&p->deadline, 0);
+	p->deadline.tv_sec += session_wait / 1000;
+	p->deadline.tv_usec += (session_wait % 1000) * 1000;
+	if (p->deadline.tv_usec >= 1000000) {
+		p->deadline.tv_sec++;
+		p->deadline.tv_usec -= 1000000;
+	}
+	p->a = a;
+	p->next = pending;
+	pending = p;
+	return 1;
+}
+
+/* adds session descriptors to the select() set and shortens the timeout
+   to the earliest deadline of held connections. Returns the new maxfd */
+static int session_fdset(fd_set *rfds, int maxfd, struct timeval *timv) {
+	pending_conn_t *p = pending;
+	struct timeval now;
+	if (session_sv[0] != -1) {
+		FD_SET(session_sv[0], rfds);
+		if (session_sv[0] > maxfd) maxfd = session_sv[0];
+	}
+	if (queued_jobs || running_jobs) { /* jobs that don't fit are picked up by session_sweep() */
+		struct sSession *ss;
+		for (ss = first_session(); ss; ss = next_session(ss))
+			if ((ss->job == JOB_QUEUED || ss->job == JOB_RUNNING) && ss->s < FD_SETSIZE) {
+				FD_SET(ss->s, rfds);
+				if (ss->s > maxfd) maxfd = ss->s;
+			}
+	}
+	if (!p)
+		return maxfd;
+	gettimeofday(&now, 0);
+	while (p) {
+		long us = (p->deadline.tv_sec - now.tv_sec) * 1000000L + (p->deadline.tv_usec - now.tv_usec);
+		if (p->a->s < FD_SETSIZE) {
+			FD_SET(p->a->s, rfds);
+			if (p->a->s > maxfd) maxfd = p->a->s;
+		} else if (us > 10000) /* cannot select on it, so check it regularly */
+			us = 10000;
+		if (us < 0) us = 0;
+		if (us < timv->tv_sec * 1000000L + timv->tv_usec) {
+			timv->tv_sec = us / 1000000L;
+			timv->tv_usec = us % 1000000L;
+		}
+		p = p->next;
+	}
+	return maxfd;
+}
+
+/* passes the connection to the detached session with the given key
+   (if it exists and the client has the same address) */
+static void session_resume(struct args *a, const unsigned char *key) {
+	struct sSession *ss;
+	session_register();
+	ss = find_session((char*) key);
+	if (ss && !ss->job && (!ss->peer || (!a->srv->unix_socket && a->sa.sin_addr.s_addr == ss->peer))) {
 #ifdef RSERV_DEBUG
-				printf("session: wrong key, closing\n");
+		printf("session: passing connection to the detached session\n");
 #endif
-				closesocket(s);
-			} else {
+		send_fd(ss->s, a->s, "R", 1);
+		close(ss->s);
+		free_session((char*) key);
+		detached_sessions--;
+	}
 #ifdef RSERV_DEBUG
-				printf("session: accepted\n");
+	else printf("session: invalid session key or peer address, closing connection\n");
 #endif
-				return s;
+	closesocket(a->s);
+	free(a);
+}
+
+/* processes registrations, finished jobs and held connections: those
+   that sent a key are resumed, those past the deadline are served as
+   regular connections */
+static void session_process(fd_set *rfds) {
+	pending_conn_t **pp = &pending;
+	struct timeval now;
+	if (rfds && session_sv[0] != -1 && FD_ISSET(session_sv[0], rfds))
+		session_register();
+	if (rfds && (queued_jobs || running_jobs)) {
+		struct sSession *ss = first_session();
+		while (ss) {
+			struct sSession *next = next_session(ss);
+			if ((ss->job == JOB_QUEUED || ss->job == JOB_RUNNING) && ss->s < FD_SETSIZE && FD_ISSET(ss->s, rfds))
+				job_update(ss);
+			ss = next;
+		}
+	}
+	if (!pending)
+		return;
+	gettimeofday(&now, 0);
+	while (*pp) {
+		pending_conn_t *p = *pp;
+		struct args *a = p->a;
+		int expired = (now.tv_sec > p->deadline.tv_sec || (now.tv_sec == p->deadline.tv_sec && now.tv_usec >= p->deadline.tv_usec));
+		struct pollfd pfd;
+		pfd.fd = a->s;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0) {
+			unsigned char key[SESSION_KEY_LEN];
+			int n = recv(a->s, (char*) key, SESSION_KEY_LEN, MSG_PEEK);
+			if (n > 0 && n < SESSION_KEY_LEN && !expired) { /* wait for the rest of the key */
+				pp = &p->next;
+				continue;
 			}
+			*pp = p->next;
+			free(p);
+			if (n == SESSION_KEY_LEN && recv(a->s, (char*) key, SESSION_KEY_LEN, 0) == SESSION_KEY_LEN)
+				session_resume(a, key);
+			else {
+				closesocket(a->s);
+				free(a);
+			}
+			continue;
 		}
+		if (expired) { /* a regular client */
+			*pp = p->next;
+			free(p);
+			a->srv->connected(a);
+			if (is_child) /* see serverLoop() */
+				exit(2);
+			continue;
+		}
+		pp = &p->next;
 	}
-	return -1;
 }
+#else
+#define session_hold(A) 0
+#endif
 
 #ifdef WIN32
 # include <process.h>
@@ -1580,6 +2623,98 @@ SEXP Rserve_oobSend(SEXP exp, SEXP code) {
 	return ScalarLogical(send_oob_sexp(OOB_USR_CODE(oob_code) | OOB_SEND, exp) == 1 ? TRUE : FALSE);
 }
 
+/* pub/sub hub: the child subscribes its WebSocket client to a channel,
+   messages published to the channel (by any child or the master) are
+   encoded once as OOB_SEND WebSocket frames and relayed by the master */
+static const char *hub_channel(SEXP sChannel) {
+	if (TYPEOF(sChannel) != STRSXP || LENGTH(sChannel) != 1 || STRING_ELT(sChannel, 0) == R_NaString)
+		Rf_error("channel must be a string");
+	return CHAR(STRING_ELT(sChannel, 0));
+}
+
+SEXP Rserve_subscribe(SEXP sChannel) {
+	const char *channel = hub_channel(sChannel);
+	if (!self_args || !WS_is_connection(self_args))
+		Rf_error("channels can only be subscribed to from code evaluated inside an Rserve WebSocket client instance");
+	if (!enable_oob) Rf_error("OOB command is disallowed by the current Rserve configuration - use 'oob enable' to allow its use");
+	if (hub_child_fd() == -1)
+		Rf_error("the pub/sub hub is not available - use 'hub enable' to enable it");
+	if (hub_send(HUB_SUBSCRIBE, channel, 0, 0))
+		Rf_error("unable to subscribe, the connection to the server has been lost");
+	return ScalarLogical(TRUE);
+}
+
+SEXP Rserve_unsubscribe(SEXP sChannel) {
+	const char *channel = (sChannel == R_NilValue) ? "" : hub_channel(sChannel);
+	if (hub_child_fd() != -1 && hub_send(HUB_UNSUBSCRIBE, channel, 0, 0))
+		Rf_error("unable to unsubscribe, the connection to the server has been lost");
+	return ScalarLogical(TRUE);
+}
+
+SEXP Rserve_publish(SEXP sChannel, SEXP exp, SEXP code) {
+	const char *channel = hub_channel(sChannel);
+	int oob_code = asInteger(code), res;
+	char *buf, *sxh, *head, *tail;
+	unsigned char fh[10];
+	struct phdr ph;
+	rlen_t rs, ll;
+
+	if (!hub_enabled())
+		Rf_error("the pub/sub hub is disabled by the current Rserve configuration - use 'hub enable' to allow its use");
+	rs = QAP_getStorageSize(exp);
+	rs += (rs >> 2); /* same safety margin as in send_oob_sexp() */
+	/* leave space for the WS frame header (up to 10 bytes), the message
+	   header and the data header in front of the SEXP so the whole
+	   frame is contiguous */
+	buf = (char*) malloc(rs + 40);
+	if (!buf)
+		Rf_error("Unable to allocate large enough buffer to send the object");
+	sxh = buf + 40;
+	tail = (char*) QAP_storeSEXP((unsigned int*)sxh, exp, rs);
+	ll = tail - sxh;
+	if (ll > 0xfffff0) { /* we must use the "long" format */
+		head = sxh - 8;
+		((unsigned int*)head)[0] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
+		((unsigned int*)head)[1] = itop(ll >> 24);
+	} else {
+		head = sxh - 4;
+		((unsigned int*)head)[0] = itop(SET_PAR(DT_SEXP, ll));
+	}
+	memset(&ph, 0, sizeof(ph));
+	ph.cmd = itop(OOB_SEND | OOB_USR_CODE(oob_code));
+	ph.len = itop(tail - head);
+#ifdef __LP64__
+	ph.res = itop((tail - head) >> 32);
+#endif
+	head -= sizeof(ph);
+	memcpy(head, &ph, sizeof(ph));
+	res = WS_frame_header(fh, 2, tail - head);
+	head -= res;
+	memcpy(head, fh, res);
+#ifdef RSERV_DEBUG
+	printf("publishing %ld bytes (frame) to '%s'\n", (long) (tail - head), channel);
+#endif
+	res = hub_send(HUB_PUBLISH, channel, head, tail - head);
+	free(buf);
+	if (res)
+		Rf_error("unable to publish, the connection to the server has been lost");
+	return ScalarLogical(TRUE);
+}
+
+SEXP Rserve_tlsStats() {
+	double val[32];
+	const char *names[32];
+	int i, n = tls_stats(val, names, 32);
+	SEXP res = PROTECT(allocVector(REALSXP, n)), nam = allocVector(STRSXP, n);
+	setAttrib(res, R_NamesSymbol, nam);
+	for (i = 0; i < n; i++) {
+		REAL(res)[i] = val[i];
+		SET_STRING_ELT(nam, i, mkChar(names[i]));
+	}
+	UNPROTECT(1);
+	return res;
+}
+
 SEXP Rserve_oobMsg(SEXP exp, SEXP code) {
 	struct phdr ph;
 	int oob_code = asInteger(code), n;
@@ -1723,13 +2858,17 @@ static void restore_signal_handlers(); /* forward decl */
 int Rserve_prepare_child(args_t *arg) {
 #ifdef FORKED  
 #ifdef unix
-	int cinp[2];
+	int cinp[2], hsv[2];
 #endif
 	long rseed = random();
     rseed ^= time(0);
 	
 	parent_pipe = -1;
 	cinp[0] = -1;
+	hsv[0] = -1;
+
+	if (!is_child && hub_pair(hsv))
+		hsv[0] = -1;
 
 #if 0 /* currenlty we disable controls in sub-protocols */
 	/* we use the input pipe only if child control is enabled. disabled pipe means no registration */
@@ -1740,6 +2879,13 @@ int Rserve_prepare_child(args_t *arg) {
     if ((lastChild = RS_fork(arg)) != 0) { /* parent/master part */
 		/* close the connection socket - the child has it already */
 		closesocket(arg->s);
+		if (hsv[0] != -1) {
+			close(hsv[1]);
+			if (lastChild > 0)
+				hub_add_peer(hsv[0], lastChild);
+			else
+				close(hsv[0]);
+		}
 		if (cinp[0] != -1) { /* if we have a valid pipe register the child */
 			child_process_t *cp = (child_process_t*) malloc(sizeof(child_process_t));
 			close(cinp[1]); /* close the write end which is what the child will be using */
@@ -1766,11 +2912,16 @@ int Rserve_prepare_child(args_t *arg) {
 		parent_pipe = cinp[1];
 		close(cinp[0]);
 	}
+	if (hsv[0] != -1) {
+		close(hsv[0]);
+		hub_child_init(hsv[1]);
+	}
 
     srandom(rseed);
     
     parentPID = getppid();
     close_all_srv_sockets(); /* close all server sockets - this includes arg->ss */
+	session_child_init();
 
 #ifdef CAN_TCP_NODELAY
     {
@@ -1788,34 +2939,110 @@ int Rserve_prepare_child(args_t *arg) {
 	return 0;
 }
 
+/* output of the text protocol is sent in fragments as the buffer fills up */
+static int text_flush(json_out_t *o, const char *buf, rlen_t len) {
+	return WS_send_fragment((args_t*) o->ctx, buf, len, 0);
+}
+
+/* sends the result of the text protocol: exp encoded as JSON (or the
+   elements of the character vector exp separated by \n in text mode)
+   or the error message if error is set. The output is streamed through
+   the buffer in o, so its size doesn't matter. */
+static void text_send(args_t *arg, json_out_t *o, SEXP exp, const char *error) {
+	o->len = 0;
+	o->err = 0;
+	if (error) {
+		if (ws_text_json) {
+			json_write(o, "{\"error\":", 9);
+			json_string(o, error);
+			json_write(o, "}", 1);
+		} else {
+			json_write(o, "ERROR: ", 7);
+			json_write(o, error, strlen(error));
+			json_write(o, "\n", 1);
+		}
+	} else if (ws_text_json)
+		json_encode(o, exp);
+	else {
+		R_xlen_t i = 0, l = XLENGTH(exp);
+		while (i < l && !o->err) {
+			const void *vmax = vmaxget();
+			const char *c = Rf_translateCharUTF8(STRING_ELT(exp, i));
+			json_write(o, c, strlen(c));
+			vmaxset(vmax);
+			if (++i < l)
+				json_write(o, "\n", 1);
+		}
+	}
+	if (!o->err && WS_send_fragment(arg, o->buf, o->len, 1))
+		o->err = 1;
+#ifdef RSERV_DEBUG
+	if (o->err)
+		fprintf(stderr, "text_send: write failed\n");
+#endif
+}
+
+#define TEXT_BUF_INIT  65536 /* initial size of the input buffer */
+#define TEXT_OBUF_SIZE 65536 /* output is sent in fragments of this size */
+
 /* text protocol (exposed by WS) */
 void Rserve_text_connected(void *thp) {
 	args_t *arg = (args_t*) thp;
 	server_t *srv = arg->srv;
-	int bl = 1024*1024, bp = 0, n;
+	rlen_t bl = TEXT_BUF_INIT, bp = 0;
+	int n;
     ParseStatus stat;
-
-	char *buf = (char*) malloc(bl--);
-	if (!buf) {
+	json_out_t ob;
+	char msg[128];
+
+	char *buf = (char*) malloc(bl);
+	memset(&ob, 0, sizeof(ob));
+	ob.size = TEXT_OBUF_SIZE;
+	ob.flush = text_flush;
+	ob.ctx = arg;
+	ob.buf = (char*) malloc(ob.size);
+	if (!buf || !ob.buf) {
 		RSEprintf("ERROR: cannot allocate buffer\n");
+		if (buf) free(buf);
+		if (ob.buf) free(ob.buf);
 		return;
 	}
 
 	self_args = arg;
 	
-	snprintf(buf, bl, "OK\n");
-	srv->send(arg, buf, strlen(buf));
+	srv->send(arg, "OK\n", 3);
 
-	while ((n = srv->recv(arg, buf + bp, bl - bp)) > 0) {
+	while ((n = srv->recv(arg, buf + bp, bl - bp - 1)) > 0) {
 		bp += n;
-		if (!(arg->flags & F_INFRAME)) { /* end of frame */
+		if (arg->flags & F_INFRAME) { /* continuation of a frame */
+			if (bp + 1 >= bl) { /* grow the buffer up to maxinbuf */
+				rlen_t nbl = bl * 2;
+				char *nb = 0;
+				if (maxInBuf && nbl > maxInBuf)
+					nbl = maxInBuf;
+				if (nbl > bl)
+					nb = (char*) realloc(buf, nbl);
+				if (nb) {
+					buf = nb;
+					bl = nbl;
+				} else {
+					RSEprintf("WARNING: frame exceeds max size, ignoring\n");
+					while ((arg->flags & F_INFRAME) && srv->recv(arg, buf, bl) > 0) ;
+					text_send(arg, &ob, R_NilValue, "frame exceeds max size");
+					bp = 0;
+				}
+			}
+			continue;
+		}
+		/* end of frame */
+		{
 			SEXP xp;
 			int parts;
 			buf[bp] = 0;
 			xp = parseString(buf, &parts, &stat);
 			if (stat != PARSE_OK) {
-				snprintf(buf, bl, "ERROR: Parse error: %s\n", getParseName(stat));
-				srv->send(arg, buf, strlen(buf));
+				snprintf(msg, sizeof(msg), "Parse error: %s", getParseName(stat));
+				text_send(arg, &ob, R_NilValue, msg);
 			} else {
 				SEXP exp = R_NilValue;
 				int err = 0;
@@ -1837,51 +3064,31 @@ void Rserve_text_connected(void *thp) {
 					}
 				} else
 					exp = R_tryEval(xp, R_GlobalEnv, &err);
-				if (!err && TYPEOF(exp) != STRSXP)
+				/* JSON is encoded directly from the result, text needs a character vector */
+				if (!err && !ws_text_json && TYPEOF(exp) != STRSXP)
 					exp = R_tryEval(lang2(install("as.character"), exp), R_GlobalEnv, &err);
-				if (!err && TYPEOF(exp) == STRSXP) {
-					int i = 0, l = LENGTH(exp);
-					long tl = 0;
-					char *sb = buf;
-					while (i < l) {
-						tl += strlen(Rf_translateCharUTF8(STRING_ELT(exp, i))) + 1;
-						i++;
-					}
-					if (tl > bl) {
-						sb = (char*) malloc(tl);
-						if (!sb) {
-							RSEprintf("ERROR: cannot allocate buffer for the result string\n");
-							snprintf(buf, bl, "ERROR: cannot allocate buffer for the result string\n");
-							srv->send(arg, buf, strlen(buf));
-						}
-					}
-					if (sb) {
-						tl = 0;
-						for (i = 0; i < l; i++) {
-							strcpy(sb + tl, Rf_translateCharUTF8(STRING_ELT(exp, i)));
-							tl += strlen(sb + tl);
-							if (i < l - 1) sb[tl++] = '\n';
-						}
-						srv->send(arg, sb, tl);
-						if (sb != buf) free(sb);
-					}
-				} else {
-					if (err)
-						snprintf(buf, bl, "ERROR: evaluation error %d\n", err);
-					else
-						snprintf(buf, bl, "ERROR: result cannot be coerced into character\n");
-					srv->send(arg, buf, strlen(buf));
-				}
+				PROTECT(exp);
+				if (err) {
+					snprintf(msg, sizeof(msg), "evaluation error %d", err);
+					text_send(arg, &ob, R_NilValue, msg);
+				} else if (!ws_text_json && TYPEOF(exp) != STRSXP)
+					text_send(arg, &ob, R_NilValue, "result cannot be coerced into character");
+				else
+					text_send(arg, &ob, exp, 0);
+				UNPROTECT(2);
 			}
-			bp = 0;
-		} else { /* continuation of a frame */
-			if (bp >= bl) {
-				RSEprintf("WARNING: frame exceeds max size, ignoring\n");
-				while ((arg->flags & F_INFRAME) && srv->recv(arg, buf, bl) > 0) ;
-				bp = 0;
+		}
+		bp = 0;
+		if (bl > TEXT_BUF_INIT) { /* don't hold on to the memory of a large request */
+			char *nb = (char*) realloc(buf, TEXT_BUF_INIT);
+			if (nb) {
+				buf = nb;
+				bl = TEXT_BUF_INIT;
 			}
 		}
 	}
+	free(ob.buf);
+	free(buf);
 }
 
 static char auth_buf[4096];
@@ -2153,6 +3360,426 @@ static void rm_rf(const char *what) {
 }
 #endif
 
+#ifdef unix
+/* --- asynchronous OC calls ---
+   With oc.workers <n> a connection in OC mode accepts CMD_OCcallAsync.
+   At the first such call the connection process forks <n> workers,
+   so they share the capabilities (and all other state) it has at that
+   point. The calls are queued and passed on to idle workers over a
+   socket pair, each worker evaluates one call at a time and sends back
+   the encoded OOB_OCRESULT payload. Results are forwarded to the client
+   while the connection process is waiting for input, so they may
+   arrive in any order. Capabilities registered by a worker during a
+   call are reported with the result and further calls of them are
+   routed to that worker. Capabilities registered in the connection
+   process after the fork are evaluated there. */
+
+#define OC_TOKEN_SIZE (MAX_OC_TOKEN_LEN + 1)
+
+/* header of messages between the connection process and a worker.
+   A call is followed by len bytes of the encoded call, a result by
+   tokens * OC_TOKEN_SIZE bytes of new capabilities and len bytes of
+   the OOB_OCRESULT payload */
+typedef struct oc_msg {
+	int id, status;
+	unsigned int tokens;
+	rlen_t len;
+} oc_msg_t;
+
+typedef struct oc_call {
+	int id, worker; /* worker the call must run in (-1 = any) */
+	rlen_t len;
+	struct oc_call *next;
+	char data[1];
+} oc_call_t;
+
+typedef struct oc_worker {
+	int fd;   /* -1 if the worker is gone */
+	pid_t pid;
+	int busy, id; /* id of the call being evaluated */
+} oc_worker_t;
+
+static int oc_pool_started, oc_pool_size;
+static oc_worker_t oc_pool[OC_MAX_WORKERS];
+static oc_call_t *oc_queue, **oc_queue_end = &oc_queue;
+static buf_fn_t oc_wire_recv;
+
+/* tokens registered by a worker during the current call */
+static char *oc_tokens;
+static unsigned int oc_ntokens, oc_tokens_size;
+
+static int oc_write_all(int fd, const void *buf, rlen_t len) {
+	const char *c = (const char*) buf;
+	while (len) {
+#ifdef MSG_NOSIGNAL
+		ssize_t n = send(fd, c, len, MSG_NOSIGNAL);
+#else
+		ssize_t n = send(fd, c, len, 0);
+#endif
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int oc_read_all(int fd, void *buf, rlen_t len) {
+	char *c = (char*) buf;
+	while (len) {
+		ssize_t n = recv(fd, c, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* encodes the DT_INT request id followed by exp as DT_SEXP into a
+   malloc()ed buffer, *head is set to the start of the payload */
+static char *oc_async_encode(int id, SEXP exp, char **head, rlen_t *len) {
+	rlen_t rs = QAP_getStorageSize(exp);
+	char *buf, *sxh, *tail;
+	/* same safety margin as in send_oob_sexp() */
+	rs += (rs >> 2);
+	if (!(buf = (char*) malloc(rs + 16)))
+		return 0;
+	sxh = buf + 16;
+	tail = (char*) QAP_storeSEXP((unsigned int*) sxh, exp, rs);
+	if ((tail - sxh) > 0xfffff0) { /* we must use the "long" format */
+		rlen_t ll = tail - sxh;
+		((unsigned int*)buf)[2] = itop(SET_PAR(DT_SEXP | DT_LARGE, ll & 0xffffff));
+		((unsigned int*)buf)[3] = itop(ll >> 24);
+		*head = buf;
+	} else {
+		((unsigned int*)buf)[3] = itop(SET_PAR(DT_SEXP, tail - sxh));
+		*head = buf + 4;
+	}
+	((unsigned int*)*head)[0] = itop(SET_PAR(DT_INT, 4));
+	((unsigned int*)*head)[1] = itop(id);
+	*len = tail - *head;
+	return buf;
+}
+
+/* evaluates an encoded OC call (clen bytes) and encodes its result. Returns the
+   buffer to free (if any), *head and *len are always set to the
+   payload and *status to the error code (0 on success) */
+static char *oc_async_eval(int id, unsigned int *call, rlen_t clen, int *status, char **head, rlen_t *len) {
+	static unsigned int idpar[2];
+	oc_entry_t *oce = 0;
+	int Rerror = 0;
+	SEXP val = oc_decode_call(call, clen, &oce), res = R_NilValue;
+	char *buf = 0;
+
+	*status = 0;
+	if (!val)
+		*status = ERR_inv_par;
+	else {
+		PROTECT(val);
+		if (oc_stats_enabled) {
+			double t0 = wall_time();
+			res = R_tryEval(val, R_GlobalEnv, &Rerror);
+			oc_record(oce, wall_time() - t0, Rerror);
+		} else
+			res = R_tryEval(val, R_GlobalEnv, &Rerror);
+		UNPROTECT(1);
+		if (Rerror)
+			*status = (Rerror < 0) ? Rerror : -Rerror;
+	}
+	if (!*status) {
+		PROTECT(res);
+		if (!(buf = oc_async_encode(id, res, head, len)))
+			*status = ERR_out_of_mem;
+		UNPROTECT(1);
+	}
+	if (*status) {
+		idpar[0] = itop(SET_PAR(DT_INT, 4));
+		idpar[1] = itop(id);
+		*head = (char*) idpar;
+		*len = sizeof(idpar);
+	}
+	return buf;
+}
+
+/* sends a failure of the call id to the client */
+static void oc_async_fail(args_t *a, int id, int err) {
+	unsigned int par[2];
+	par[0] = itop(SET_PAR(DT_INT, 4));
+	par[1] = itop(id);
+	a->srv->send_resp(a, SET_STAT(OOB_OCRESULT, err), sizeof(par), par);
+}
+
+static void oc_collect_token(const char *token) {
+	if (oc_ntokens >= oc_tokens_size) {
+		unsigned int size = oc_tokens_size ? (oc_tokens_size * 2) : 16;
+		char *nt = (char*) realloc(oc_tokens, size * OC_TOKEN_SIZE);
+		if (!nt) /* the capability can then only be called synchronously */
+			return;
+		oc_tokens = nt;
+		oc_tokens_size = size;
+	}
+	memset(oc_tokens + oc_ntokens * OC_TOKEN_SIZE, 0, OC_TOKEN_SIZE);
+	strncpy(oc_tokens + oc_ntokens * OC_TOKEN_SIZE, token, MAX_OC_TOKEN_LEN);
+	oc_ntokens++;
+}
+
+/* worker: evaluates calls until the connection process goes away */
+static void oc_worker_run(int fd) {
+	oc_msg_t m;
+	self_args = 0; /* OOB messages cannot be sent from workers */
+	oc_register_hook = oc_collect_token;
+	while (!oc_read_all(fd, &m, sizeof(m))) {
+		char *buf = (char*) malloc(m.len + 8), *res, *head = 0;
+		rlen_t len = 0;
+		int err;
+		if (!buf || oc_read_all(fd, buf, m.len))
+			break;
+		memset(buf + m.len, 0, 8);
+		oc_ntokens = 0;
+		res = oc_async_eval(m.id, (unsigned int*) buf, m.len, &m.status, &head, &len);
+		free(buf);
+		m.tokens = oc_ntokens;
+		m.len = len;
+		err = oc_write_all(fd, &m, sizeof(m)) || oc_write_all(fd, oc_tokens, m.tokens * OC_TOKEN_SIZE) ||
+			oc_write_all(fd, head, len);
+		free(res);
+		if (err)
+			break;
+	}
+	close(fd);
+}
+
+/* waits for input on a plain or TLS QAP connection while forwarding
+   results of asynchronous calls */
+static int oc_async_recv(args_t *arg, void *buf, rlen_t len) {
+	struct pollfd pfd[OC_MAX_WORKERS + 1];
+	int nw;
+	while (!tls_pending(arg) && (nw = oc_async_fds(pfd + 1, OC_MAX_WORKERS))) {
+		if (server_flush(arg)) /* we may be waiting for a long time */
+			return -1;
+		pfd[0].fd = arg->s;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		if (poll(pfd, nw + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[0].revents) /* input (or an error which recv will report) */
+			break;
+		oc_async_forward(arg, pfd + 1, nw);
+		if (server_flush(arg))
+			return -1;
+	}
+	return oc_wire_recv(arg, buf, len);
+}
+
+/* forks the workers, returns their number */
+static int oc_async_start(args_t *a) {
+	int i, j;
+	oc_pool_started = 1;
+	oc_share_all();
+	for (i = 0; i < oc_workers; i++) {
+		int sv[2];
+		pid_t pid;
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			break;
+		if ((pid = fork()) == 0) {
+			close(sv[0]);
+			for (j = 0; j < i; j++)
+				close(oc_pool[j].fd);
+			closesocket(a->s);
+			oc_worker_run(sv[1]);
+			exit(0);
+		}
+		close(sv[1]);
+		if (pid == -1) {
+			close(sv[0]);
+			break;
+		}
+		oc_pool[i].fd = sv[0];
+		oc_pool[i].pid = pid;
+		oc_pool[i].busy = 0;
+	}
+	oc_pool_size = i;
+	if (!i)
+		RSEprintf("WARNING: cannot start OC workers, asynchronous calls will be evaluated by the connection\n");
+	else if (a->srv->recv == server_recv || (a->srv->flags & SRV_TLS)) {
+		/* WebSockets poll the workers in their own wire layer */
+		oc_wire_recv = a->srv->recv;
+		a->srv->recv = oc_async_recv;
+	}
+#ifdef RSERV_DEBUG
+	printf("started %d OC workers\n", i);
+#endif
+	return i;
+}
+
+static void oc_worker_lost(args_t *a, int w) {
+	oc_worker_t *ow = oc_pool + w;
+	close(ow->fd);
+	ow->fd = -1;
+	kill(ow->pid, SIGKILL);
+	waitpid(ow->pid, 0, 0);
+	RSEprintf("WARNING: OC worker %d (pid %d) has terminated\n", w, (int) ow->pid);
+	if (ow->busy) {
+		ow->busy = 0;
+		oc_async_fail(a, ow->id, ERR_conn_broken);
+	}
+}
+
+/* passes queued calls on to idle workers. Calls that cannot run
+   anymore (their worker is gone) fail. */
+static void oc_dispatch(args_t *a) {
+	oc_call_t **cp = &oc_queue;
+	while (*cp) {
+		oc_call_t *c = *cp;
+		int w = -1, alive = 0, i;
+		for (i = 0; i < oc_pool_size; i++)
+			if (oc_pool[i].fd != -1 && (c->worker == -1 || c->worker == i)) {
+				alive = 1;
+				if (!oc_pool[i].busy) {
+					w = i;
+					break;
+				}
+			}
+		if (w != -1) {
+			oc_msg_t m;
+			m.id = c->id;
+			m.status = 0;
+			m.tokens = 0;
+			m.len = c->len;
+			if (oc_write_all(oc_pool[w].fd, &m, sizeof(m)) || oc_write_all(oc_pool[w].fd, c->data, c->len)) {
+				oc_worker_lost(a, w);
+				continue; /* try again with the remaining workers */
+			}
+			oc_pool[w].busy = 1;
+			oc_pool[w].id = c->id;
+		} else if (alive) { /* wait for the worker */
+			cp = &c->next;
+			continue;
+		} else
+			oc_async_fail(a, c->id, ERR_conn_broken);
+		*cp = c->next;
+		free(c);
+	}
+	oc_queue_end = cp;
+}
+
+/* queues the asynchronous call id (encoded call of len bytes). Returns
+   0 if the call has been queued (or failed) and 1 if it has to be
+   evaluated by the connection process */
+static int oc_async_submit(args_t *a, int id, unsigned int *call, rlen_t len) {
+	oc_entry_t *e;
+	oc_call_t *c;
+	int where;
+	if (!oc_pool_started)
+		oc_async_start(a);
+	e = oc_call_entry(call, len);
+	where = oc_location(e);
+	if (where == OC_LOCAL || (where == OC_SHARED && !oc_pool_size))
+		return 1;
+	if (!(c = (oc_call_t*) malloc(sizeof(oc_call_t) + len))) {
+		oc_async_fail(a, id, ERR_out_of_mem);
+		return 0;
+	}
+	c->id = id;
+	c->worker = (where >= 0) ? where : -1;
+	c->len = len;
+	c->next = 0;
+	memcpy(c->data, call, len);
+	*oc_queue_end = c;
+	oc_queue_end = &c->next;
+	oc_dispatch(a);
+	return 0;
+}
+
+int oc_async_fds(struct pollfd *pfd, int max) {
+	int i, n = 0;
+	for (i = 0; i < oc_pool_size && n < max; i++)
+		if (oc_pool[i].fd != -1 && oc_pool[i].busy) {
+			pfd[n].fd = oc_pool[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			n++;
+		}
+	return n;
+}
+
+void oc_async_forward(args_t *a, struct pollfd *pfd, int n) {
+	int i, w;
+	for (i = 0; i < n; i++) {
+		oc_worker_t *ow;
+		oc_msg_t m;
+		char *buf = 0;
+		unsigned int t;
+		if (!pfd[i].revents)
+			continue;
+		for (w = 0; w < oc_pool_size && oc_pool[w].fd != pfd[i].fd; w++) {}
+		if (w == oc_pool_size)
+			continue;
+		ow = oc_pool + w;
+		if (oc_read_all(ow->fd, &m, sizeof(m)) ||
+			!(buf = (char*) malloc(m.tokens * OC_TOKEN_SIZE + m.len + 1)) ||
+			oc_read_all(ow->fd, buf, m.tokens * OC_TOKEN_SIZE + m.len)) {
+			free(buf);
+			oc_worker_lost(a, w);
+			continue;
+		}
+		ow->busy = 0;
+		for (t = 0; t < m.tokens; t++) {
+			char *token = buf + t * OC_TOKEN_SIZE;
+			token[OC_TOKEN_SIZE - 1] = 0;
+			oc_add_remote(token, w);
+		}
+		a->srv->send_resp(a, m.status ? SET_STAT(OOB_OCRESULT, m.status) : OOB_OCRESULT,
+						  m.len, buf + m.tokens * OC_TOKEN_SIZE);
+		free(buf);
+	}
+	oc_dispatch(a);
+}
+
+/* stops the workers at the end of the connection. Results of calls
+   that are still running have nowhere to go, so busy workers are
+   killed. */
+static void oc_async_close() {
+	int i;
+	for (i = 0; i < oc_pool_size; i++)
+		if (oc_pool[i].fd != -1) {
+			close(oc_pool[i].fd);
+			oc_pool[i].fd = -1;
+			if (oc_pool[i].busy)
+				kill(oc_pool[i].pid, SIGKILL);
+			waitpid(oc_pool[i].pid, 0, 0);
+		}
+	while (oc_queue) {
+		oc_call_t *c = oc_queue;
+		oc_queue = c->next;
+		free(c);
+	}
+	oc_queue_end = &oc_queue;
+}
+#endif
+
+/* returns the encoded SEXP of a DT_SEXP parameter (which may be flagged
+   DT_LARGE like in CMD_setSEXP) and adjusts *len accordingly. Returns
+   NULL if the parameter is not a SEXP */
+static unsigned int *sexp_par(int type, void *par, rlen_t *len) {
+	int boffs = 0;
+	if (type != DT_SEXP && type != (DT_SEXP | DT_LARGE))
+		return 0;
+	if (type & DT_LARGE) boffs++;
+	if (*len < 4 * boffs)
+		return 0;
+	*len -= 4 * boffs;
+	return ((unsigned int*) par) + boffs;
+}
+
 /* FIXME: we are not using Rserve_prepare_child so the behavior may differ between QAP and others! */
 /* working thread/function. the parameter is of the type struct args* */
 /* This server function implements the Rserve QAP1 protocol */
@@ -2187,7 +3814,7 @@ void Rserve_QAP1_connected(void *thp) {
 
 #ifdef unix
     char wdname[512];
-	int cinp[2];
+	int cinp[2], hsv[2];
 #endif
 
 #ifdef FORKED  
@@ -2204,9 +3831,19 @@ void Rserve_QAP1_connected(void *thp) {
 		if ((child_control || self_control) && pipe(cinp) != 0)
 			cinp[0] = -1;
 
+		if (hub_pair(hsv))
+			hsv[0] = -1;
+
 		if ((lastChild = RS_fork(a)) != 0) { /* parent/master part */
 			/* close the connection socket - the child has it already */
 			closesocket(a->s);
+			if (hsv[0] != -1) {
+				close(hsv[1]);
+				if (lastChild > 0)
+					hub_add_peer(hsv[0], lastChild);
+				else
+					close(hsv[0]);
+			}
 			if (cinp[0] != -1) { /* if we have a valid pipe register the child */
 				child_process_t *cp = (child_process_t*) malloc(sizeof(child_process_t));
 				close(cinp[1]); /* close the write end which is what the child will be using */
@@ -2233,11 +3870,16 @@ void Rserve_QAP1_connected(void *thp) {
 			parent_pipe = cinp[1];
 			close(cinp[0]);
 		}
+		if (hsv[0] != -1) {
+			close(hsv[0]);
+			hub_child_init(hsv[1]);
+		}
 		
 		srandom(rseed);
     
 		parentPID = getppid();
 		close_all_srv_sockets(); /* close all server sockets - this includes a->ss */
+		session_child_init();
 		
 		performConfig(SU_CLIENT);
     }
@@ -2421,8 +4063,15 @@ void Rserve_QAP1_connected(void *thp) {
 #endif
 
 			/* in OC mode everything but OCcall is invalid */
-		if ((a->srv->flags & SRV_QAP_OC) && ph.cmd != CMD_OCcall) {
+		if ((a->srv->flags & SRV_QAP_OC) && ph.cmd != CMD_OCcall
+#ifdef unix
+			&& !(ph.cmd == CMD_OCcallAsync && oc_workers > 0)
+#endif
+			) {
 			sendResp(a, SET_STAT(RESP_ERR, ERR_disabled));
+#ifdef unix
+			oc_async_close();
+#endif
 			free(sendbuf); free(sfbuf);
 			closesocket(s);
 			return;
@@ -2555,28 +4204,26 @@ void Rserve_QAP1_connected(void *thp) {
 #endif
 
 		if (ph.cmd == CMD_OCcall) {
-			int valid = 0;
-			SEXP val = R_NilValue;
-			if (pars >= 1 && (parT[0] == DT_SEXP || parT[0] == (DT_SEXP | DT_LARGE))) {
-				int boffs = 0;
-				unsigned int *sptr;
-				if (parT[0] & DT_LARGE) boffs++;
-				sptr = ((unsigned int*)parP[0]) + boffs;
-				val = QAP_decode(&sptr);
-				if (val && TYPEOF(val) == LANGSXP) {
-					SEXP ocref = CAR(val);
-					if (TYPEOF(ocref) == STRSXP && LENGTH(ocref) == 1) {
-						SEXP ocv = oc_resolve(CHAR(STRING_ELT(ocref, 0)));
-						if (ocv && ocv != R_NilValue) {
-							/* valid reference -- replace it in the call */
-							SETCAR(val, ocv);
-							valid = 1;
-						}
-					}
-				}
+			oc_entry_t *oce = 0;
+			SEXP val = 0;
+			unsigned int *call = 0;
+			rlen_t clen = (pars >= 1) ? parL[0] : 0;
+			/* the capability is looked up directly from the encoded
+			   token and replaces it in the call */
+			if (pars >= 1 && (call = sexp_par(parT[0], parP[0], &clen)))
+				val = oc_decode_call(call, clen, &oce);
+#ifdef unix
+			/* capabilities registered by workers can only be called asynchronously */
+			if (!val && call && (oce = oc_call_entry(call, clen)) && oc_location(oce) >= 0) {
+				sendResp(a, SET_STAT(RESP_ERR, ERR_unavailable));
+				continue;
 			}
+#endif
 			/* invalid calls lead to immediate termination with no message */
-			if (!valid) {
+			if (!val) {
+#ifdef unix
+				oc_async_close();
+#endif
 				free(sendbuf); free(sfbuf);
 				closesocket(s);				
 				return;
@@ -2585,12 +4232,46 @@ void Rserve_QAP1_connected(void *thp) {
 #ifdef RSERV_DEBUG
 			printf("  running eval on SEXP (after OC replacement): ");
 			printSEXP(val);
+#endif
+#ifdef unix
+			if (oc_stats_enabled) {
+				double t0 = wall_time();
+				eval_result = R_tryEval(val, R_GlobalEnv, &Rerror);
+				oc_record(oce, wall_time() - t0, Rerror);
+			} else
 #endif
 			eval_result = R_tryEval(val, R_GlobalEnv, &Rerror);
 			UNPROTECT(1);
 			process = 1;
 		}
 
+#ifdef unix
+		if (ph.cmd == CMD_OCcallAsync) {
+			unsigned int *call = 0;
+			rlen_t clen = (pars >= 2) ? parL[1] : 0;
+			int id;
+			/* invalid calls lead to immediate termination with no message */
+			if (pars < 2 || parT[0] != DT_INT || parL[0] < 4 || !(call = sexp_par(parT[1], parP[1], &clen)) ||
+				!oc_call_entry(call, clen)) {
+				oc_async_close();
+				free(sendbuf); free(sfbuf);
+				closesocket(s);
+				return;
+			}
+			id = ptoi(*((int*) parP[0]));
+			if (oc_async_submit(a, id, call, clen)) {
+				/* the capability exists only in this process */
+				char *head = 0, *res;
+				rlen_t len = 0;
+				int status;
+				res = oc_async_eval(id, call, clen, &status, &head, &len);
+				srv->send_resp(a, status ? SET_STAT(OOB_OCRESULT, status) : OOB_OCRESULT, len, head);
+				free(res);
+			}
+			continue;
+		}
+#endif
+
 		if (ph.cmd == CMD_switch) {
 			if (pars < 1 || parT[0] != DT_STRING) 
 				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
@@ -3015,10 +4696,54 @@ void Rserve_QAP1_connected(void *thp) {
 			}
 		}
 	
+#ifdef unix
+		if (ph.cmd == CMD_attachSession) {
+			process = 1;
+			if (pars < 1 || parT[0] != DT_BYTESTREAM || parL[0] != SESSION_KEY_LEN)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else
+				attach_session(a, (const unsigned char*) parP[0]);
+		}
+
+		if (ph.cmd == CMD_jobSubmit) {
+			process = 1;
+			if (pars < 1 || parT[0] != DT_STRING)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else {
+				int j = 0;
+				xp = parseString((char*) parP[0], &j, &stat);
+				PROTECT(xp);
+				if (stat != 1)
+					sendResp(a, SET_STAT(RESP_ERR, stat));
+				else if (!submit_job(a, xp))
+					s = a->s; /* the job is done, the connection was closed */
+				UNPROTECT(1);
+			}
+		}
+
+		if (ph.cmd == CMD_jobPoll || ph.cmd == CMD_jobFetch) {
+			job_info_t ji;
+			process = 1;
+			Rerror = 0;
+			if (pars < 1 || parT[0] != DT_BYTESTREAM || parL[0] != SESSION_KEY_LEN)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else if (query_job(a, (const unsigned char*) parP[0], &ji))
+				sendResp(a, SET_STAT(RESP_ERR, ERR_unavailable));
+			else if (!ji.state)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_inv_par));
+			else if (ph.cmd == CMD_jobPoll)
+				eval_result = job_state(&ji);
+			else if (ji.state != JOB_DONE && ji.state != JOB_FAILED)
+				sendResp(a, SET_STAT(RESP_ERR, ERR_session_busy));
+			else if (!(eval_result = fetch_job((const unsigned char*) parP[0])))
+				sendResp(a, SET_STAT(RESP_ERR, ERR_IOerror));
+		}
+#endif
+
 		if (ph.cmd==CMD_detachSession) {
 			process=1;
 			if (!detach_session(a)) {
-				s = resume_session();
+				a->s = s = resume_session();
 				sendResp(a, RESP_OK);
 			}
 		}
@@ -3099,9 +4824,9 @@ void Rserve_QAP1_connected(void *thp) {
 				else
 					printf("result is <null>\n");
 #endif				
-				if (stat == 1 && ph.cmd == CMD_detachedVoidEval && detach_session(a))
-					sendResp(a, SET_STAT(RESP_ERR, ERR_detach_failed));
-				else if (stat != 1)
+				if (stat == 1 && ph.cmd == CMD_detachedVoidEval && detach_session(a)) {
+					/* detach_session() has sent the error response */
+				} else if (stat != 1)
 					sendResp(a, SET_STAT(RESP_ERR, stat));
 				else {
 #ifdef RSERV_DEBUG
@@ -3143,7 +4868,7 @@ void Rserve_QAP1_connected(void *thp) {
 			if (!Rerror) printSEXP(exp);
 #endif
 			if (ph.cmd == CMD_detachedVoidEval && s == -1)
-				s = resume_session();
+				a->s = s = resume_session();
 			if (Rerror) {
 				sendResp(a, SET_STAT(RESP_ERR, (Rerror < 0) ? Rerror : -Rerror));
 			} else {
@@ -3267,6 +4992,9 @@ void Rserve_QAP1_connected(void *thp) {
 #endif
     if (rn > 0)
 		sendResp(a, SET_STAT(RESP_ERR, ERR_conn_broken));
+#ifdef unix
+	oc_async_close();
+#endif
     closesocket(s);
     free(sendbuf); free(sfbuf); free(buf);
 	{ /* run .Rserve.done() if present */
@@ -3376,6 +5104,10 @@ int server_send(args_t *arg, const void *buf, rlen_t len) {
 	return send(arg->s, buf, len, 0);
 }
 
+int server_flush(args_t *arg) {
+	return (arg->srv->flush) ? arg->srv->flush(arg) : 0;
+}
+
 server_t *create_Rserve_QAP1(int flags) {
 	server_t *srv;
 	if (use_ipv6) flags |= SRV_IPV6;
@@ -3397,13 +5129,16 @@ void serverLoop() {
 #ifdef unix
     struct timeval timv;
     int selRet = 0;
-    fd_set readfds;
+    fd_set readfds, writefds;
 #endif
 
 	if (main_argv && tag_argv == 1 && strlen(main_argv[0]) >= 8) {
 		strcpy(main_argv[0] + strlen(main_argv[0]) - 8, "/RsrvSRV");
 		tag_argv = 2;
 	}
+#ifdef unix
+	session_init();
+#endif
     
     while(active && (servers || children)) { /* main serving loop */
 		int i;
@@ -3411,6 +5146,7 @@ void serverLoop() {
 		int maxfd = 0;
 #ifdef FORKED
 		while (waitpid(-1, 0, WNOHANG) > 0);
+		session_sweep();
 #endif
 		/* 500ms (used to be 10ms) - it shouldn't really matter since
 		   it's ok for us to sleep -- the timeout will only influence
@@ -3418,6 +5154,7 @@ void serverLoop() {
 		   quickly we react to shutdown */
 		timv.tv_sec = 0; timv.tv_usec = 500000;
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 		for (i = 0; i < servers; i++)
 			if (server[i])
 				{
@@ -3436,7 +5173,13 @@ void serverLoop() {
 			}
 		}
 
-		selRet = select(maxfd + 1, &readfds, 0, 0, &timv);
+		maxfd = hub_fdset(&readfds, &writefds, maxfd, &timv);
+		maxfd = session_fdset(&readfds, maxfd, &timv);
+
+		selRet = select(maxfd + 1, &readfds, &writefds, 0, &timv);
+
+		session_process((selRet > 0) ? &readfds : 0);
+		hub_process((selRet > 0) ? &readfds : 0, (selRet > 0) ? &writefds : 0);
 
 		if (selRet > 0) {
 			for (i = 0; i < servers; i++) {
@@ -3479,7 +5222,11 @@ void serverLoop() {
 						while (*laddr)
 							if (sa->sa.sin_addr.s_addr == inet_addr(*(laddr++)))
 								{ allowed=1; break; }
-						if (allowed) {
+						if (allowed && session_hold(sa)) {
+#ifdef RSERV_DEBUG
+							printf("INFO: accepted connection for server %p, waiting for a session key\n", (void*) srv);
+#endif
+						} else if (allowed) {
 #ifdef RSERV_DEBUG
 							printf("INFO: accepted connection for server %p, calling connected\n", (void*) srv);
 #endif
@@ -3497,6 +5244,10 @@ void serverLoop() {
 #endif
 							closesocket(sa->s);
 						}
+					} else if (session_hold(sa)) {
+#ifdef RSERV_DEBUG
+						printf("INFO: accepted connection for server %p, waiting for a session key\n", (void*) srv);
+#endif
 					} else { /* ---> remote enabled */
 #ifdef RSERV_DEBUG
 						printf("INFO: accepted connection for server %p, calling connected\n", (void*) srv);
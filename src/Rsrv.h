@@ -119,6 +119,7 @@ struct phdr { /* always 16 bytes */
 #define CMD_OOB  0x20000  /* out-of-band data - i.e. unsolicited messages */
 #define OOB_SEND (CMD_OOB | 0x1000) /* OOB send - unsolicited SEXP sent from the R instance to the client. 12 LSB are reserved for application-specific code */
 #define OOB_MSG  (CMD_OOB | 0x2000) /* OOB message - unsolicited message sent from the R instance to the client requiring a response. 12 LSB are reserved for application-specific code */
+#define OOB_OCRESULT (CMD_OOB | 0x3000) /* result of an asynchronous OC call (CMD_OCcallAsync): DT_INT request id followed by DT_SEXP result, only the id with the stat code set if the call failed */
 
 #define IS_OOB_SEND(X)  (((X) & 0x0ffff000) == OOB_SEND)
 #define IS_OOB_MSG(X)   (((X) & 0x0ffff000) == OOB_MSG)
@@ -207,6 +208,11 @@ struct phdr { /* always 16 bytes */
 								  and it requires that the SEXP is a
 								  language construct with OC reference
 								  in the first position */
+#define CMD_OCcallAsync  0x00e /* int (request id), SEXP : -  -- OC call
+								  that is evaluated asynchronously by
+								  a worker process (see oc.workers),
+								  the result is sent as OOB_OCRESULT
+								  with the same id */
 #define CMD_OCinit  0x434f7352 /* SEXP -- 'RsOC' - command sent from
 								  the server in OC mode with the packet
 								  of initial capabilities. */
@@ -231,6 +237,12 @@ struct phdr { /* always 16 bytes */
 #define CMD_detachedVoidEval 0x031 /* string : session key; doesn't */
 #define CMD_attachSession    0x032 /* session key : - */  
 
+/* asynchronous jobs (since 1.7-2) */
+#define CMD_jobSubmit        0x033 /* string : job key ; the job is evaluated
+									  after the connection is closed */
+#define CMD_jobPoll          0x034 /* job key : SEXP list(state, cpu, wall) */
+#define CMD_jobFetch         0x035 /* job key : SEXP result of the job */
+
 /* control commands (since 0.6-0) - passed on to the master process */
 /* Note: currently all control commands are asychronous, i.e. RESP_OK
    indicates that the command was enqueued in the master pipe, but there
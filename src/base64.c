@@ -5,7 +5,14 @@ static const char *b64tab = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxy
 
 /* dst must be at least (len + 2) / 3 * 4 + 1 bytes long and will be NUL terminated when done */
 void base64encode(const unsigned char *src, int len, char *dst) {
+    unsigned char tail[3];
     while (len > 0) {
+	if (len < 3) { /* never read beyond src, pad the last group with zeros */
+	    tail[0] = src[0];
+	    tail[1] = (len > 1) ? src[1] : 0;
+	    tail[2] = 0;
+	    src = tail;
+	}
 	*(dst++) = b64tab[src[0] >> 2];
 	*(dst++) = b64tab[((src[0] & 0x03) << 4) | ((src[1] & 0xf0) >> 4)];
 	*(dst++) = (len > 1) ? b64tab[((src[1] & 0x0f) << 2) | ((src[2] & 0xc0) >> 6)] : '=';
@@ -1,11 +1,32 @@
 #include "RSserver.h"
 #include "tls.h"
 #include "http.h"
+#include "http2.h"
 #include "websockets.h" /* for connection upgrade */
+#include "hub.h"
 #include "rserr.h"
+#include "md5.h"
 #include <sisocks.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 /* size of the line buffer for each worker (request and header only)
  * requests that have longer headers will be rejected with 413
@@ -41,6 +62,9 @@
 #define CONTENT_TYPE      0x0040 /* message has a specific content type set */
 #define CONTENT_FORM_UENC 0x0080 /* message content type is application/x-www-form-urlencoded */
 #define WS_UPGRADE        0x0100 /* upgrade to WebSockets protocol */
+#define ACCEPT_GZIP       0x0200 /* client accepts gzip content encoding */
+#define ACCEPT_DEFLATE    0x0400 /* client accepts deflate content encoding */
+#define H2C_UPGRADE       0x0800 /* upgrade to HTTP/2 (h2c) */
 
 struct buffer {
     struct buffer *next, *prev;
@@ -52,6 +76,11 @@ struct buffer {
 #include <sys/un.h> /* needed for unix sockets */
 #endif
 
+#ifndef USE_RINTERNALS
+#define USE_RINTERNALS
+#include <Rinternals.h>
+#endif
+
 struct args {
 	server_t *srv; /* server that instantiated this connection */
     SOCKET s;
@@ -68,14 +97,20 @@ struct args {
     struct sockaddr_un su;
 #endif
     char *line_buf;                /* line buffer (used for request and headers) */
-    char *url, *body;              /* URL and request body */
+    char *url, *body;              /* URL and request body (body points into body_sexp) */
     char *content_type;            /* content type (if set) */
-    unsigned int line_pos, body_pos; /* positions in the buffers */
+    unsigned int line_pos;         /* position in the line buffer */
+    long body_pos;                 /* number of body bytes received so far */
+    SEXP body_sexp;                /* raw vector holding the body, preserved for the life of the request */
+    FILE *body_file;               /* if the body is too big it is stored in this file instead */
+    char *body_fn;                 /* name of the body file */
     long content_length;           /* desired content length */
     char part, method;             /* request part, method */
 	int  attr;                     /* connection attributes */
-	char *ws_protocol, *ws_version, *ws_key;
+	char *ws_protocol, *ws_version, *ws_key, *ws_extensions;
     struct buffer *headers;        /* buffer holding header lines */
+    char *h2_settings;             /* HTTP2-Settings: of an h2c upgrade request */
+    struct multipart *mp;          /* multipart/form-data parser (if the body is parsed as it arrives) */
 };
 
 #define IS_HTTP_1_1(C) (((C)->attr & HTTP_1_0) == 0)
@@ -83,11 +118,6 @@ struct args {
 /* returns the HTTP/x.x string for a given connection - we support 1.0 and 1.1 only */
 #define HTTP_SIG(C) (IS_HTTP_1_1(C) ? "HTTP/1.1" : "HTTP/1.0")
 
-#ifndef USE_RINTERNALS
-#define USE_RINTERNALS
-#include <Rinternals.h>
-#endif
-
 /* free buffers starting from the tail(!!) */
 static void free_buffer(struct buffer *buf) {
     if (!buf) return;
@@ -127,6 +157,576 @@ static SEXP collect_buffers(struct buffer *buf) {
     return res;
 }
 
+/* body size (in bytes) above which request bodies are stored in a
+   temporary file instead of memory, 0 = always keep in memory */
+static long body_tmpfile_limit = 0;
+
+void set_http_body_tmpfile(long limit) {
+	body_tmpfile_limit = (limit > 0) ? limit : 0;
+}
+
+static void free_multipart(struct multipart *mp);
+
+/* releases the request body - both the in-memory and the file version */
+static void free_request_body(args_t *c) {
+	if (c->body_sexp) {
+		R_ReleaseObject(c->body_sexp);
+		c->body_sexp = 0;
+	}
+	c->body = NULL;
+	if (c->body_file) {
+		fclose(c->body_file);
+		c->body_file = NULL;
+	}
+	if (c->body_fn) { /* if R wants to keep the file, it has to move it while handling the request */
+		unlink(c->body_fn);
+		free(c->body_fn);
+		c->body_fn = NULL;
+	}
+	if (c->mp) {
+		free_multipart(c->mp);
+		c->mp = NULL;
+	}
+}
+
+static long alloc_body_len;
+static SEXP alloc_body_res;
+
+static void alloc_body_(void *dummy) {
+	alloc_body_res = allocVector(RAWSXP, alloc_body_len);
+	R_PreserveObject(alloc_body_res);
+}
+
+/* allocates a raw vector for the body such that the content can be
+   received directly into it. The allocation is done at top level so
+   a failure doesn't longjmp out of the connection code. Returns 0 on
+   success, -1 on failure. */
+static int alloc_request_body(args_t *c, long len) {
+	alloc_body_len = len;
+	alloc_body_res = 0;
+	if (R_ToplevelExec(alloc_body_, 0) == FALSE || !alloc_body_res)
+		return -1;
+	c->body_sexp = alloc_body_res;
+	c->body = (char*) RAW(c->body_sexp);
+	return 0;
+}
+
+/* returns R's temporary directory (looked up once) */
+static const char *body_tmp_dir() {
+	static char *tmp_dir;
+	if (!tmp_dir) {
+		int err = 0;
+		SEXP sTmp = R_tryEval(PROTECT(lang1(install("tempdir"))), R_GlobalEnv, &err);
+		tmp_dir = strdup((!err && TYPEOF(sTmp) == STRSXP && LENGTH(sTmp) > 0) ? CHAR(STRING_ELT(sTmp, 0)) : "/tmp");
+		UNPROTECT(1);
+	}
+	return tmp_dir;
+}
+
+/* creates a temporary file for the body in R's temporary directory */
+static int create_body_file(args_t *c) {
+	const char *tmp_dir = body_tmp_dir();
+	int fd;
+	if (!tmp_dir) return -1;
+	if (!(c->body_fn = (char*) malloc(strlen(tmp_dir) + 24)))
+		return -1;
+	sprintf(c->body_fn, "%s/http-body-XXXXXX", tmp_dir);
+	if ((fd = mkstemp(c->body_fn)) == -1) {
+		free(c->body_fn);
+		c->body_fn = NULL;
+		return -1;
+	}
+	if (!(c->body_file = fdopen(fd, "wb"))) {
+		close(fd);
+		free_request_body(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* --- multipart/form-data ---
+
+   Multipart bodies are parsed as they arrive. Parts with a file name
+   (and fields that are too big to be kept in memory) are written to
+   temporary files, other fields are kept in memory. The body passed
+   to R is a named list with one element per part: a string for a
+   field and list(name, filename, content_type, path, size) for a file.
+   As with tmpfile bodies the files are removed once the request has
+   been served. */
+
+#define MP_PREAMBLE  0 /* before the first boundary */
+#define MP_DATA      1 /* part content */
+#define MP_AFTER     2 /* after a boundary: either CRLF or -- follows */
+#define MP_HEADERS   3 /* part headers */
+#define MP_DONE      4 /* after the final boundary */
+#define MP_ERROR     5 /* malformed body */
+
+#define MP_BUF_SIZE   65536
+#define MP_FIELD_MAX  (1024*1024) /* fields bigger than that are stored in a file */
+#define MP_MAX_PARTS  1024
+
+typedef struct mp_part {
+	struct mp_part *next;
+	char *name, *filename, *ctype;
+	char *fn;                  /* temporary file (if stored in a file) */
+	FILE *f;
+	char *data;                /* content (if stored in memory) */
+	unsigned long len, size;   /* length of the content, size of data */
+} mp_part_t;
+
+struct multipart {
+	char delim[80];            /* CRLF--boundary */
+	unsigned int dlen;
+	int state, nparts;
+	char *buf;
+	unsigned int pos, len;
+	mp_part_t *parts, *cur;
+};
+
+/* creates a parser for the value of a Content-type: header (original case) or
+   returns NULL if it is not multipart/form-data with a valid boundary */
+static struct multipart *new_multipart(const char *ct) {
+	struct multipart *mp;
+	const char *b = ct, *e;
+	if (strncasecmp(ct, "multipart/form-data", 19))
+		return 0;
+	while (*b && strncasecmp(b, "boundary=", 9)) b++;
+	if (!*b) return 0;
+	b += 9;
+	if (*b == '"') {
+		e = ++b;
+		while (*e && *e != '"') e++;
+	} else {
+		e = b;
+		while (*e && *e != ';' && *e != ' ' && *e != '\t') e++;
+	}
+	if (e == b || e - b > 70) /* RFC 2046 limits boundaries to 70 characters */
+		return 0;
+	if (!(mp = (struct multipart*) calloc(1, sizeof(struct multipart))))
+		return 0;
+	if (!(mp->buf = (char*) malloc(MP_BUF_SIZE))) {
+		free(mp);
+		return 0;
+	}
+	memcpy(mp->delim, "\r\n--", 4);
+	memcpy(mp->delim + 4, b, e - b);
+	mp->dlen = 4 + (e - b);
+	/* the first boundary is not preceded by CRLF, so we pretend it is */
+	memcpy(mp->buf, "\r\n", 2);
+	mp->len = 2;
+	mp->state = MP_PREAMBLE;
+	return mp;
+}
+
+static void free_multipart(struct multipart *mp) {
+	while (mp->parts) {
+		mp_part_t *p = mp->parts;
+		mp->parts = p->next;
+		if (p->f) fclose(p->f);
+		if (p->fn) { /* if R wants to keep the file, it has to move it while handling the request */
+			unlink(p->fn);
+			free(p->fn);
+		}
+		if (p->name) free(p->name);
+		if (p->filename) free(p->filename);
+		if (p->ctype) free(p->ctype);
+		if (p->data) free(p->data);
+		free(p);
+	}
+	if (mp->buf) free(mp->buf);
+	free(mp);
+}
+
+/* extracts the value of the parameter par from a header value (quoted or token) */
+static char *mp_param(const char *v, const char *par) {
+	unsigned int pl = strlen(par);
+	while (*v) {
+		while (*v == ';' || *v == ' ' || *v == '\t') v++;
+		if (!strncasecmp(v, par, pl) && v[pl] == '=') {
+			const char *e;
+			char *res, *d;
+			v += pl + 1;
+			if (*v != '"') {
+				e = v;
+				while (*e && *e != ';' && *e != ' ' && *e != '\t') e++;
+				if (!(res = (char*) malloc(e - v + 1))) return 0;
+				memcpy(res, v, e - v);
+				res[e - v] = 0;
+				return res;
+			}
+			v++;
+			if (!(d = res = (char*) malloc(strlen(v) + 1))) return 0;
+			while (*v && *v != '"') {
+				if (*v == '\\' && v[1]) v++;
+				*(d++) = *(v++);
+			}
+			*d = 0;
+			return res;
+		}
+		while (*v && *v != ';') { /* skip to the next parameter */
+			if (*v == '"') {
+				v++;
+				while (*v && *v != '"') { if (*v == '\\' && v[1]) v++; v++; }
+				if (*v) v++;
+			} else v++;
+		}
+	}
+	return 0;
+}
+
+/* processes a part header line (NUL-terminated) */
+static void mp_header(mp_part_t *p, char *l) {
+	char *v = l;
+	while (*v && *v != ':') v++;
+	if (!*v) return;
+	*(v++) = 0;
+	while (*v == ' ' || *v == '\t') v++;
+	if (!strcasecmp(l, "content-disposition")) {
+		if (p->name) free(p->name);
+		if (p->filename) free(p->filename);
+		p->name = mp_param(v, "name");
+		p->filename = mp_param(v, "filename");
+	} else if (!strcasecmp(l, "content-type")) {
+		if (p->ctype) free(p->ctype);
+		p->ctype = strdup(v);
+	}
+}
+
+/* appends content to the current part */
+static int mp_sink(struct multipart *mp, const char *d, unsigned long n) {
+	mp_part_t *p = mp->cur;
+	/* files are created even if they are empty so the part is
+	   reported as a file */
+	if (!p->f && (p->filename || p->len + n > MP_FIELD_MAX)) { /* move to a file */
+		const char *dir = body_tmp_dir();
+		int fd;
+		if (!dir || !(p->fn = (char*) malloc(strlen(dir) + 24)))
+			return -1;
+		sprintf(p->fn, "%s/http-part-XXXXXX", dir);
+		if ((fd = mkstemp(p->fn)) == -1) {
+			free(p->fn);
+			p->fn = 0;
+			return -1;
+		}
+		if (!(p->f = fdopen(fd, "wb"))) {
+			close(fd);
+			return -1;
+		}
+		if (p->len && fwrite(p->data, 1, p->len, p->f) != p->len)
+			return -1;
+		if (p->data) {
+			free(p->data);
+			p->data = 0;
+		}
+	}
+	if (!n) return 0;
+	if (p->f) {
+		if (fwrite(d, 1, n, p->f) != n)
+			return -1;
+	} else {
+		if (p->len + n > p->size) {
+			unsigned long ns = p->size ? p->size : 1024;
+			char *nd;
+			while (ns < p->len + n) ns <<= 1;
+			if (!(nd = (char*) realloc(p->data, ns)))
+				return -1;
+			p->data = nd;
+			p->size = ns;
+		}
+		memcpy(p->data + p->len, d, n);
+	}
+	p->len += n;
+	return 0;
+}
+
+/* finds the delimiter in the buffer, returns its offset or -1 */
+static long mp_find(struct multipart *mp, const char *d, unsigned int n) {
+	const char *s = d, *e = d + n;
+	while (s + mp->dlen <= e && (s = (const char*) memchr(s, '\r', e - s))) {
+		if (s + mp->dlen > e)
+			break;
+		if (!memcmp(s, mp->delim, mp->dlen))
+			return s - d;
+		s++;
+	}
+	return -1;
+}
+
+/* processes the data in the buffer, returns -1 on error */
+static int mp_process(struct multipart *mp) {
+	while (mp->pos < mp->len) {
+		char *d = mp->buf + mp->pos;
+		unsigned int n = mp->len - mp->pos;
+		switch (mp->state) {
+		case MP_PREAMBLE:
+		case MP_DATA:
+			{
+				long off = mp_find(mp, d, n);
+				if (off < 0) { /* keep what could be the start of the delimiter */
+					if (n < mp->dlen) return 0;
+					if (mp->state == MP_DATA && mp_sink(mp, d, n - mp->dlen + 1))
+						return -1;
+					mp->pos += n - mp->dlen + 1;
+					return 0;
+				}
+				if (mp->state == MP_DATA && mp_sink(mp, d, off))
+					return -1;
+				mp->pos += off + mp->dlen;
+				mp->state = MP_AFTER;
+				break;
+			}
+		case MP_AFTER:
+			if (*d == ' ' || *d == '\t') { /* transport padding */
+				mp->pos++;
+				break;
+			}
+			if (n < 2) return 0;
+			if (d[0] == '-' && d[1] == '-') {
+				mp->state = MP_DONE;
+				break;
+			}
+			if (d[0] != '\r' || d[1] != '\n' || mp->nparts >= MP_MAX_PARTS)
+				return -1;
+			mp->pos += 2;
+			{ /* new part */
+				mp_part_t *p = (mp_part_t*) calloc(1, sizeof(mp_part_t)), **tail = &mp->parts;
+				if (!p) return -1;
+				while (*tail) tail = &((*tail)->next);
+				*tail = mp->cur = p;
+				mp->nparts++;
+			}
+			mp->state = MP_HEADERS;
+			break;
+		case MP_HEADERS:
+			{
+				char *eol = (char*) memchr(d, '\n', n);
+				if (!eol) {
+					if (mp->pos == 0 && n == MP_BUF_SIZE) /* header line doesn't fit */
+						return -1;
+					return 0;
+				}
+				mp->pos += eol - d + 1;
+				if (eol > d && eol[-1] == '\r') eol--;
+				if (eol == d) { /* empty line - content follows */
+					mp->state = MP_DATA;
+					break;
+				}
+				*eol = 0;
+				mp_header(mp->cur, d);
+				break;
+			}
+		case MP_DONE: /* epilogue is ignored */
+			mp->pos = mp->len;
+			return 0;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* feeds body content to the parser */
+static int feed_multipart(struct multipart *mp, const char *buf, long len) {
+	while (len > 0) {
+		unsigned int n;
+		if (mp->pos) { /* move unprocessed data to the front */
+			memmove(mp->buf, mp->buf + mp->pos, mp->len - mp->pos);
+			mp->len -= mp->pos;
+			mp->pos = 0;
+		}
+		n = MP_BUF_SIZE - mp->len;
+		if (n > len) n = len;
+		if (!n) { /* buffer full, nothing could be processed */
+			mp->state = MP_ERROR;
+			return -1;
+		}
+		memcpy(mp->buf + mp->len, buf, n);
+		mp->len += n;
+		buf += n;
+		len -= n;
+		if (mp_process(mp)) {
+			mp->state = MP_ERROR;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* creates the R representation of the parts */
+static SEXP multipart_result(struct multipart *mp) {
+	SEXP res = PROTECT(allocVector(VECSXP, mp->nparts));
+	SEXP names = PROTECT(allocVector(STRSXP, mp->nparts));
+	mp_part_t *p = mp->parts;
+	int i = 0;
+	for (; p; p = p->next, i++) {
+		SET_STRING_ELT(names, i, mkChar(p->name ? p->name : ""));
+		if (p->f) { /* make sure all content is on the disk */
+			fclose(p->f);
+			p->f = 0;
+		}
+		if (p->fn) {
+			SEXP fi = PROTECT(allocVector(VECSXP, 5)), fin = PROTECT(allocVector(STRSXP, 5));
+			SET_VECTOR_ELT(fi, 0, p->name ? mkString(p->name) : R_NilValue);
+			SET_VECTOR_ELT(fi, 1, p->filename ? mkString(p->filename) : R_NilValue);
+			SET_VECTOR_ELT(fi, 2, p->ctype ? mkString(p->ctype) : R_NilValue);
+			SET_VECTOR_ELT(fi, 3, mkString(p->fn));
+			SET_VECTOR_ELT(fi, 4, ScalarReal((double) p->len));
+			SET_STRING_ELT(fin, 0, mkChar("name"));
+			SET_STRING_ELT(fin, 1, mkChar("filename"));
+			SET_STRING_ELT(fin, 2, mkChar("content_type"));
+			SET_STRING_ELT(fin, 3, mkChar("path"));
+			SET_STRING_ELT(fin, 4, mkChar("size"));
+			setAttrib(fi, R_NamesSymbol, fin);
+			SET_VECTOR_ELT(res, i, fi);
+			UNPROTECT(2);
+		} else if (p->len && memchr(p->data, 0, p->len)) { /* binary field */
+			SEXP r = allocVector(RAWSXP, p->len);
+			memcpy(RAW(r), p->data, p->len);
+			SET_VECTOR_ELT(res, i, r);
+		} else
+			SET_VECTOR_ELT(res, i, ScalarString(mkCharLen(p->len ? p->data : "", p->len)));
+	}
+	setAttrib(res, R_NamesSymbol, names);
+	UNPROTECT(2);
+	return res;
+}
+
+/* store body content - either in the body vector, the file or the multipart parser */
+static int store_body(args_t *c, const char *buf, long len) {
+	if (c->mp) {
+		if (feed_multipart(c->mp, buf, len))
+			return -1;
+	} else if (c->body_file) {
+		if (fwrite(buf, 1, len, c->body_file) != len)
+			return -1;
+	} else
+		memcpy(c->body + c->body_pos, buf, len);
+	c->body_pos += len;
+	return 0;
+}
+
+/* HTTP/2 support (h2c with prior knowledge or via Upgrade:, h2 via ALPN) */
+static int http2_enabled = 0;
+
+void set_http_h2(int enable) {
+	http2_enabled = enable ? 1 : 0;
+	set_tls_alpn_h2(http2_enabled);
+}
+
+static int http2_request(args_t *c, const char *req, unsigned long req_len, char **res, unsigned long *res_len);
+static void h2c_upgrade(args_t *c);
+
+/* compression level used for responses (0 = no compression) and
+   the minimal size of a payload to be considered for compression */
+static int  compress_level = 0;
+static long compress_min = 1024;
+
+void set_http_compression(int level, long min_size) {
+	if (level >= 0)
+		compress_level = (level > 9) ? 9 : level;
+	if (min_size >= 0)
+		compress_min = min_size;
+}
+
+/* parses the value of the Accept-Encoding: header and returns ACCEPT_*
+   flags for the encodings we support. Encodings with q=0 are not
+   acceptable, "*" stands for all encodings that are not listed. */
+static int parse_accept_encoding(const char *s) {
+	int res = 0, listed = 0, any = 0;
+	while (*s) {
+		const char *e;
+		int flag = 0, star = 0, q0 = 0;
+		while (*s == ' ' || *s == '\t' || *s == ',') s++;
+		e = s;
+		while (*e && *e != ',' && *e != ';' && *e != ' ' && *e != '\t') e++;
+		if ((e - s == 4 && !strncasecmp(s, "gzip", 4)) || (e - s == 6 && !strncasecmp(s, "x-gzip", 6)))
+			flag = ACCEPT_GZIP;
+		else if (e - s == 7 && !strncasecmp(s, "deflate", 7))
+			flag = ACCEPT_DEFLATE;
+		else if (e - s == 1 && *s == '*')
+			star = 1;
+		s = e;
+		while (*s && *s != ',') { /* parameters - we only care about q */
+			if (*s == ';') {
+				s++;
+				while (*s == ' ' || *s == '\t') s++;
+				if ((*s == 'q' || *s == 'Q') && s[1] == '=' && atof(s + 2) <= 0.0)
+					q0 = 1;
+			} else s++;
+		}
+		if (star)
+			any = !q0;
+		else {
+			listed |= flag;
+			if (!q0)
+				res |= flag;
+		}
+	}
+	if (any)
+		res |= (ACCEPT_GZIP | ACCEPT_DEFLATE) & ~listed;
+	return res;
+}
+
+/* checks whether the content type is worth compressing */
+static int is_compressible(const char *ct) {
+	return (!strncmp(ct, "text/", 5) || strstr(ct, "json") || strstr(ct, "javascript") ||
+			strstr(ct, "xml") || !strncmp(ct, "image/svg", 9)) ? 1 : 0;
+}
+
+/* checks whether the headers vector contains a given header (name must be lowercase) */
+static int has_header(SEXP sHeaders, const char *name) {
+	unsigned int i, n, nl = strlen(name);
+	if (TYPEOF(sHeaders) != STRSXP) return 0;
+	for (i = 0, n = LENGTH(sHeaders); i < n; i++) {
+		const char *hs = CHAR(STRING_ELT(sHeaders, i));
+		if (!strncasecmp(hs, name, nl) && hs[nl] == ':')
+			return 1;
+	}
+	return 0;
+}
+
+/* checks whether a pre-compressed version <fn>.gz exists which is not
+   older than the file itself. If so, gzfn is set to its name */
+static int has_gz_sibling(const char *fn, char *gzfn, unsigned int size) {
+	struct stat st, gst;
+	if (strlen(fn) + 4 > size) return 0;
+	strcpy(gzfn, fn);
+	strcat(gzfn, ".gz");
+	if (stat(fn, &st) || stat(gzfn, &gst) || gst.st_mtime < st.st_mtime)
+		return 0;
+	return 1;
+}
+
+#ifdef HAVE_ZLIB
+/* compresses the payload in gzip or zlib (HTTP "deflate") format. Returns
+   a malloc()ed buffer or NULL if the compression failed or didn't help */
+static char *compress_payload(const char *src, unsigned long len, int gzip, unsigned long *dlen) {
+	z_stream z;
+	unsigned long bound;
+	char *dst;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, compress_level, Z_DEFLATED, gzip ? 31 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	bound = deflateBound(&z, len);
+	if (!(dst = (char*) malloc(bound))) {
+		deflateEnd(&z);
+		return 0;
+	}
+	z.next_in = (Bytef*) src;
+	z.avail_in = len;
+	z.next_out = (Bytef*) dst;
+	z.avail_out = bound;
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= len) {
+		deflateEnd(&z);
+		free(dst);
+		return 0;
+	}
+	*dlen = z.total_out;
+	deflateEnd(&z);
+	return dst;
+}
+#endif
+
 static void free_args(args_t *c)
 {
     DBG(printf("finalizing worker %p\n", (void*) c));
@@ -138,10 +738,7 @@ static void free_args(args_t *c)
 		free(c->line_buf);
 		c->line_buf = NULL;
 	}
-    if (c->body) {
-		free(c->body);
-		c->body = NULL;
-    }
+	free_request_body(c);
 	
     if (c->content_type) {
 		free(c->content_type);
@@ -163,12 +760,39 @@ static void free_args(args_t *c)
 		free(c->ws_version);
 		c->ws_version = NULL;
 	}
+	if (c->ws_extensions) {
+		free(c->ws_extensions);
+		c->ws_extensions = NULL;
+	}
+	if (c->h2_settings) {
+		free(c->h2_settings);
+		c->h2_settings = NULL;
+	}
     if (c->s != INVALID_SOCKET) {
+		server_flush(c);
 		closesocket(c->s);
 		c->s = INVALID_SOCKET;
     }
 }
 
+/* reset the worker so it can process a new request (keep-alive) */
+static void reset_request(args_t *c) {
+	if (c->url) { free(c->url); c->url = NULL; }
+	free_request_body(c);
+	if (c->content_type) { free(c->content_type); c->content_type = NULL; }
+	if (c->headers) { free_buffer(c->headers); c->headers = NULL; }
+	if (c->ws_key) { free(c->ws_key); c->ws_key = NULL; }
+	if (c->ws_protocol) { free(c->ws_protocol); c->ws_protocol = NULL; }
+	if (c->ws_version) { free(c->ws_version); c->ws_version = NULL; }
+	if (c->ws_extensions) { free(c->ws_extensions); c->ws_extensions = NULL; }
+	if (c->h2_settings) { free(c->h2_settings); c->h2_settings = NULL; }
+	c->body_pos = 0;
+	c->method = 0;
+	c->part = PART_REQUEST;
+	c->attr = 0;
+	c->content_length = 0;
+}
+
 static int send_response(args_t *c, const char *buf, unsigned int len)
 {
 	server_t *srv = c->srv;
@@ -202,6 +826,37 @@ static int send_http_response(args_t *c, const char *text) {
     return send_response(c, text, strlen(text));
 }
 
+/* sends the remaining headers (each starting with CRLF, the first header
+   line must be already sent) and the payload. The payload is compressed
+   if enabled, the client accepts it and the content is large enough and
+   of a compressible type */
+static void send_content(args_t *c, const char *ct, SEXP sHeaders, const char *data, unsigned long len) {
+	char buf[64];
+	char *cbuf = 0;
+	const char *enc = 0;
+	if (compress_level > 0 && len >= compress_min && is_compressible(ct) && !has_header(sHeaders, "content-encoding")) {
+		send_response(c, "\r\nVary: Accept-Encoding", 23);
+#ifdef HAVE_ZLIB
+		if (c->attr & (ACCEPT_GZIP | ACCEPT_DEFLATE)) {
+			unsigned long clen = 0;
+			int gzip = (c->attr & ACCEPT_GZIP) ? 1 : 0;
+			if ((cbuf = compress_payload(data, len, gzip, &clen))) {
+				enc = gzip ? "\r\nContent-Encoding: gzip" : "\r\nContent-Encoding: deflate";
+				data = cbuf;
+				len = clen;
+			}
+		}
+#endif
+	}
+	if (enc)
+		send_response(c, enc, strlen(enc));
+	sprintf(buf, "\r\nContent-length: %lu\r\n\r\n", len);
+	send_response(c, buf, strlen(buf));
+	if (c->method != METHOD_HEAD)
+		send_response(c, data, len);
+	if (cbuf) free(cbuf);
+}
+
 /* decode URI in place (decoding never expands) */
 static void uri_decode(char *s)
 {
@@ -284,17 +939,38 @@ static SEXP R_ContentTypeName;
 
 /* create an object representing the request body. It is NULL if the body is empty (or zero length).
  * In the case of a URL encoded form it will have the same shape as the query string (named string vector).
+ * If the body was too big to be kept in memory it is a string with the name "tmpfile" holding the
+ * name of the file that contains the body (the file is removed after the request has been served).
+ * A multipart/form-data body is a named list of the parts (see multipart_result).
  * In all other cases it will be a raw vector with a "content-type" attribute (if specified in the headers) */
 static SEXP parse_request_body(args_t *c) {
-    if (!c || !c->body) return R_NilValue;
+	if (c && c->mp) {
+		SEXP res;
+		if (!c->body_pos) return R_NilValue;
+		res = PROTECT(multipart_result(c->mp));
+		if (c->content_type) {
+			if (!R_ContentTypeName) R_ContentTypeName = install("content-type");
+			setAttrib(res, R_ContentTypeName, mkString(c->content_type));
+		}
+		UNPROTECT(1);
+		return res;
+	}
+    if (!c || (!c->body && !c->body_fn)) return R_NilValue;
 	
-    if ((c->attr & CONTENT_FORM_UENC) && !(c->srv->flags & HTTP_RAW_BODY)) { /* URL encoded form - return parsed form */
+    if (c->body && (c->attr & CONTENT_FORM_UENC) && !(c->srv->flags & HTTP_RAW_BODY)) { /* URL encoded form - return parsed form */
 		c->body[c->content_length] = 0; /* the body is guaranteed to have an extra byte for the termination */
 		return parse_query(c->body);
-    } else { /* something else - pass it as a raw vector */
-		SEXP res = PROTECT(Rf_allocVector(RAWSXP, c->content_length));
-		if (c->content_length)
-			memcpy(RAW(res), c->body, c->content_length);
+    } else { /* something else - pass it as a raw vector (or file name) */
+		SEXP res;
+		if (c->body_fn) {
+			if (c->body_file) { /* make sure all content is on the disk */
+				fclose(c->body_file);
+				c->body_file = NULL;
+			}
+			res = PROTECT(mkString(c->body_fn));
+			setAttrib(res, R_NamesSymbol, mkString("tmpfile"));
+		} else /* the body vector was allocated with the exact size so we can pass it as-is */
+			res = PROTECT(c->body_sexp);
 		if (c->content_type) { /* attach the content type so it can be interpreted */
 			if (!R_ContentTypeName) R_ContentTypeName = install("content-type");
 			setAttrib(res, R_ContentTypeName, mkString(c->content_type));
@@ -311,27 +987,450 @@ static void fin_request(args_t *c) {
 		c->attr |= CONNECTION_CLOSE;
 }
 
+/* --- lazy request object for .http.request2(req) ---
+
+   req is an environment with active bindings url, method, query,
+   headers, cookies and body. Each of them is parsed only when it is
+   first accessed and the result is cached in the environment (as
+   .url, .method, ...) so it remains available after the request has
+   been served. The bindings call back into C via .Call() with an
+   external pointer to the request which is cleared once the request
+   is done. */
+
+static const char *req_fields[] = { "url", "method", "query", "headers", "cookies", "body", 0 };
+static SEXP req_bodies, req_xp_sym, req_function, R_HttpRequest2Sym;
+static char *req_query; /* query part of the URL of the current request */
+
+/* returns the header lines of the request as a contiguous string (the
+   collected vector is protected if it has to be created) */
+static const char *req_header_block(args_t *c, long *len, int *nprot) {
+	struct buffer *buf = c->headers;
+	SEXP sRaw;
+	*len = 0;
+	if (!buf) return 0;
+	if (!buf->prev) { /* common case: all headers fit in one buffer */
+		*len = buf->length;
+		return buf->data;
+	}
+	sRaw = PROTECT(collect_buffers(buf));
+	(*nprot)++;
+	*len = LENGTH(sRaw);
+	return (const char*) RAW(sRaw);
+}
+
+/* named character vector of headers (lower-case names), repeated headers
+   are joined with ", ". Header names come from the client, so they are
+   never turned into symbols (R never releases those) */
+static SEXP req_headers(args_t *c) {
+	int nprot = 0, n = 0, k = 0;
+	long len = 0;
+	const char *h = req_header_block(c, &len, &nprot), *e = h + len, *l;
+	SEXP res, names;
+	char name[128];
+	for (l = h; l && l < e; l++) /* upper bound on the number of headers */
+		if (*l == '\n') n++;
+	res = PROTECT(allocVector(STRSXP, n + 1));
+	names = PROTECT(allocVector(STRSXP, n + 1));
+	while (h && h < e) {
+		const char *eol = h, *v, *ve;
+		unsigned int i = 0;
+		while (eol < e && *eol != '\n') eol++;
+		v = h;
+		while (v < eol && *v != ':') v++;
+		if (v < eol && v - h < sizeof(name) && !(v - h == 14 && !strncmp(h, "Request-Method", 14))) {
+			int j;
+			for (; h < v; h++)
+				name[i++] = (*h >= 'A' && *h <= 'Z') ? (*h | 0x20) : *h;
+			name[i] = 0;
+			v++;
+			while (v < eol && (*v == ' ' || *v == '\t')) v++;
+			ve = eol;
+			while (ve > v && (ve[-1] == '\r' || ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+			for (j = 0; j < k; j++)
+				if (!strcmp(CHAR(STRING_ELT(names, j)), name))
+					break;
+			if (j < k) { /* repeated header */
+				const char *pv = CHAR(STRING_ELT(res, j));
+				unsigned int pl = strlen(pv);
+				char *nv = (char*) R_alloc(pl + (ve - v) + 3, 1);
+				memcpy(nv, pv, pl);
+				memcpy(nv + pl, ", ", 2);
+				memcpy(nv + pl + 2, v, ve - v);
+				nv[pl + 2 + (ve - v)] = 0;
+				SET_STRING_ELT(res, j, mkChar(nv));
+			} else {
+				SET_STRING_ELT(res, k, mkCharLen(v, ve - v));
+				SET_STRING_ELT(names, k++, mkChar(name));
+			}
+		}
+		h = eol + 1;
+	}
+	res = PROTECT(lengthgets(res, k));
+	setAttrib(res, R_NamesSymbol, lengthgets(names, k));
+	UNPROTECT(3 + nprot);
+	return res;
+}
+
+/* named character vector of cookies from the Cookie: header(s) */
+static SEXP req_cookies(args_t *c) {
+	int nprot = 0, n = 0, i = 0;
+	long len = 0;
+	const char *h = req_header_block(c, &len, &nprot), *e = h + len, *l;
+	SEXP res, names;
+	/* first pass: count */
+	for (l = h; l && l < e; ) {
+		const char *eol = l;
+		while (eol < e && *eol != '\n') eol++;
+		if (eol - l > 7 && !strncasecmp(l, "cookie:", 7)) {
+			const char *p = l + 7;
+			n++;
+			for (; p < eol; p++) if (*p == ';') n++;
+		}
+		l = eol + 1;
+	}
+	res = PROTECT(allocVector(STRSXP, n));
+	names = PROTECT(allocVector(STRSXP, n));
+	for (l = h; l && l < e && i < n; ) {
+		const char *eol = l;
+		while (eol < e && *eol != '\n') eol++;
+		if (eol - l > 7 && !strncasecmp(l, "cookie:", 7)) {
+			const char *p = l + 7;
+			while (p < eol && i < n) {
+				const char *k, *ke, *v, *ve;
+				while (p < eol && (*p == ' ' || *p == '\t')) p++;
+				k = p;
+				while (p < eol && *p != ';' && *p != '=') p++;
+				ke = p;
+				if (p < eol && *p == '=') p++;
+				v = p;
+				while (p < eol && *p != ';') p++;
+				ve = p;
+				while (ve > v && (ve[-1] == '\r' || ve[-1] == ' ')) ve--;
+				if (ve - v > 1 && *v == '"' && ve[-1] == '"') { v++; ve--; }
+				if (ke > k) {
+					SET_STRING_ELT(names, i, mkCharLen(k, ke - k));
+					SET_STRING_ELT(res, i, mkCharLen(v, ve - v));
+					i++;
+				}
+				if (p < eol) p++; /* skip ; */
+			}
+		}
+		l = eol + 1;
+	}
+	if (i < n) { /* some were empty */
+		res = lengthgets(res, i);
+		UNPROTECT(2);
+		PROTECT(res);
+		names = PROTECT(lengthgets(names, i));
+	}
+	setAttrib(res, R_NamesSymbol, names);
+	UNPROTECT(2 + nprot);
+	return res;
+}
+
+static SEXP req_method(args_t *c) {
+	switch (c->method) {
+	case METHOD_GET:  return mkString("GET");
+	case METHOD_POST: return mkString("POST");
+	case METHOD_HEAD: return mkString("HEAD");
+	}
+	{ /* other methods are only recorded in the Request-Method pseudo-header */
+		int nprot = 0;
+		long len = 0;
+		const char *h = req_header_block(c, &len, &nprot), *e = h + len, *eol;
+		SEXP res = R_NilValue;
+		if (h && len > 16 && !strncmp(h, "Request-Method: ", 16)) {
+			h += 16;
+			for (eol = h; eol < e && *eol != '\n'; eol++) {}
+			res = mkCharLen(h, eol - h);
+		}
+		if (res != R_NilValue)
+			res = ScalarString(res);
+		UNPROTECT(nprot);
+		return res;
+	}
+}
+
+/* .Call entry point of the active bindings: req_field(xp, field) */
+static SEXP req_field(SEXP xp, SEXP sField) {
+	args_t *c = (args_t*) R_ExternalPtrAddr(xp);
+	SEXP env = R_ExternalPtrProtected(xp), cache, res;
+	const char *field = CHAR(STRING_ELT(sField, 0));
+	char cname[16];
+
+	snprintf(cname, sizeof(cname), ".%s", field);
+	cache = install(cname);
+	res = findVarInFrame(env, cache);
+	if (res != R_UnboundValue)
+		return res;
+	if (!c)
+		Rf_error("the request is no longer valid (the field `%s' was not accessed while it was served)", field);
+	if (!strcmp(field, "url")) {
+		uri_decode(c->url); /* decode the path part */
+		res = mkString(c->url);
+	} else if (!strcmp(field, "method"))
+		res = req_method(c);
+	else if (!strcmp(field, "query"))
+		res = req_query ? parse_query(req_query) : R_NilValue;
+	else if (!strcmp(field, "headers"))
+		res = req_headers(c);
+	else if (!strcmp(field, "cookies"))
+		res = req_cookies(c);
+	else if (!strcmp(field, "body"))
+		res = parse_request_body(c);
+	else
+		Rf_error("invalid request field `%s'", field);
+	PROTECT(res);
+	defineVar(cache, res, env);
+	UNPROTECT(1);
+	return res;
+}
+
+/* creates the request object for the request c, xp is set to the
+   external pointer which has to be cleared once the request is done */
+static SEXP new_request_env(args_t *c, SEXP *xp) {
+	SEXP env, fnc;
+	int i;
+	if (!req_bodies) { /* bodies of the binding functions: .Call(<req_field>, .req.ptr, "<field>") */
+		SEXP sCall, fn;
+		for (i = 0; req_fields[i]; i++) {}
+		req_bodies = allocVector(VECSXP, i);
+		R_PreserveObject(req_bodies);
+		req_xp_sym = install(".req.ptr");
+		/* env has no parent, so we have to use the function objects instead of symbols */
+		req_function = eval(install("function"), R_BaseEnv);
+		R_PreserveObject(req_function);
+		sCall = PROTECT(eval(install(".Call"), R_BaseEnv));
+		fn = PROTECT(R_MakeExternalPtr((void*) req_field, install("native symbol"), R_NilValue));
+		for (i = 0; req_fields[i]; i++)
+			SET_VECTOR_ELT(req_bodies, i, lang4(sCall, fn, req_xp_sym, mkString(req_fields[i])));
+		UNPROTECT(2);
+	}
+	env = PROTECT(eval(PROTECT(lang3(install("new.env"), ScalarLogical(TRUE), R_EmptyEnv)), R_GlobalEnv));
+	*xp = R_MakeExternalPtr(c, R_NilValue, env);
+	defineVar(req_xp_sym, *xp, env);
+	/* function() .Call(...) evaluated in env gives us a closure with env as its environment */
+	fnc = PROTECT(lang4(req_function, R_NilValue, R_NilValue, R_NilValue));
+	for (i = 0; req_fields[i]; i++) {
+		SETCAR(CDR(CDR(fnc)), VECTOR_ELT(req_bodies, i));
+		R_MakeActiveBinding(install(req_fields[i]), eval(fnc, env), env);
+	}
+	UNPROTECT(3);
+	return env;
+}
+
+/* sends the response based on the result of the R handler */
+static void http_respond(args_t *c, SEXP x)
+{
+    const char *ct = "text/html";
+    SEXP sHeaders = R_NilValue, y;
+    int code = 200;
+
+	/* the result is expected to have one of the following forms:
+
+	   a) character vector of length 1 => error (possibly from try),
+	   will create 500 response
+	   
+	   b) list(payload[, content-type[, headers[, status code]]])
+	   
+	   payload: can be a character vector of length one or a
+	   raw vector. if the character vector is named "file" then
+	   the content of a file of that name is the payload
+	   
+	   content-type: must be a character vector of length one
+	   or NULL (if present, else default is "text/html")
+	   
+	   headers: must be a character vector - the elements will
+	   have CRLF appended and neither Content-type nor
+	   Content-length may be used
+	   
+	   status code: must be an integer if present (default is 200)
+	*/
+	
+	if (TYPEOF(x) == STRSXP && LENGTH(x) > 0) { /* string means there was an error */
+		const char *s = CHAR(STRING_ELT(x, 0));
+		send_http_response(c, " 500 Evaluation error\r\nConnection: close\r\nContent-type: text/plain\r\n\r\n");
+		DBG(Rprintf("respond with 500 and content: %s\n", s));
+		if (c->method != METHOD_HEAD)
+			send_response(c, s, strlen(s));
+		c->attr |= CONNECTION_CLOSE; /* force close */
+		return;
+	}
+	
+	if (TYPEOF(x) == VECSXP && LENGTH(x) > 0) { /* a list (generic vector) can be a real payload */
+		SEXP xNames = getAttrib(x, R_NamesSymbol);
+		if (LENGTH(x) > 1) {
+			SEXP sCT = VECTOR_ELT(x, 1); /* second element is content type if present */
+			if (TYPEOF(sCT) == STRSXP && LENGTH(sCT) > 0)
+				ct = CHAR(STRING_ELT(sCT, 0));
+			if (LENGTH(x) > 2) { /* third element is headers vector */
+				sHeaders = VECTOR_ELT(x, 2);
+				if (TYPEOF(sHeaders) != STRSXP)
+					sHeaders = R_NilValue;
+				if (LENGTH(x) > 3) /* fourth element is HTTP code */
+					code = asInteger(VECTOR_ELT(x, 3));
+			}
+		}
+		y = VECTOR_ELT(x, 0);
+		if (TYPEOF(y) == STRSXP && LENGTH(y) > 0) {
+			char buf[64];
+			int  is_tmp = 0;
+			const char *cs = CHAR(STRING_ELT(y, 0)), *fn = 0;
+			if (code == 200)
+				send_http_response(c, " 200 OK\r\nContent-type: ");
+			else {
+				sprintf(buf, "%s %d Code %d\r\nContent-type: ", HTTP_SIG(c), code, code);
+				send_response(c, buf, strlen(buf));
+			}
+			send_response(c, ct, strlen(ct));
+			if (sHeaders != R_NilValue) {
+				unsigned int i = 0, n = LENGTH(sHeaders);
+				for (; i < n; i++) {
+					const char *hs = CHAR(STRING_ELT(sHeaders, i));
+					if (*hs) { /* headers must be non-empty */
+						send_response(c, "\r\n", 2);
+						send_response(c, hs, strlen(hs));
+					}
+				}
+			}
+			/* special content - a file: either list(file="") or list(tmpfile="")
+			   the latter will be deleted once served */
+			if (TYPEOF(xNames) == STRSXP && LENGTH(xNames) > 0 &&
+				(!strcmp(CHAR(STRING_ELT(xNames, 0)), "file") || (is_tmp = !strcmp(CHAR(STRING_ELT(xNames, 0)), "tmpfile"))))
+				fn = cs;
+			if (fn) {
+				char *fbuf, gzfn[1024];
+				FILE *f;
+				long fsz = 0;
+				/* serve a pre-compressed <file>.gz instead if the client accepts it
+				   (unless the handler has chosen an encoding itself) */
+				if (!is_tmp && compress_level > 0 && !has_header(sHeaders, "content-encoding") &&
+					has_gz_sibling(fn, gzfn, sizeof(gzfn))) {
+					send_response(c, "\r\nVary: Accept-Encoding", 23);
+					if (c->attr & ACCEPT_GZIP) {
+						send_response(c, "\r\nContent-Encoding: gzip", 24);
+						fn = gzfn;
+					}
+				}
+				f = fopen(fn, "rb");
+				if (!f) {
+					send_response(c, "\r\nContent-length: 0\r\n\r\n", 23);
+					fin_request(c);
+					return;
+				}
+				fseek(f, 0, SEEK_END);
+				fsz = ftell(f);
+				fseek(f, 0, SEEK_SET);
+				sprintf(buf, "\r\nContent-length: %ld\r\n\r\n", fsz);
+				send_response(c, buf, strlen(buf));
+				if (c->method != METHOD_HEAD) {
+					fbuf = (char*) malloc(32768);
+					if (fbuf) {
+						while (fsz > 0 && !feof(f)) {
+							int rd = (fsz > 32768) ? 32768 : fsz;
+							if (fread(fbuf, 1, rd, f) != rd) {
+								free(fbuf);
+								c->attr |= CONNECTION_CLOSE;
+								fclose(f);
+								if (is_tmp) unlink(fn);
+								return;
+							}
+							send_response(c, fbuf, rd);
+							fsz -= rd;
+						}
+						free(fbuf);
+					} else { /* allocation error - get out */
+						c->attr |= CONNECTION_CLOSE;
+						fclose(f);
+						if (is_tmp) unlink(fn);
+						return;
+					}
+				}
+				fclose(f);
+				if (is_tmp) unlink(fn);
+				fin_request(c);
+				return;
+			}
+			send_content(c, ct, sHeaders, cs, strlen(cs));
+			fin_request(c);
+			return;
+		}
+		if (TYPEOF(y) == RAWSXP) {
+			char buf[64];
+			Rbyte *cs = RAW(y);
+			if (code == 200)
+				send_http_response(c, " 200 OK\r\nContent-type: ");
+			else {
+				sprintf(buf, "%s %d Code %d\r\nContent-type: ", HTTP_SIG(c), code, code);
+				send_response(c, buf, strlen(buf));
+			}
+			send_response(c, ct, strlen(ct));
+			if (sHeaders != R_NilValue) {
+				unsigned int i = 0, n = LENGTH(sHeaders);
+				for (; i < n; i++) {
+					const char *hs = CHAR(STRING_ELT(sHeaders, i));
+					send_response(c, "\r\n", 2);
+					send_response(c, hs, strlen(hs));
+				}
+			}
+			send_content(c, ct, sHeaders, (const char*) cs, LENGTH(y));
+			fin_request(c);
+			return;
+		}
+	}
+    send_http_response(c, " 500 Invalid response from R\r\nConnection: close\r\nContent-type: text/plain\r\n\r\nServer error: invalid response from R\r\n");
+    c->attr |= CONNECTION_CLOSE; /* force close */
+}
+
 /* process a request by calling the httpd() function in R */
+static unsigned long requests_processed; /* number of requests passed to process_request */
+
 static void process_request(args_t *c)
 {
-    const char *ct = "text/html";
     char *query = 0, *s;
-    SEXP sHeaders = R_NilValue;
-    int code = 200;
+    SEXP sHandler2;
     DBG(Rprintf("process request for %p\n", (void*) c));
     if (!c || !c->url) return; /* if there is not enough to process, bail out */
+	requests_processed++;
 	if (c->attr & WS_UPGRADE) {
-		WS13_upgrade(c, c->ws_key, c->ws_protocol, c->ws_version);
+		WS13_upgrade(c, c->ws_key, c->ws_protocol, c->ws_version, c->ws_extensions);
 		/* the WS swtich messes up args since it replaces it with its own version so
 		   we can't go back to serving - just bail out (NOTE: only works when forked!) */
 		exit(0);
 	}
+	if (c->attr & H2C_UPGRADE) { /* serve the request and continue as HTTP/2 */
+		h2c_upgrade(c);
+		c->attr |= CONNECTION_CLOSE;
+		return;
+	}
     s = c->url;
     while (*s && *s != '?') s++; /* find the query part */
     if (*s) {
 		*(s++) = 0;
 		query = s;
     }
+	/* use .http.request2(req) with a lazy request object if it exists */
+	if (!R_HttpRequest2Sym) R_HttpRequest2Sym = install(".http.request2");
+	sHandler2 = findVar(R_HttpRequest2Sym, R_GlobalEnv);
+	if (TYPEOF(sHandler2) == PROMSXP)
+		sHandler2 = eval(sHandler2, R_GlobalEnv);
+	if (TYPEOF(sHandler2) == CLOSXP) {
+		SEXP xp, x;
+		SEXP sReq = PROTECT(new_request_env(c, &xp));
+		SEXP sTrue = PROTECT(ScalarLogical(TRUE));
+		x = PROTECT(lang3(install("try"), lang2(R_HttpRequest2Sym, sReq), sTrue));
+		SET_TAG(CDR(CDR(x)), install("silent"));
+		DBG(Rprintf("eval(try(.http.request2(req),silent=TRUE)) for '%s'\n", c->url));
+		req_query = query;
+		x = PROTECT(eval(x, R_GlobalEnv));
+		http_respond(c, x);
+		server_flush(c);
+		/* the request object can outlive the request, but can't access it anymore */
+		R_ClearExternalPtr(xp);
+		req_query = 0;
+		UNPROTECT(4);
+		return;
+	}
     uri_decode(c->url); /* decode the path part */
     {   /* construct "try(httpd(url, query, body, headers), silent=TRUE)" */
 		SEXP sTrue = PROTECT(ScalarLogical(TRUE));
@@ -340,7 +1439,7 @@ static void process_request(args_t *c)
 		SEXP sReqHeaders = PROTECT(c->headers ? collect_buffers(c->headers) : R_NilValue);
 		SEXP sArgs = PROTECT(list4(mkString(c->url), sQuery, sBody, sReqHeaders));
 		SEXP sTry = install("try");
-		SEXP y, x = PROTECT(lang3(sTry,
+		SEXP x = PROTECT(lang3(sTry,
 								  LCONS(install(".http.request"), sArgs),
 								  sTrue));
 		SET_TAG(CDR(CDR(x)), install("silent"));
@@ -348,168 +1447,14 @@ static void process_request(args_t *c)
 		
 		/* evaluate the above in the global namespace */
 		x = PROTECT(eval(x, R_GlobalEnv));
-		
-		/* the result is expected to have one of the following forms:
-
-		   a) character vector of length 1 => error (possibly from try),
-		   will create 500 response
-		   
-		   b) list(payload[, content-type[, headers[, status code]]])
-		   
-		   payload: can be a character vector of length one or a
-		   raw vector. if the character vector is named "file" then
-		   the content of a file of that name is the payload
-		   
-		   content-type: must be a character vector of length one
-		   or NULL (if present, else default is "text/html")
-		   
-		   headers: must be a character vector - the elements will
-		   have CRLF appended and neither Content-type nor
-		   Content-length may be used
-		   
-		   status code: must be an integer if present (default is 200)
-		*/
-		
-		if (TYPEOF(x) == STRSXP && LENGTH(x) > 0) { /* string means there was an error */
-			const char *s = CHAR(STRING_ELT(x, 0));
-			send_http_response(c, " 500 Evaluation error\r\nConnection: close\r\nContent-type: text/plain\r\n\r\n");
-			DBG(Rprintf("respond with 500 and content: %s\n", s));
-			if (c->method != METHOD_HEAD)
-				send_response(c, s, strlen(s));
-			c->attr |= CONNECTION_CLOSE; /* force close */
-			UNPROTECT(7);
-			return;
-		}
-		
-		if (TYPEOF(x) == VECSXP && LENGTH(x) > 0) { /* a list (generic vector) can be a real payload */
-			SEXP xNames = getAttrib(x, R_NamesSymbol);
-			if (LENGTH(x) > 1) {
-				SEXP sCT = VECTOR_ELT(x, 1); /* second element is content type if present */
-				if (TYPEOF(sCT) == STRSXP && LENGTH(sCT) > 0)
-					ct = CHAR(STRING_ELT(sCT, 0));
-				if (LENGTH(x) > 2) { /* third element is headers vector */
-					sHeaders = VECTOR_ELT(x, 2);
-					if (TYPEOF(sHeaders) != STRSXP)
-						sHeaders = R_NilValue;
-					if (LENGTH(x) > 3) /* fourth element is HTTP code */
-						code = asInteger(VECTOR_ELT(x, 3));
-				}
-			}
-			y = VECTOR_ELT(x, 0);
-			if (TYPEOF(y) == STRSXP && LENGTH(y) > 0) {
-				char buf[64];
-				int  is_tmp = 0;
-				const char *cs = CHAR(STRING_ELT(y, 0)), *fn = 0;
-				if (code == 200)
-					send_http_response(c, " 200 OK\r\nContent-type: ");
-				else {
-					sprintf(buf, "%s %d Code %d\r\nContent-type: ", HTTP_SIG(c), code, code);
-					send_response(c, buf, strlen(buf));
-				}
-				send_response(c, ct, strlen(ct));
-				if (sHeaders != R_NilValue) {
-					unsigned int i = 0, n = LENGTH(sHeaders);
-					for (; i < n; i++) {
-						const char *hs = CHAR(STRING_ELT(sHeaders, i));
-						if (*hs) { /* headers must be non-empty */
-							send_response(c, "\r\n", 2);
-							send_response(c, hs, strlen(hs));
-						}
-					}
-				}
-				/* special content - a file: either list(file="") or list(tmpfile="")
-				   the latter will be deleted once served */
-				if (TYPEOF(xNames) == STRSXP && LENGTH(xNames) > 0 &&
-					(!strcmp(CHAR(STRING_ELT(xNames, 0)), "file") || (is_tmp = !strcmp(CHAR(STRING_ELT(xNames, 0)), "tmpfile"))))
-					fn = cs;
-				if (fn) {
-					char *fbuf;
-					FILE *f = fopen(fn, "rb");
-					long fsz = 0;
-					if (!f) {
-						send_response(c, "\r\nContent-length: 0\r\n\r\n", 23);
-						UNPROTECT(7);
-						fin_request(c);
-						return;
-					}
-					fseek(f, 0, SEEK_END);
-					fsz = ftell(f);
-					fseek(f, 0, SEEK_SET);
-					sprintf(buf, "\r\nContent-length: %ld\r\n\r\n", fsz);
-					send_response(c, buf, strlen(buf));
-					if (c->method != METHOD_HEAD) {
-						fbuf = (char*) malloc(32768);
-						if (fbuf) {
-							while (fsz > 0 && !feof(f)) {
-								int rd = (fsz > 32768) ? 32768 : fsz;
-								if (fread(fbuf, 1, rd, f) != rd) {
-									free(fbuf);
-									UNPROTECT(7);
-									c->attr |= CONNECTION_CLOSE;
-									fclose(f);
-									if (is_tmp) unlink(fn);
-									return;
-								}
-								send_response(c, fbuf, rd);
-								fsz -= rd;
-							}
-							free(fbuf);
-						} else { /* allocation error - get out */
-							UNPROTECT(7);
-							c->attr |= CONNECTION_CLOSE;
-							fclose(f);
-							if (is_tmp) unlink(fn);
-							return;
-						}
-					}
-					fclose(f);
-					if (is_tmp) unlink(fn);
-					UNPROTECT(7);
-					fin_request(c);
-					return;
-				}
-				sprintf(buf, "\r\nContent-length: %u\r\n\r\n", (unsigned int) strlen(cs));
-				send_response(c, buf, strlen(buf));
-				if (c->method != METHOD_HEAD)
-					send_response(c, cs, strlen(cs));
-				UNPROTECT(7);
-				fin_request(c);
-				return;
-			}
-			if (TYPEOF(y) == RAWSXP) {
-				char buf[64];
-				Rbyte *cs = RAW(y);
-				if (code == 200)
-					send_http_response(c, " 200 OK\r\nContent-type: ");
-				else {
-					sprintf(buf, "%s %d Code %d\r\nContent-type: ", HTTP_SIG(c), code, code);
-					send_response(c, buf, strlen(buf));
-				}
-				send_response(c, ct, strlen(ct));
-				if (sHeaders != R_NilValue) {
-					unsigned int i = 0, n = LENGTH(sHeaders);
-					for (; i < n; i++) {
-						const char *hs = CHAR(STRING_ELT(sHeaders, i));
-						send_response(c, "\r\n", 2);
-						send_response(c, hs, strlen(hs));
-					}
-				}
-				sprintf(buf, "\r\nContent-length: %u\r\n\r\n", LENGTH(y));
-				send_response(c, buf, strlen(buf));
-				if (c->method != METHOD_HEAD)
-					send_response(c, (char*) cs, LENGTH(y));
-				UNPROTECT(7);
-				fin_request(c);
-				return;
-			}
-		}
+		http_respond(c, x);
+		server_flush(c);
 		UNPROTECT(7);
     }
-    send_http_response(c, " 500 Invalid response from R\r\nConnection: close\r\nContent-type: text/plain\r\n\r\nServer error: invalid response from R\r\n");
-    c->attr |= CONNECTION_CLOSE; /* force close */
 }
 
 static void http_close(args_t *arg) {
+	server_flush(arg);
 	closesocket(arg->s);
 	arg->s = -1;
 }
@@ -525,28 +1470,29 @@ static void http_input_iteration(args_t *c) {
 	
     DBG(printf("input handler for worker %p (sock=%d, part=%d, method=%d, line_pos=%d)\n", (void*) c, (int)c->s, (int)c->part, (int)c->method, (int)c->line_pos));
 	
-    /* FIXME: there is one edge case that is not caught on unix: if
-     * recv reads two or more full requests into the line buffer then
-     * this function exits after the first one, but input handlers may
-     * not trigger, because there may be no further data. It is not
-     * trivial to fix, because just checking for a full line at the
-     * beginning and not calling recv won't trigger a new input
-     * handler. However, under normal circumstance this should not
-     * happen, because clients should wait for the response and even
-     * if they don't it's unlikely that both requests get combined
-     * into one packet. */
+    /* Pipelining: the client may send further requests without waiting
+     * for the response, so a single recv can pull more than one request
+     * into the line buffer. Anything left over after a request has been
+     * served stays at the beginning of the line buffer and the next
+     * iteration parses it without calling recv as long as it contains a
+     * complete line. All callers iterate until the connection is closed,
+     * so pipelined requests are served back to back. */
     if (c->part < PART_BODY) {
 		char *s = c->line_buf;
-		n = srv->recv(c, c->line_buf + c->line_pos, LINE_BUF_SIZE - c->line_pos - 1);
-		DBG(printf("[recv n=%d, line_pos=%d, part=%d]\n", n, c->line_pos, (int)c->part));
-		if (n < 0) { /* error, scrape this worker */
-			http_close(c);
-			return;
-		}
-		if (n == 0) { /* connection closed -> try to process and then remove */
-			process_request(c);
-			http_close(c);
-			return;
+		if (c->line_pos > 0 && memchr(c->line_buf, '\n', c->line_pos)) /* left-over from the previous request */
+			n = 0;
+		else {
+			n = srv->recv(c, c->line_buf + c->line_pos, LINE_BUF_SIZE - c->line_pos - 1);
+			DBG(printf("[recv n=%d, line_pos=%d, part=%d]\n", n, c->line_pos, (int)c->part));
+			if (n < 0) { /* error, scrape this worker */
+				http_close(c);
+				return;
+			}
+			if (n == 0) { /* connection closed -> try to process and then remove */
+				process_request(c);
+				http_close(c);
+				return;
+			}
 		}
 		c->line_pos += n;
 		c->line_buf[c->line_pos] = 0;
@@ -562,13 +1508,31 @@ static void http_input_iteration(args_t *c) {
 					return;
 				}
 				if (c->attr & CONTENT_LENGTH && c->content_length) {
-					if (c->content_length < 0 ||  /* we are parsing signed so negative numbers are bad */
-						c->content_length > 2147483640 || /* R will currently have issues with body around 2Gb or more, so better to not go there */
-						!(c->body = (char*) malloc(c->content_length + 1 /* allocate an extra termination byte */ ))) {
+					/* forms are always parsed in memory, everything else
+					   goes into a file if it exceeds the limit */
+					int is_form = (c->attr & CONTENT_FORM_UENC) && !(c->srv->flags & HTTP_RAW_BODY);
+					if (c->content_length < 0) { /* we are parsing signed so negative numbers are bad */
+						send_http_response(c, " 400 Bad Request (invalid content length)\r\nConnection: close\r\n\r\n");
+						http_close(c);
+						return;
+					}
+					if (c->mp) {
+						/* multipart bodies are stored by the parser */
+					} else if (body_tmpfile_limit && !is_form && c->content_length > body_tmpfile_limit) {
+						if (create_body_file(c)) {
+							send_http_response(c, " 500 Unable to store request body\r\nConnection: close\r\n\r\n");
+							http_close(c);
+							return;
+						}
+					} else if (c->content_length > 2147483640 || /* R will currently have issues with body around 2Gb or more, so better to not go there */
+							   alloc_request_body(c, c->content_length + (is_form ? 1 : 0) /* forms need an extra termination byte */)) {
 						send_http_response(c, " 413 Request Entity Too Large (request body too big)\r\nConnection: close\r\n\r\n");
 						http_close(c);
 						return;
 					}
+				} else if (c->mp) { /* nothing to parse */
+					free_multipart(c->mp);
+					c->mp = NULL;
 				}
 				c->body_pos = 0;
 				c->part = PART_BODY;
@@ -591,25 +1555,24 @@ static void http_input_iteration(args_t *c) {
 						return;
 					}
 					/* keep-alive - reset the worker so it can process a new request */
-					if (c->url) { free(c->url); c->url = NULL; }
-					if (c->body) { free(c->body); c->body = NULL; }
-					if (c->content_type) { free(c->content_type); c->content_type = NULL; }
-					if (c->headers) { free_buffer(c->headers); c->headers = NULL; }
-					if (c->ws_key) { free(c->ws_key); c->ws_key = NULL; }
-					if (c->ws_protocol) { free(c->ws_protocol); c->ws_protocol = NULL; }
-					if (c->ws_version) { free(c->ws_version); c->ws_version = NULL; }
-					c->body_pos = 0;
-					c->method = 0;
-					c->part = PART_REQUEST;
-					c->attr = 0;
-					c->content_length = 0;
+					reset_request(c);
 					return;
 				}
 				/* copy body content (as far as available) */
-				c->body_pos = (c->content_length < c->line_pos) ? c->content_length : c->line_pos;
-				if (c->body_pos) {
-					memcpy(c->body, c->line_buf, c->body_pos);
-					c->line_pos -= c->body_pos; /* NOTE: we are NOT moving the buffer since non-zero left-over causes connection close */
+				{
+					long avail = (c->content_length < c->line_pos) ? c->content_length : c->line_pos;
+					if (avail) {
+						if (store_body(c, c->line_buf, avail)) {
+							send_http_response(c, c->mp ? " 400 Bad Request (invalid multipart body)\r\nConnection: close\r\n\r\n" :
+											   " 500 Unable to store request body\r\nConnection: close\r\n\r\n");
+							http_close(c);
+							return;
+						}
+						/* anything beyond the body is the next (pipelined) request */
+						c->line_pos -= avail;
+						if (c->line_pos)
+							memmove(c->line_buf, c->line_buf + avail, c->line_pos);
+					}
 				}
 				/* POST will continue into the BODY part */
 				break;
@@ -638,6 +1601,11 @@ static void http_input_iteration(args_t *c) {
 						/* --- process request line --- */
 						unsigned int rll = strlen(bol); /* request line length */
 						char *url = strchr(bol, ' ');
+						if (http2_enabled && !strcmp(bol, "PRI * HTTP/2.0")) { /* HTTP/2 with prior knowledge */
+							http2_serve(c, s, c->line_buf + c->line_pos - s, s - bol, 0, 0, 0, http2_request);
+							http_close(c);
+							return;
+						}
 						if (!url || rll < 14 || strncmp(bol + rll - 9, " HTTP/1.", 8)) { /* each request must have at least 14 characters [GET / HTTP/1.0] and have HTTP/1.x */
 							send_response(c, "HTTP/1.0 400 Bad Request\r\n\r\n", 28);
 							http_close(c);
@@ -713,12 +1681,25 @@ static void http_input_iteration(args_t *c) {
 							DBG(printf("header '%s' => '%s'\n", bol, k));
 							if (!strcmp(bol, "upgrade") && !strcmp(k, "websocket"))
 								c->attr |= WS_UPGRADE;
+							if (http2_enabled && !strcmp(bol, "upgrade") && !strncmp(k, "h2c", 3) && (!k[3] || k[3] == ',' || k[3] == ' '))
+								c->attr |= H2C_UPGRADE;
+							if (!strcmp(bol, "http2-settings")) {
+								if (c->h2_settings) free(c->h2_settings);
+								c->h2_settings = strdup(k);
+							}
 							if (!strcmp(bol, "content-length")) {
 								c->attr |= CONTENT_LENGTH;
 								c->content_length = atol(k);
 							}
 							if (!strcmp(bol, "content-type")) {
 								char *l = k;
+								if (c->mp) {
+									free_multipart(c->mp);
+									c->mp = NULL;
+								}
+								/* multipart bodies are parsed as they arrive (the boundary is case-sensitive) */
+								if (!(c->srv->flags & HTTP_RAW_BODY))
+									c->mp = new_multipart(k);
 								while (*l) { if (*l >= 'A' && *l <= 'Z') *l |= 0x20; l++; }
 								c->attr |= CONTENT_TYPE;
 								if (c->content_type) free(c->content_type);
@@ -728,6 +1709,8 @@ static void http_input_iteration(args_t *c) {
 							}
 							if (!strcmp(bol, "host"))
 								c->attr |= HOST_HEADER;
+							if (!strcmp(bol, "accept-encoding"))
+								c->attr |= parse_accept_encoding(k);
 							if (!strcmp(bol, "connection")) {
 								char *l = k;
 								while (*l) { if (*l >= 'A' && *l <= 'Z') *l |= 0x20; l++; }
@@ -746,6 +1729,10 @@ static void http_input_iteration(args_t *c) {
 								if (c->ws_version) free(c->ws_version);
 								c->ws_version = strdup(k);
 							}
+							if (!strcmp(bol, "sec-websocket-extensions")) {
+								if (c->ws_extensions) free(c->ws_extensions);
+								c->ws_extensions = strdup(k);
+							}
 							DBG(Rprintf(" [attr = %x]\n", c->attr));
 						}
 					}
@@ -758,11 +1745,15 @@ static void http_input_iteration(args_t *c) {
 			return;
 		}
     }
-    if (c->part == PART_BODY && c->body) { /* BODY  - this branch always returns */
+    if (c->part == PART_BODY && (c->body || c->body_file || c->mp)) { /* BODY  - this branch always returns */
 		if (c->body_pos < c->content_length) { /* need to receive more ? */
-			DBG(printf("BODY: body_pos=%d, content_length=%ld\n", c->body_pos, c->content_length));
-			n = srv->recv(c, c->body + c->body_pos, c->content_length - c->body_pos);
-			DBG(printf("      [recv n=%d - had %u of %lu]\n", n, c->body_pos, c->content_length));
+			long need = c->content_length - c->body_pos;
+			DBG(printf("BODY: body_pos=%ld, content_length=%ld\n", c->body_pos, c->content_length));
+			if (c->body_file || c->mp) /* file and multipart bodies go through the line buffer */
+				n = srv->recv(c, c->line_buf, (need < LINE_BUF_SIZE) ? need : LINE_BUF_SIZE);
+			else /* receive directly into the body vector */
+				n = srv->recv(c, c->body + c->body_pos, (need < 2147483647) ? need : 2147483647);
+			DBG(printf("      [recv n=%d - had %ld of %ld]\n", n, c->body_pos, c->content_length));
 			c->line_pos = 0;
 			if (n < 0) { /* error, scrap this worker */
 				http_close(c);
@@ -773,33 +1764,36 @@ static void http_input_iteration(args_t *c) {
 				http_close(c);
 				return;
 			}
-			c->body_pos += n;
+			if (c->body_file || c->mp) {
+				if (store_body(c, c->line_buf, n)) {
+					send_http_response(c, c->mp ? " 400 Bad Request (invalid multipart body)\r\nConnection: close\r\n\r\n" :
+									   " 500 Unable to store request body\r\nConnection: close\r\n\r\n");
+					http_close(c);
+					return;
+				}
+			} else
+				c->body_pos += n;
 		}
 		if (c->body_pos == c->content_length) { /* yay! we got the whole body */
+			if (c->mp && c->mp->state != MP_DONE) { /* final boundary missing */
+				send_http_response(c, " 400 Bad Request (invalid multipart body)\r\nConnection: close\r\n\r\n");
+				http_close(c);
+				return;
+			}
 			process_request(c);
-			if (c->attr & CONNECTION_CLOSE || c->line_pos) { /* we have to close the connection if there was a double-hit */
+			if (c->attr & CONNECTION_CLOSE) {
 				http_close(c);
 				return;
 			}
-			/* keep-alive - reset the worker so it can process a new request */
-			if (c->url) { free(c->url); c->url = NULL; }
-			if (c->body) { free(c->body); c->body = NULL; }
-			if (c->content_type) { free(c->content_type); c->content_type = NULL; }
-			if (c->headers) { free_buffer(c->headers); c->headers = NULL; }
-			if (c->ws_key) { free(c->ws_key); c->ws_key = NULL; }
-			if (c->ws_protocol) { free(c->ws_protocol); c->ws_protocol = NULL; }
-			if (c->ws_version) { free(c->ws_version); c->ws_version = NULL; }
-			c->line_pos = 0; c->body_pos = 0;
-			c->method = 0;
-			c->part = PART_REQUEST;
-			c->attr = 0;
-			c->content_length = 0;
+			/* keep-alive - reset the worker so it can process a new request,
+			   line_buf may already contain the next one */
+			reset_request(c);
 			return;
 		}
     }
 	
     /* we enter here only if recv was used to leave the headers with no body */
-    if (c->part == PART_BODY && !c->body) {
+    if (c->part == PART_BODY && !c->body && !c->body_file && !c->mp) {
 		char *s = c->line_buf;
 		if (c->line_pos > 0) {
 			if ((s[0] != '\r' || s[1] != '\n') && (s[0] != '\n')) {
@@ -822,18 +1816,7 @@ static void http_input_iteration(args_t *c) {
 					c->line_pos -= sh;
 				}
 				/* keep-alive - reset the worker so it can process a new request */
-				if (c->url) { free(c->url); c->url = NULL; }
-				if (c->body) { free(c->body); c->body = NULL; }
-				if (c->content_type) { free(c->content_type); c->content_type = NULL; }
-				if (c->headers) { free_buffer(c->headers); c->headers = NULL; }
-				if (c->ws_key) { free(c->ws_key); c->ws_key = NULL; }
-				if (c->ws_protocol) { free(c->ws_protocol); c->ws_protocol = NULL; }
-				if (c->ws_version) { free(c->ws_version); c->ws_version = NULL; }
-				c->body_pos = 0;
-				c->method = 0;
-				c->part = PART_REQUEST;
-				c->attr = 0;
-				c->content_length = 0;
+				reset_request(c);
 				return;
 			}
 		}
@@ -855,9 +1838,1463 @@ static void http_input_iteration(args_t *c) {
     }
 }
 
+/* --- HTTP/2 ---
+
+   Requests on HTTP/2 streams are passed to us in HTTP/1.1 form and run
+   through the regular parser and handler with the output captured, see
+   http2.c for the conversion from and to HTTP/2 frames. */
+
+static const char *h2_req;
+static unsigned long h2_req_pos, h2_req_len;
+static char *h2_res;
+static unsigned long h2_res_len, h2_res_size;
+
+static int h2_capture_recv(args_t *c, void *buf, rlen_t len) {
+	if (len > h2_req_len - h2_req_pos)
+		len = h2_req_len - h2_req_pos;
+	memcpy(buf, h2_req + h2_req_pos, len);
+	h2_req_pos += len;
+	return len;
+}
+
+static int h2_capture_send(args_t *c, const void *buf, rlen_t len) {
+	if (h2_res_len + len > h2_res_size) {
+		unsigned long ns = h2_res_size ? h2_res_size : 16384;
+		char *nb;
+		while (ns < h2_res_len + len) ns <<= 1;
+		if (!(nb = (char*) realloc(h2_res, ns)))
+			return -1;
+		h2_res = nb;
+		h2_res_size = ns;
+	}
+	memcpy(h2_res + h2_res_len, buf, len);
+	h2_res_len += len;
+	return len;
+}
+
+/* runs fn (which serves the request in c) with the response captured into h2_res */
+static void h2_capture(args_t *c, void (*fn)(args_t*)) {
+	server_t *srv = c->srv, hsrv = *srv;
+	SOCKET s = c->s;
+	hsrv.recv = h2_capture_recv;
+	hsrv.send = h2_capture_send;
+	hsrv.flush = 0;
+	c->srv = &hsrv;
+	/* the parser closes the socket when the connection is to be closed,
+	   so give it a descriptor it can close */
+	c->s = dup(s);
+	h2_res = 0;
+	h2_res_len = h2_res_size = 0;
+	fn(c);
+	if (c->s != -1)
+		closesocket(c->s);
+	c->s = s;
+	c->srv = srv;
+}
+
+static void h2_parse_request(args_t *c) {
+	unsigned long served = requests_processed;
+	while (c->s != -1 && requests_processed == served)
+		http_input_iteration(c);
+}
+
+static int http2_request(args_t *c, const char *req, unsigned long req_len, char **res, unsigned long *res_len) {
+	h2_req = req;
+	h2_req_pos = 0;
+	h2_req_len = req_len;
+	c->line_pos = 0;
+	h2_capture(c, h2_parse_request);
+	reset_request(c);
+	c->line_pos = 0;
+	*res = h2_res;
+	*res_len = h2_res_len;
+	h2_res = 0;
+	return 0;
+}
+
+/* the current request asked for an upgrade to h2c: serve it as stream 1 and continue with HTTP/2 */
+static void h2c_upgrade(args_t *c) {
+	char *res, *settings = c->h2_settings;
+	unsigned long res_len;
+	const char *sw = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+	c->attr &= ~H2C_UPGRADE;
+	c->h2_settings = 0;
+	h2_capture(c, process_request);
+	res = h2_res;
+	res_len = h2_res_len;
+	h2_res = 0;
+	if (c->srv->send(c, sw, strlen(sw)) < (int) strlen(sw)) {
+		if (res) free(res);
+		if (settings) free(settings);
+		return;
+	}
+	if (!res) { /* we need some response for stream 1 */
+		res = strdup("HTTP/1.1 500 Server error\r\nContent-length: 0\r\n\r\n");
+		res_len = res ? strlen(res) : 0;
+	}
+	reset_request(c);
+	/* anything after the request is already HTTP/2 */
+	http2_serve(c, c->line_buf, c->line_pos, 0, res, res_len, settings, http2_request);
+	c->line_pos = 0;
+	if (settings) free(settings);
+}
+
+/* --- pre-forked worker pool ---
+
+   If enabled (http.workers > 0) plain HTTP connections are not served
+   by a forked child per connection. Instead the server hands accepted
+   connections over to a single I/O process which owns all HTTP
+   sockets in an event loop. It only parses as much of each request
+   as is needed to find where it ends and dispatches complete requests
+   to a pool of long-lived R workers over unix sockets. The workers
+   run the regular request parser and R handler, their responses are
+   relayed back to the client by the I/O process. Idle keep-alive
+   connections thus only cost a few buffers instead of an R process
+   and are closed after http.keepalive.timeout seconds.
+   WebSocket upgrade requests are handed to a dedicated child as usual.
+
+   The I/O process and the workers exchange frames consisting of a
+   pool_frame_t header followed by len bytes of payload. */
+
+#define PF_END   1  /* last frame of a response */
+#define PF_CLOSE 2  /* response: client connection is to be closed after the response,
+					   request: client has closed the connection */
+
+typedef struct pool_frame {
+	unsigned int len, flags, id;
+} pool_frame_t;
+
+#define POOL_WBUF_SIZE (64*1024)    /* worker output buffer */
+#define POOL_OBUF_MAX  (1024*1024)  /* pending output above which workers are not read */
+
+static int pool_workers = 0;
+static int pool_idle_timeout = 60;  /* idle connections are closed after this many seconds (0 = never) */
+
+void set_http_workers(int n) {
+	pool_workers = (n > 0) ? n : 0;
+}
+
+void set_http_keepalive_timeout(int sec) {
+	pool_idle_timeout = (sec > 0) ? sec : 0;
+}
+
+static int read_full(int fd, void *buf, unsigned int len) {
+	char *c = (char*) buf;
+	while (len) {
+		int n = read(fd, c, len);
+		if (n < 1) {
+			if (n < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, unsigned int len) {
+	const char *c = (const char*) buf;
+	while (len) {
+		int n = write(fd, c, len);
+		if (n < 1) {
+			if (n < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* --- worker side --- */
+
+static int pool_fd = -1;            /* worker: socket connected to the I/O process */
+static unsigned int pool_id;        /* worker: id of the request being served */
+static pool_frame_t pool_next;      /* worker: look-ahead frame (start of the next request) */
+static int pool_has_next;
+static char *pend_buf;              /* data received but not consumed by the parser yet */
+static unsigned int pend_pos, pend_len, pend_size;
+static int pool_closed;             /* worker: client has closed the connection */
+static char *pool_wbuf;
+static unsigned int pool_wlen;
+
+/* reads a frame into the pending buffer */
+static int pool_read_frame(int fd, pool_frame_t *f) {
+	if (read_full(fd, f, sizeof(pool_frame_t)))
+		return -1;
+	if (f->len > pend_size) {
+		char *nb = (char*) realloc(pend_buf, f->len);
+		if (!nb) return -1;
+		pend_buf = nb;
+		pend_size = f->len;
+	}
+	pend_pos = pend_len = 0;
+	if (f->len && read_full(fd, pend_buf, f->len))
+		return -1;
+	pend_len = f->len;
+	return 0;
+}
+
+static int pool_flush(unsigned int flags) {
+	pool_frame_t f;
+	f.len = pool_wlen;
+	f.flags = flags;
+	f.id = pool_id;
+	pool_wlen = 0;
+	if (write_full(pool_fd, &f, sizeof(f)) || (f.len && write_full(pool_fd, pool_wbuf, f.len)))
+		return -1;
+	return 0;
+}
+
+/* recv for workers: serves the request data sent by the I/O process,
+   returns 0 (as if the connection was closed) if the request is incomplete */
+static int pool_worker_recv(args_t *c, void *buf, rlen_t len) {
+	while (pend_pos >= pend_len) {
+		pool_frame_t f;
+		if (pool_has_next || pool_closed)
+			return 0;
+		if (pool_read_frame(pool_fd, &f))
+			exit(0); /* the I/O process is gone */
+		if (f.id != pool_id) { /* next request already - keep it for later */
+			pool_next = f;
+			pool_has_next = 1;
+			return 0;
+		}
+		if (f.flags & PF_CLOSE) {
+			pool_closed = 1;
+			return 0;
+		}
+	}
+	if (len > pend_len - pend_pos)
+		len = pend_len - pend_pos;
+	memcpy(buf, pend_buf + pend_pos, len);
+	pend_pos += len;
+	return len;
+}
+
+/* send for workers: buffers the response and passes it to the I/O process.
+   Frames are never larger than POOL_WBUF_SIZE so the I/O process can
+   relay big responses piece by piece */
+static int pool_worker_send(args_t *c, const void *buf, rlen_t len) {
+	const char *src = (const char*) buf;
+	rlen_t left = len;
+	if (pool_wlen + len > POOL_WBUF_SIZE) {
+		if (pool_flush(0))
+			return -1;
+		while (left >= POOL_WBUF_SIZE) { /* big chunks are passed without copying */
+			pool_frame_t f;
+			f.len = POOL_WBUF_SIZE;
+			f.flags = 0;
+			f.id = pool_id;
+			if (write_full(pool_fd, &f, sizeof(f)) || write_full(pool_fd, src, POOL_WBUF_SIZE))
+				return -1;
+			src += POOL_WBUF_SIZE;
+			left -= POOL_WBUF_SIZE;
+		}
+	}
+	memcpy(pool_wbuf + pool_wlen, src, left);
+	pool_wlen += left;
+	return len;
+}
+
+static void pool_worker(server_t *srv, int fd) {
+	static server_t wsrv;
+	args_t *c = (args_t*) calloc(1, sizeof(args_t));
+	if (!c || !(c->line_buf = (char*) malloc(LINE_BUF_SIZE)) || !(pool_wbuf = (char*) malloc(POOL_WBUF_SIZE))) {
+		RSEprintf("ERROR: unable to allocate HTTP worker buffers\n");
+		exit(1);
+	}
+	wsrv = *srv;
+	wsrv.recv = pool_worker_recv;
+	wsrv.send = pool_worker_send;
+	c->srv = &wsrv;
+	pool_fd = fd;
+	while (1) {
+		pool_frame_t f;
+		unsigned long served = requests_processed;
+		if (pool_has_next) {
+			f = pool_next;
+			pool_has_next = 0;
+		} else if (pool_read_frame(fd, &f))
+			break;
+		if (f.id == pool_id) /* left-over of a request that has been already answered */
+			continue;
+		pool_id = f.id;
+		pool_closed = 0;
+		/* the parser closes the socket when the connection is to be closed,
+		   so give it a descriptor it can close */
+		c->s = dup(fd);
+		while (c->s != -1 && requests_processed == served)
+			http_input_iteration(c);
+		if (pool_flush(PF_END | ((c->s == -1) ? PF_CLOSE : 0)))
+			break;
+		if (c->s != -1) {
+			closesocket(c->s);
+			c->s = -1;
+		}
+		reset_request(c);
+		c->line_pos = 0;
+	}
+	exit(0);
+}
+
+/* recv used by connections handed over by the I/O process:
+   first serves data already read by the I/O process */
+static int pool_handoff_recv(args_t *c, void *buf, rlen_t len) {
+	if (pend_pos < pend_len) {
+		if (len > pend_len - pend_pos)
+			len = pend_len - pend_pos;
+		memcpy(buf, pend_buf + pend_pos, len);
+		pend_pos += len;
+		return len;
+	}
+	return server_recv(c, buf, len);
+}
+
+/* --- event loop abstraction (epoll if available, poll otherwise) --- */
+
+#define EV_READ  1
+#define EV_WRITE 2
+
+#ifdef HAVE_SYS_EPOLL_H
+static int ev_fd = -1;
+
+static int ev_init() {
+	return (ev_fd = epoll_create(64));
+}
+
+static int ev_ctl(int fd, int ev, int op) {
+	struct epoll_event e;
+	memset(&e, 0, sizeof(e));
+	e.events = ((ev & EV_READ) ? EPOLLIN : 0) | ((ev & EV_WRITE) ? EPOLLOUT : 0);
+	e.data.fd = fd;
+	return epoll_ctl(ev_fd, op, fd, &e);
+}
+
+#define ev_add(FD, EV) ev_ctl(FD, EV, EPOLL_CTL_ADD)
+#define ev_mod(FD, EV) ev_ctl(FD, EV, EPOLL_CTL_MOD)
+#define ev_del(FD)     ev_ctl(FD, 0, EPOLL_CTL_DEL)
+
+static int ev_wait(int *fds, int *evs, int max, int timeout) {
+	struct epoll_event e[64];
+	int i, n;
+	if (max > 64) max = 64;
+	n = epoll_wait(ev_fd, e, max, timeout);
+	for (i = 0; i < n; i++) {
+		fds[i] = e[i].data.fd;
+		evs[i] = ((e[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? EV_READ : 0) |
+			((e[i].events & EPOLLOUT) ? EV_WRITE : 0);
+	}
+	return n;
+}
+
+static void ev_close() {
+	if (ev_fd != -1) close(ev_fd);
+	ev_fd = -1;
+}
+#else
+static struct pollfd *ev_pfd;
+static int ev_n, ev_size;
+
+static int ev_init() {
+	ev_size = 64;
+	ev_n = 0;
+	return (ev_pfd = (struct pollfd*) malloc(sizeof(struct pollfd) * ev_size)) ? 0 : -1;
+}
+
+static int ev_add(int fd, int ev) {
+	if (ev_n >= ev_size) {
+		struct pollfd *np = (struct pollfd*) realloc(ev_pfd, sizeof(struct pollfd) * ev_size * 2);
+		if (!np) return -1;
+		ev_pfd = np;
+		ev_size *= 2;
+	}
+	ev_pfd[ev_n].fd = fd;
+	ev_pfd[ev_n].events = ((ev & EV_READ) ? POLLIN : 0) | ((ev & EV_WRITE) ? POLLOUT : 0);
+	ev_pfd[ev_n++].revents = 0;
+	return 0;
+}
+
+static int ev_mod(int fd, int ev) {
+	int i;
+	for (i = 0; i < ev_n; i++)
+		if (ev_pfd[i].fd == fd) {
+			ev_pfd[i].events = ((ev & EV_READ) ? POLLIN : 0) | ((ev & EV_WRITE) ? POLLOUT : 0);
+			return 0;
+		}
+	return -1;
+}
+
+static int ev_del(int fd) {
+	int i;
+	for (i = 0; i < ev_n; i++)
+		if (ev_pfd[i].fd == fd) {
+			ev_pfd[i] = ev_pfd[--ev_n];
+			return 0;
+		}
+	return -1;
+}
+
+static int ev_wait(int *fds, int *evs, int max, int timeout) {
+	int i, n = 0;
+	if (poll(ev_pfd, ev_n, timeout) < 0)
+		return -1;
+	for (i = 0; i < ev_n && n < max; i++)
+		if (ev_pfd[i].revents) {
+			fds[n] = ev_pfd[i].fd;
+			evs[n++] = ((ev_pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) ? EV_READ : 0) |
+				((ev_pfd[i].revents & POLLOUT) ? EV_WRITE : 0);
+		}
+	return n;
+}
+
+static void ev_close() {
+	if (ev_pfd) free(ev_pfd);
+	ev_pfd = 0;
+	ev_n = 0;
+}
+#endif
+
+/* --- I/O process side --- */
+
+#define PC_CLOSE    1 /* close the connection once all output has been sent */
+#define PC_EOF      2 /* the client has closed its side */
+
+typedef struct pool_conn {
+	int s;
+	char *ibuf;                 /* input received from the client */
+	unsigned int ilen, isize;
+	char *obuf;                 /* output pending to be sent to the client */
+	unsigned int opos, olen, osize;
+	long req_left;              /* bytes of the current request still to be passed to the worker */
+	int worker;                 /* index of the worker serving this connection or -1 */
+	int flags;                  /* PC_* flags */
+	int ev;                     /* events we are currently waiting for */
+	struct pool_conn *next;     /* next connection in the dispatch queue */
+	char *cache_key;            /* if set, the response is captured for the cache */
+	char *cap;                  /* captured response */
+	unsigned int caplen, capsize;
+	time_t last_active;         /* last time anything was received or sent */
+} pool_conn_t;
+
+typedef struct pool_worker {
+	int fd;
+	pid_t pid;
+	pool_conn_t *conn;          /* connection being served (NULL if it was closed in the meantime) */
+	int busy;                   /* serving a request */
+	unsigned int id;            /* id of the request being served */
+	int paused;                 /* we stop reading while the client is catching up */
+	char *wbuf;                 /* frames queued to be sent to the worker */
+	unsigned int wpos, wlen, wsize;
+	pool_frame_t in;            /* frame being received from the worker */
+	unsigned int in_pos;        /* bytes of it (header and payload) received so far */
+} pool_worker_t;
+
+static pool_worker_t *pworkers;
+static pool_conn_t **pconns;    /* connections indexed by socket */
+static int pconns_size;
+static pool_conn_t *pqueue, *pqueue_tail; /* connections waiting for a worker */
+static unsigned int pool_seq;
+static int pool_master = -1;    /* I/O process: socket to the server, master: socket to the I/O process */
+static server_t *pool_srv;
+
+static void pool_close_all_but(int keep) {
+	int i;
+	for (i = 0; i < pconns_size; i++)
+		if (pconns[i] && pconns[i]->s != keep)
+			closesocket(pconns[i]->s);
+	for (i = 0; i < pool_workers; i++)
+		if (pworkers[i].fd != -1 && pworkers[i].fd != keep)
+			close(pworkers[i].fd);
+	if (pool_master != -1 && pool_master != keep)
+		close(pool_master);
+	ev_close();
+}
+
+static int pool_spawn_worker(int i) {
+	int sv[2];
+	pid_t pid;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	if ((pid = fork()) == 0) {
+		pworkers[i].fd = -1;
+		close(sv[0]);
+		pool_close_all_but(sv[1]);
+		pool_worker(pool_srv, sv[1]);
+		exit(0);
+	}
+	close(sv[1]);
+	if (pid < 0) {
+		close(sv[0]);
+		return -1;
+	}
+	pworkers[i].fd = sv[0];
+	pworkers[i].pid = pid;
+	pworkers[i].conn = 0;
+	pworkers[i].busy = 0;
+	pworkers[i].paused = 0;
+	pworkers[i].wpos = pworkers[i].wlen = 0;
+	pworkers[i].in_pos = 0;
+	ev_add(sv[0], EV_READ);
+	return 0;
+}
+
+static void pool_worker_events(pool_worker_t *w) {
+	ev_mod(w->fd, (w->paused ? 0 : EV_READ) | ((w->wlen > w->wpos) ? EV_WRITE : 0));
+}
+
+/* sends as much of the queued frames as the worker takes without
+   blocking. Returns -1 if the worker is gone */
+static int pool_worker_flush(pool_worker_t *w) {
+	while (w->wlen > w->wpos) {
+		int n = send(w->fd, w->wbuf + w->wpos, w->wlen - w->wpos, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		w->wpos += n;
+	}
+	if (w->wpos == w->wlen)
+		w->wpos = w->wlen = 0;
+	return 0;
+}
+
+/* queues a frame for the worker, so a busy worker never stalls the
+   I/O process. Returns -1 if the worker is gone or on allocation error */
+static int pool_worker_queue(pool_worker_t *w, unsigned int flags, const char *buf, unsigned int len) {
+	pool_frame_t f;
+	if (w->wpos && w->wlen + sizeof(f) + len > w->wsize) {
+		memmove(w->wbuf, w->wbuf + w->wpos, w->wlen - w->wpos);
+		w->wlen -= w->wpos;
+		w->wpos = 0;
+	}
+	if (w->wlen + sizeof(f) + len > w->wsize) {
+		unsigned int ns = w->wsize ? w->wsize : 16384;
+		char *nb;
+		while (ns < w->wlen + sizeof(f) + len) ns <<= 1;
+		if (!(nb = (char*) realloc(w->wbuf, ns)))
+			return -1;
+		w->wbuf = nb;
+		w->wsize = ns;
+	}
+	f.len = len;
+	f.flags = flags;
+	f.id = w->id;
+	memcpy(w->wbuf + w->wlen, &f, sizeof(f));
+	if (len)
+		memcpy(w->wbuf + w->wlen + sizeof(f), buf, len);
+	w->wlen += sizeof(f) + len;
+	if (pool_worker_flush(w))
+		return -1;
+	pool_worker_events(w);
+	return 0;
+}
+
+static void pool_update_conn(pool_conn_t *c) {
+	int ev = 0;
+	/* don't read while a request is being served unless it is the body,
+	   but read at least until the request head is complete. Reading
+	   also stops while too much is queued for the worker */
+	if (!(c->flags & (PC_CLOSE | PC_EOF)) &&
+		(c->worker < 0 || pworkers[c->worker].wlen - pworkers[c->worker].wpos < POOL_OBUF_MAX) &&
+		((c->worker >= 0) ? (c->req_left > 0 || c->ilen < LINE_BUF_SIZE) : (c->ilen < LINE_BUF_SIZE)))
+		ev |= EV_READ;
+	if (c->olen > c->opos)
+		ev |= EV_WRITE;
+	if (ev != c->ev) {
+		ev_mod(c->s, ev);
+		c->ev = ev;
+	}
+}
+
+static void pool_add_conn(int s) {
+	pool_conn_t *c;
+	if (s >= pconns_size) {
+		int ns = pconns_size ? pconns_size : 64;
+		pool_conn_t **np;
+		while (ns <= s) ns <<= 1;
+		if (!(np = (pool_conn_t**) realloc(pconns, sizeof(pool_conn_t*) * ns))) {
+			closesocket(s);
+			return;
+		}
+		memset(np + pconns_size, 0, sizeof(pool_conn_t*) * (ns - pconns_size));
+		pconns = np;
+		pconns_size = ns;
+	}
+	if (!(c = (pool_conn_t*) calloc(1, sizeof(pool_conn_t)))) {
+		closesocket(s);
+		return;
+	}
+	c->s = s;
+	c->worker = -1;
+	c->ev = EV_READ;
+	c->last_active = time(0);
+	pconns[s] = c;
+#ifdef CAN_TCP_NODELAY
+	{
+		int opt = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*) &opt, sizeof(opt));
+	}
+#endif
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	ev_add(s, EV_READ);
+}
+
+/* tells the worker that the client is gone if it is still waiting for the request body */
+static void pool_abort(pool_conn_t *c) {
+	if (c->worker >= 0 && c->req_left > 0) {
+		/* a failure means the worker is gone, it will be replaced */
+		pool_worker_queue(pworkers + c->worker, PF_CLOSE, 0, 0);
+		c->req_left = 0;
+	}
+}
+
+static void pool_rm_conn(pool_conn_t *c) {
+	if (c->worker >= 0) { /* let the worker finish, but discard its output */
+		pool_worker_t *w = pworkers + c->worker;
+		pool_abort(c);
+		w->conn = 0;
+		if (w->paused) {
+			w->paused = 0;
+			pool_worker_events(w);
+		}
+	}
+	if (c->next || pqueue_tail == c) { /* remove from the queue */
+		pool_conn_t *q = pqueue, *prev = 0;
+		while (q && q != c) { prev = q; q = q->next; }
+		if (q) {
+			if (prev) prev->next = c->next; else pqueue = c->next;
+			if (pqueue_tail == c) pqueue_tail = prev;
+		}
+	}
+	ev_del(c->s);
+	closesocket(c->s);
+	pconns[c->s] = 0;
+	if (c->ibuf) free(c->ibuf);
+	if (c->obuf) free(c->obuf);
+	if (c->cache_key) free(c->cache_key);
+	if (c->cap) free(c->cap);
+	free(c);
+}
+
+/* finds the end of the request at the beginning of the buffer.
+   Returns its length (head and body), 0 if the head is incomplete
+   and -1 if the head is too big. upgrade is set if the request asks
+   for a WebSocket or HTTP/2 upgrade (or is the HTTP/2 preface) and
+   head_len to the length of the head. */
+static long pool_request_length(const char *buf, unsigned int len, int *upgrade, long *head_len) {
+	const char *c = buf, *e = buf + len, *eoh = 0;
+	long cl = 0;
+	*upgrade = 0;
+	while (c < e) { /* find an empty line */
+		if (*c == '\n') { eoh = c + 1; break; }
+		if (*c == '\r' && c + 1 < e && c[1] == '\n') { eoh = c + 2; break; }
+		while (c < e && *c != '\n') c++;
+		if (c < e) c++;
+	}
+	if (!eoh)
+		return (len >= LINE_BUF_SIZE - 1) ? -1 : 0;
+	for (c = buf; c < eoh; ) { /* the few headers we need to know about */
+		const char *eol = c;
+		while (eol < eoh && *eol != '\n') eol++;
+		if (eol - c > 15 && !strncasecmp(c, "content-length:", 15))
+			cl = atol(c + 15);
+		else if (eol - c > 8 && !strncasecmp(c, "upgrade:", 8)) {
+			const char *v = c + 8;
+			while (v < eol && (*v == ' ' || *v == '\t')) v++;
+			if ((eol - v >= 9 && !strncasecmp(v, "websocket", 9)) ||
+				(http2_enabled && eol - v >= 3 && !strncasecmp(v, "h2c", 3)))
+				*upgrade = 1;
+		}
+		c = eol + 1;
+	}
+	if (http2_enabled && len >= 14 && !strncmp(buf, "PRI * HTTP/2.0", 14))
+		*upgrade = 1;
+	if (cl < 0) cl = 0;
+	*head_len = eoh - buf;
+	return (eoh - buf) + cl;
+}
+
+/* hands a connection requesting a WebSocket or HTTP/2 upgrade to a dedicated child */
+static void pool_handoff(pool_conn_t *c) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		static server_t hsrv;
+		args_t *arg = (args_t*) calloc(1, sizeof(args_t));
+		int s = c->s;
+		pool_close_all_but(s);
+		if (!arg || !(arg->line_buf = (char*) malloc(LINE_BUF_SIZE)))
+			exit(1);
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL) & (~O_NONBLOCK));
+		pend_buf = c->ibuf;
+		pend_pos = 0;
+		pend_len = c->ilen;
+		hsrv = *pool_srv;
+		hsrv.recv = pool_handoff_recv;
+		arg->srv = &hsrv;
+		arg->s = s;
+		while (arg->s != -1)
+			http_input_iteration(arg);
+		free_args(arg);
+		exit(0);
+	}
+	pool_rm_conn(c);
+}
+
+/* pass the next part of the request to the worker */
+static int pool_forward(pool_conn_t *c) {
+	pool_worker_t *w = pworkers + c->worker;
+	unsigned int n = (c->req_left < c->ilen) ? c->req_left : c->ilen;
+	if (!n) return 0;
+	if (pool_worker_queue(w, 0, c->ibuf, n))
+		return -1;
+	c->req_left -= n;
+	c->ilen -= n;
+	if (c->ilen)
+		memmove(c->ibuf, c->ibuf + n, c->ilen);
+	return 0;
+}
+
+/* --- response cache of the I/O process ---
+
+   Responses to GET requests are cached if the handler opts in by
+   setting Cache-Control: max-age (or s-maxage) and the response is
+   not marked as no-store, no-cache or private and doesn't set
+   cookies. The cache is keyed by the Host: header, the request target
+   (URL and query) and the accepted content encodings. Hits (GET and
+   HEAD) are served by the I/O process without involving R, including
+   304 responses to conditional requests with matching If-None-Match.
+   Responses without an ETag get one computed from the content.
+   Entries are evicted in LRU order once the size limit is reached. */
+
+#define CACHE_HASH_SIZE 1024
+
+typedef struct cache_entry {
+	struct cache_entry *prev, *next; /* LRU list, most recently used first */
+	struct cache_entry *hnext;       /* hash chain */
+	unsigned int hash;
+	char *key;
+	char *data;                      /* the complete response without the leading "HTTP/1.x" */
+	unsigned int len, head_len, sline_len; /* total length, length of the head and the status line (incl. CRLF) */
+	char *h304;                      /* Cache-Control, Expires and Vary lines to send with a 304 (stored after the body) */
+	unsigned int h304_len;
+	char etag[72];
+	time_t stored, expires;
+} cache_entry_t;
+
+static cache_entry_t *cache_tab[CACHE_HASH_SIZE], *cache_lru, *cache_lru_tail;
+static unsigned long cache_size, cache_limit;
+
+void set_http_cache(unsigned long size) {
+	cache_limit = size;
+}
+
+static unsigned int cache_hash(const char *key) {
+	unsigned int h = 2166136261U; /* FNV-1a */
+	while (*key) {
+		h ^= (unsigned char) *(key++);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void cache_remove(cache_entry_t *e) {
+	cache_entry_t **h = cache_tab + (e->hash % CACHE_HASH_SIZE);
+	while (*h && *h != e) h = &((*h)->hnext);
+	if (*h) *h = e->hnext;
+	if (e->prev) e->prev->next = e->next; else cache_lru = e->next;
+	if (e->next) e->next->prev = e->prev; else cache_lru_tail = e->prev;
+	cache_size -= e->len + e->h304_len + strlen(e->key) + sizeof(cache_entry_t);
+	free(e->key);
+	free(e->data);
+	free(e);
+}
+
+static cache_entry_t *cache_find(const char *key) {
+	unsigned int h = cache_hash(key);
+	cache_entry_t *e = cache_tab[h % CACHE_HASH_SIZE];
+	while (e && (e->hash != h || strcmp(e->key, key))) e = e->hnext;
+	if (!e) return 0;
+	if (e->expires <= time(0)) {
+		cache_remove(e);
+		return 0;
+	}
+	if (e != cache_lru) { /* move to the front of the LRU list */
+		e->prev->next = e->next;
+		if (e->next) e->next->prev = e->prev; else cache_lru_tail = e->prev;
+		e->prev = 0;
+		e->next = cache_lru;
+		cache_lru->prev = e;
+		cache_lru = e;
+	}
+	return e;
+}
+
+/* parses a Cache-Control: value, returns the lifetime or 0 if the response may not be cached */
+static long cache_lifetime(const char *v, const char *end) {
+	long max_age = -1, s_maxage = -1;
+	while (v < end) {
+		const char *t;
+		while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+		t = v;
+		while (t < end && *t != ',') t++;
+		if ((t - v >= 8 && !strncasecmp(v, "no-store", 8)) || (t - v >= 8 && !strncasecmp(v, "no-cache", 8)) ||
+			(t - v >= 7 && !strncasecmp(v, "private", 7)))
+			return 0;
+		if (t - v > 8 && !strncasecmp(v, "max-age=", 8))
+			max_age = atol(v + 8);
+		if (t - v > 9 && !strncasecmp(v, "s-maxage=", 9))
+			s_maxage = atol(v + 9);
+		v = t;
+	}
+	return (s_maxage >= 0) ? s_maxage : ((max_age > 0) ? max_age : 0);
+}
+
+/* does a Vary: value (up to end) list only Accept-Encoding? */
+static int cache_vary_ok(const char *v, const char *end) {
+	while (v < end) {
+		const char *t;
+		while (v < end && (*v == ' ' || *v == '\t' || *v == ',' || *v == '\r')) v++;
+		if (v >= end) break;
+		t = v;
+		while (t < end && *t != ',' && *t != ' ' && *t != '\t' && *t != '\r') t++;
+		if (t - v != 15 || strncasecmp(v, "accept-encoding", 15))
+			return 0;
+		v = t;
+	}
+	return 1;
+}
+
+/* is the header at c (up to eol) hop-by-hop, i.e., it must not be replayed from the cache? */
+static int cache_hop_header(const char *c, const char *eol) {
+	return (eol - c > 11 && !strncasecmp(c, "connection:", 11)) ||
+		(eol - c > 11 && !strncasecmp(c, "keep-alive:", 11));
+}
+
+/* stores a response in the cache if it is cacheable. The entry holds
+   the status line without the protocol version (the version of the
+   request is used when it is served) and no hop-by-hop headers. */
+static void cache_store(const char *key, const char *data, unsigned int len) {
+	const char *c = data, *e = data + len, *eol, *etag = 0, *etag_end = 0, *hdrs, *body;
+	unsigned int sline_len, head_len;
+	long lifetime = 0, cl = -1;
+	cache_entry_t *ce;
+	char *d, etag_hdr[96];
+	int etag_hl = 0;
+
+	if (len < 16 || strncmp(data, "HTTP/1.", 7) || strncmp(data + 8, " 200 ", 5))
+		return;
+	while (c < e && *c != '\n') c++;
+	if (c >= e) return;
+	c++;
+	hdrs = c;
+	while (1) { /* headers */
+		if (c >= e) return;
+		if (*c == '\n' || (*c == '\r' && c + 1 < e && c[1] == '\n')) { /* end of headers */
+			c += (*c == '\r') ? 2 : 1;
+			break;
+		}
+		eol = c;
+		while (eol < e && *eol != '\n') eol++;
+		if (eol >= e) return;
+		if (eol - c > 14 && !strncasecmp(c, "cache-control:", 14))
+			lifetime = cache_lifetime(c + 14, eol);
+		else if (eol - c > 15 && !strncasecmp(c, "content-length:", 15))
+			cl = atol(c + 15);
+		else if (eol - c > 11 && !strncasecmp(c, "set-cookie:", 11))
+			return;
+		else if (eol - c > 5 && !strncasecmp(c, "vary:", 5)) { /* we only know how to handle Accept-Encoding */
+			if (!cache_vary_ok(c + 5, eol))
+				return;
+		} else if (eol - c > 5 && !strncasecmp(c, "etag:", 5)) {
+			etag = c + 5;
+			while (*etag == ' ' || *etag == '\t') etag++;
+			etag_end = eol;
+			while (etag_end > etag && (etag_end[-1] == '\r' || etag_end[-1] == ' ')) etag_end--;
+		}
+		c = eol + 1;
+	}
+	body = c;
+	if (lifetime <= 0 || cl < 0 || (body - data) + cl != len || (etag && etag_end - etag > 70))
+		return;
+	if (len + strlen(key) + sizeof(cache_entry_t) > cache_limit / 4) /* don't let a single entry flush the cache */
+		return;
+	if (!(ce = (cache_entry_t*) calloc(1, sizeof(cache_entry_t))))
+		return;
+	if (etag)
+		memcpy(ce->etag, etag, etag_end - etag);
+	else { /* compute an ETag from the content and add it to the headers */
+		static const char *hexc = "0123456789abcdef";
+		unsigned char md5h[16];
+		int i;
+		md5hash(body, cl, md5h);
+		ce->etag[0] = '"';
+		for (i = 0; i < 16; i++) {
+			ce->etag[1 + i * 2] = hexc[md5h[i] >> 4];
+			ce->etag[2 + i * 2] = hexc[md5h[i] & 15];
+		}
+		ce->etag[33] = '"';
+		etag_hl = snprintf(etag_hdr, sizeof(etag_hdr), "ETag: %s\r\n", ce->etag);
+	}
+	/* the headers a 304 has to repeat (RFC 7232 sec. 4.1) follow the body, so reserve room for them as well */
+	if (!(ce->data = d = (char*) malloc(len + etag_hl + (body - hdrs)))) {
+		free(ce);
+		return;
+	}
+	/* status line without "HTTP/1.x" */
+	memcpy(d, data + 8, hdrs - data - 8);
+	d += hdrs - data - 8;
+	sline_len = d - ce->data;
+	memcpy(d, etag_hdr, etag_hl);
+	d += etag_hl;
+	for (c = hdrs; c < body; c = eol + 1) {
+		for (eol = c; eol < body && *eol != '\n'; eol++) {}
+		if (!cache_hop_header(c, eol)) {
+			memcpy(d, c, eol + 1 - c);
+			d += eol + 1 - c;
+		}
+	}
+	head_len = d - ce->data;
+	memcpy(d, body, cl);
+	len = head_len + cl;
+	ce->h304 = d = ce->data + len;
+	for (c = hdrs; c < body; c = eol + 1) {
+		for (eol = c; eol < body && *eol != '\n'; eol++) {}
+		if ((eol - c > 14 && !strncasecmp(c, "cache-control:", 14)) ||
+		    (eol - c > 8 && !strncasecmp(c, "expires:", 8)) ||
+		    (eol - c > 5 && !strncasecmp(c, "vary:", 5))) {
+			memcpy(d, c, eol + 1 - c);
+			d += eol + 1 - c;
+		}
+	}
+	ce->h304_len = d - ce->h304;
+	if (!(ce->key = strdup(key))) {
+		free(ce->data);
+		free(ce);
+		return;
+	}
+	{ /* replace an existing entry */
+		cache_entry_t *old = cache_find(key);
+		if (old) cache_remove(old);
+	}
+	ce->len = len;
+	ce->head_len = head_len;
+	ce->sline_len = sline_len;
+	ce->stored = time(0);
+	ce->expires = ce->stored + lifetime;
+	ce->hash = cache_hash(key);
+	ce->hnext = cache_tab[ce->hash % CACHE_HASH_SIZE];
+	cache_tab[ce->hash % CACHE_HASH_SIZE] = ce;
+	ce->next = cache_lru;
+	if (cache_lru) cache_lru->prev = ce; else cache_lru_tail = ce;
+	cache_lru = ce;
+	cache_size += len + ce->h304_len + strlen(key) + sizeof(cache_entry_t);
+	while (cache_size > cache_limit && cache_lru_tail) /* evict least recently used */
+		cache_remove(cache_lru_tail);
+}
+
+/* does the If-None-Match: value match the etag? */
+static int etag_match(const char *inm, const char *etag) {
+	unsigned int el = strlen(etag);
+	while (*inm) {
+		const char *t;
+		while (*inm == ' ' || *inm == '\t' || *inm == ',') inm++;
+		if (*inm == '*') return 1;
+		if (!strncmp(inm, "W/", 2)) inm += 2; /* weak comparison is fine for GET/HEAD */
+		t = inm;
+		while (*t && *t != ',' && *t != ' ' && *t != '\t') t++;
+		if (t - inm == el && !strncmp(inm, etag, el))
+			return 1;
+		inm = t;
+	}
+	return 0;
+}
+
+static int pool_append_output(pool_conn_t *c, const char *buf, unsigned int len) {
+	if (c->olen + len > c->osize) {
+		unsigned int ns = c->osize ? c->osize : 16384;
+		char *nb;
+		while (ns < c->olen + len) ns <<= 1;
+		if (!(nb = (char*) realloc(c->obuf, ns)))
+			return -1;
+		c->obuf = nb;
+		c->osize = ns;
+	}
+	memcpy(c->obuf + c->olen, buf, len);
+	c->olen += len;
+	return 0;
+}
+
+/* looks at the request head and either serves it from the cache (returns 1)
+   or sets up the connection to capture the response if it may be cached (returns 0) */
+static int pool_cache_request(pool_conn_t *c, unsigned int head_len) {
+	const char *b = c->ibuf, *e = c->ibuf + head_len, *eol, *target, *tend;
+	char inm[256], host[256], key[1024];
+	int head = 0, http10 = 0, close = 0, nocache = 0, accept = 0;
+	cache_entry_t *ce;
+
+	inm[0] = host[0] = 0;
+	if (head_len > 4 && !strncmp(b, "GET ", 4))
+		target = b + 4;
+	else if (head_len > 5 && !strncmp(b, "HEAD ", 5)) {
+		target = b + 5;
+		head = 1;
+	} else
+		return 0;
+	for (tend = target; tend < e && *tend != ' ' && *tend != '\r' && *tend != '\n'; tend++) {}
+	if (tend - target > sizeof(key) - sizeof(host) - 16)
+		return 0;
+	for (eol = tend; eol < e && *eol != '\n'; eol++) {}
+	if (eol - tend >= 9 && !strncmp(tend, " HTTP/1.0", 9))
+		http10 = 1;
+	b = eol + 1;
+	while (b < e) {
+		const char *v;
+		for (eol = b; eol < e && *eol != '\n'; eol++) {}
+		v = b;
+		while (v < eol && *v != ':') v++;
+		if (v < eol) {
+			unsigned int kl = v - b;
+			v++;
+			while (v < eol && (*v == ' ' || *v == '\t')) v++;
+			if (kl == 13 && !strncasecmp(b, "authorization", 13))
+				return 0; /* we don't serve authorized content from a shared cache */
+			if ((kl == 13 && !strncasecmp(b, "cache-control", 13)) || (kl == 6 && !strncasecmp(b, "pragma", 6))) {
+				const char *t = v;
+				for (; t + 8 <= eol; t++)
+					if (!strncasecmp(t, "no-cache", 8) || !strncasecmp(t, "no-store", 8))
+						nocache = 1;
+			}
+			if (kl == 10 && !strncasecmp(b, "connection", 10) && eol - v >= 5 && !strncasecmp(v, "close", 5))
+				close = 1;
+			if (kl == 15 && !strncasecmp(b, "accept-encoding", 15)) {
+				char ae[256];
+				unsigned int al = (eol - v < sizeof(ae)) ? (eol - v) : (sizeof(ae) - 1);
+				memcpy(ae, v, al);
+				ae[al] = 0;
+				accept = parse_accept_encoding(ae);
+			}
+			if (kl == 4 && !strncasecmp(b, "host", 4)) {
+				unsigned int hl = (eol - v < sizeof(host)) ? (eol - v) : (sizeof(host) - 1), i;
+				for (i = 0; i < hl; i++) /* host names are case-insensitive */
+					host[i] = tolower((unsigned char) v[i]);
+				host[hl] = 0;
+				while (hl && (host[hl - 1] == '\r' || host[hl - 1] == ' ')) host[--hl] = 0;
+			}
+			if (kl == 13 && !strncasecmp(b, "if-none-match", 13)) {
+				unsigned int il = (eol - v < sizeof(inm)) ? (eol - v) : (sizeof(inm) - 1);
+				memcpy(inm, v, il);
+				inm[il] = 0;
+				while (il && (inm[il - 1] == '\r' || inm[il - 1] == ' ')) inm[--il] = 0;
+			}
+		}
+		b = eol + 1;
+	}
+	snprintf(key, sizeof(key), "%x %s %.*s", accept, host, (int) (tend - target), target);
+	if (!nocache && (ce = cache_find(key))) {
+		char hdr[160];
+		int hl;
+		long age = (long) (time(0) - ce->stored);
+		const char *proto = http10 ? "HTTP/1.0" : "HTTP/1.1", *conn = (close && !http10) ? "Connection: close\r\n" : "";
+		if (*inm && etag_match(inm, ce->etag)) {
+			hl = snprintf(hdr, sizeof(hdr), "%s 304 Not Modified\r\nETag: %s\r\nAge: %ld\r\n", proto, ce->etag, age);
+			pool_append_output(c, hdr, hl);
+			pool_append_output(c, ce->h304, ce->h304_len);
+			hl = snprintf(hdr, sizeof(hdr), "%s\r\n", conn);
+			pool_append_output(c, hdr, hl);
+		} else {
+			pool_append_output(c, proto, 8);
+			pool_append_output(c, ce->data, ce->sline_len);
+			hl = snprintf(hdr, sizeof(hdr), "Age: %ld\r\n%s", age, conn);
+			pool_append_output(c, hdr, hl);
+			pool_append_output(c, ce->data + ce->sline_len, (head ? ce->head_len : ce->len) - ce->sline_len);
+		}
+		if (http10 || close)
+			c->flags |= PC_CLOSE;
+		return 1;
+	}
+	if (!head) /* capture the response so it can be cached */
+		c->cache_key = strdup(key);
+	return 0;
+}
+
+/* checks whether the connection has a complete request head and queues it */
+static void pool_check_request(pool_conn_t *c) {
+	int upgrade = 0;
+	long len, head_len = 0;
+	if (c->worker >= 0 || c->next || pqueue_tail == c || !c->ilen || (c->flags & PC_CLOSE))
+		return;
+	len = pool_request_length(c->ibuf, c->ilen, &upgrade, &head_len);
+	if (len == 0) return;
+	if (len < 0) {
+		const char *msg = "HTTP/1.1 413 Request entity too large\r\nConnection: close\r\n\r\n";
+		send(c->s, msg, strlen(msg), 0);
+		pool_rm_conn(c);
+		return;
+	}
+	if (upgrade) {
+		pool_handoff(c);
+		return;
+	}
+	if (cache_limit && len == head_len && pool_cache_request(c, head_len)) { /* served from the cache */
+		c->ilen -= len;
+		if (c->ilen)
+			memmove(c->ibuf, c->ibuf + len, c->ilen);
+		pool_check_request(c); /* pipelined request? */
+		return;
+	}
+	c->req_left = len;
+	if (pqueue_tail)
+		pqueue_tail->next = c;
+	else
+		pqueue = c;
+	pqueue_tail = c;
+}
+
+/* the worker died - replace it */
+static void pool_worker_lost(int wi) {
+	pool_worker_t *w = pworkers + wi;
+	pool_conn_t *c = w->conn;
+	ev_del(w->fd);
+	close(w->fd);
+	w->fd = -1;
+	w->conn = 0;
+	w->busy = 0;
+	w->wpos = w->wlen = 0;
+	if (c) {
+		c->worker = -1;
+		pool_rm_conn(c);
+	}
+	pool_spawn_worker(wi);
+}
+
+static void pool_dispatch() {
+	int i;
+	for (i = 0; i < pool_workers && pqueue; i++)
+		if (pworkers[i].fd != -1 && !pworkers[i].busy) {
+			pool_conn_t *c = pqueue;
+			pqueue = c->next;
+			if (!pqueue) pqueue_tail = 0;
+			c->next = 0;
+			c->worker = i;
+			pworkers[i].conn = c;
+			pworkers[i].busy = 1;
+			pworkers[i].id = ++pool_seq;
+			if (pool_forward(c)) { /* worker is gone, replace it */
+				pool_worker_lost(i);
+				continue;
+			}
+			pool_update_conn(c);
+		}
+}
+
+static void pool_conn_input(pool_conn_t *c) {
+	int n, s = c->s;
+	if (c->isize - c->ilen < 8192) {
+		unsigned int ns = c->isize ? (c->isize * 2) : 16384;
+		char *nb = (char*) realloc(c->ibuf, ns);
+		if (!nb) {
+			pool_rm_conn(c);
+			return;
+		}
+		c->ibuf = nb;
+		c->isize = ns;
+	}
+	n = recv(c->s, c->ibuf + c->ilen, c->isize - c->ilen, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n > 0)
+		c->last_active = time(0);
+	if (n < 1) { /* closed or error */
+		if (c->worker >= 0) { /* let the worker finish what it's doing */
+			pool_abort(c);
+			c->flags |= PC_EOF;
+			pool_update_conn(c);
+		} else
+			pool_rm_conn(c);
+		return;
+	}
+	c->ilen += n;
+	if (c->worker >= 0 && c->req_left > 0) {
+		if (pool_forward(c)) {
+			pool_worker_lost(c->worker);
+			return;
+		}
+	} else
+		pool_check_request(c);
+	if (pconns[s] == c) /* the connection may have been removed */
+		pool_update_conn(c);
+}
+
+static void pool_conn_output(pool_conn_t *c) {
+	int n;
+	if (c->olen > c->opos) {
+#ifdef MSG_NOSIGNAL
+		n = send(c->s, c->obuf + c->opos, c->olen - c->opos, MSG_NOSIGNAL);
+#else
+		n = send(c->s, c->obuf + c->opos, c->olen - c->opos, 0);
+#endif
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				pool_rm_conn(c);
+				return;
+			}
+		} else { /* (new output may have to wait for the socket, so keep going) */
+			c->opos += n;
+			c->last_active = time(0);
+			if (c->opos == c->olen)
+				c->opos = c->olen = 0;
+		}
+	}
+	if (c->olen == c->opos) {
+		if (c->flags & PC_CLOSE) {
+			pool_rm_conn(c);
+			return;
+		}
+	}
+	if (c->worker >= 0 && pworkers[c->worker].paused && c->olen - c->opos < POOL_OBUF_MAX) {
+		pworkers[c->worker].paused = 0;
+		pool_worker_events(pworkers + c->worker);
+	}
+	pool_update_conn(c);
+}
+
+/* sends frames queued for the worker once it can take them.
+   Returns -1 if the worker had to be replaced */
+static int pool_worker_output(int wi) {
+	pool_worker_t *w = pworkers + wi;
+	if (pool_worker_flush(w)) {
+		pool_worker_lost(wi);
+		return -1;
+	}
+	pool_worker_events(w);
+	if (w->conn) /* reading from the client may have been stopped */
+		pool_update_conn(w->conn);
+	return 0;
+}
+
+/* reads whatever the worker has sent without blocking. The payload
+   goes directly to the output of the connection (or is discarded if
+   the connection is gone), so the reading can be paused in the middle
+   of a response while the client is catching up */
+static void pool_worker_input(int wi) {
+	pool_worker_t *w = pworkers + wi;
+	pool_conn_t *c = w->conn;
+	pool_frame_t *f = &w->in;
+	char discard[4096], *dst;
+	unsigned int want;
+	int n, s = c ? c->s : -1;
+	if (w->in_pos < sizeof(pool_frame_t)) {
+		n = recv(w->fd, ((char*) f) + w->in_pos, sizeof(pool_frame_t) - w->in_pos, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (n < 1 || (w->in_pos += n, w->in_pos == sizeof(pool_frame_t) && f->len > POOL_WBUF_SIZE)) {
+			pool_worker_lost(wi); /* the worker died (or is broken) - replace it */
+			return;
+		}
+		if (w->in_pos < sizeof(pool_frame_t))
+			return;
+	}
+	want = f->len - (w->in_pos - sizeof(pool_frame_t));
+	if (want) {
+		if (c && c->olen + want > c->osize) {
+			unsigned int ns = c->osize ? c->osize : 16384;
+			char *nb;
+			while (ns < c->olen + want) ns <<= 1;
+			if (!(nb = (char*) realloc(c->obuf, ns))) {
+				c->worker = -1;
+				pool_rm_conn(c);
+				c = w->conn = 0;
+			} else {
+				c->obuf = nb;
+				c->osize = ns;
+			}
+		}
+		if (c)
+			dst = c->obuf + c->olen;
+		else {
+			dst = discard;
+			if (want > sizeof(discard))
+				want = sizeof(discard);
+		}
+		n = recv(w->fd, dst, want, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (n < 1) {
+			pool_worker_lost(wi);
+			return;
+		}
+		w->in_pos += n;
+		if (c) {
+			if (c->cache_key) { /* capture for the cache */
+				if (c->caplen + n > c->capsize) {
+					unsigned int ns = c->capsize ? c->capsize : 16384;
+					char *nb = 0;
+					while (ns < c->caplen + n) ns <<= 1;
+					if (ns > cache_limit / 4 || !(nb = (char*) realloc(c->cap, ns))) { /* too big, give up */
+						free(c->cache_key);
+						c->cache_key = 0;
+					} else {
+						c->cap = nb;
+						c->capsize = ns;
+					}
+				}
+				if (c->cache_key) {
+					memcpy(c->cap + c->caplen, dst, n);
+					c->caplen += n;
+				}
+			}
+			c->olen += n;
+		}
+	}
+	if (w->in_pos == sizeof(pool_frame_t) + f->len) { /* the frame is complete */
+		w->in_pos = 0;
+		if (f->flags & PF_END) {
+			w->conn = 0;
+			w->busy = 0;
+			if (c && c->cache_key) {
+				if (c->cap)
+					cache_store(c->cache_key, c->cap, c->caplen);
+				free(c->cache_key);
+				c->cache_key = 0;
+				c->caplen = 0;
+			}
+			if (c) {
+				c->worker = -1;
+				/* if the worker didn't consume the whole request we can't continue */
+				if ((f->flags & PF_CLOSE) || c->req_left > 0 || (c->flags & PC_EOF))
+					c->flags |= PC_CLOSE;
+				else
+					pool_check_request(c); /* pipelined request? */
+			}
+		}
+	}
+	if (c && pconns[s] == c) { /* the connection may have been removed */
+		if (c->worker >= 0 && c->olen - c->opos >= POOL_OBUF_MAX) { /* client is slow, wait */
+			w->paused = 1;
+			pool_worker_events(w);
+		}
+		pool_conn_output(c);
+	}
+}
+
+/* closes connections that have been idle (not served by a worker and
+   nothing received or sent) for longer than pool_idle_timeout */
+static void pool_expire_idle() {
+	static time_t last_check;
+	time_t now = time(0);
+	int i;
+	if (pool_idle_timeout <= 0 || now == last_check)
+		return;
+	last_check = now;
+	for (i = 0; i < pconns_size; i++) {
+		pool_conn_t *c = pconns[i];
+		if (c && c->worker < 0 && !c->next && pqueue_tail != c &&
+			now - c->last_active > pool_idle_timeout)
+			pool_rm_conn(c);
+	}
+}
+
+/* main loop of the I/O process, never returns */
+static void pool_io_loop(args_t *arg, int master) {
+	int fds[64], evs[64], i, n;
+	pid_t master_pid = getppid();
+	pool_srv = arg->srv;
+	pool_master = master;
+	signal(SIGPIPE, SIG_IGN);
+	/* the hub connection cannot be shared by the children we hand off connections to */
+	hub_child_close();
+	if (ev_init() < 0 || !(pworkers = (pool_worker_t*) calloc(pool_workers, sizeof(pool_worker_t)))) {
+		RSEprintf("ERROR: unable to initialize HTTP I/O process\n");
+		exit(1);
+	}
+	for (i = 0; i < pool_workers; i++)
+		pworkers[i].fd = -1;
+	for (i = 0; i < pool_workers; i++)
+		if (pool_spawn_worker(i))
+			RSEprintf("WARNING: unable to start HTTP worker\n");
+	ev_add(master, EV_READ);
+	pool_add_conn(arg->s);
+	while (1) {
+		n = ev_wait(fds, evs, 64, 1000);
+		while (waitpid(-1, 0, WNOHANG) > 0) {} /* reap workers and hand-off children */
+		if (getppid() != master_pid) /* the server is gone */
+			break;
+		for (i = 0; i < n; i++) {
+			int fd = fds[i], j;
+			if (fd == master) {
+				int s = -1;
+				char c;
+				int r = recv_fd(master, &s, &c, 1);
+				if (r == 0 || (r < 0 && errno != EINTR)) /* server closed the socket */
+					exit(0);
+				if (s != -1)
+					pool_add_conn(s);
+				continue;
+			}
+			for (j = 0; j < pool_workers; j++)
+				if (pworkers[j].fd == fd)
+					break;
+			if (j < pool_workers) {
+				if ((evs[i] & EV_WRITE) && pool_worker_output(j))
+					continue;
+				if (evs[i] & EV_READ)
+					pool_worker_input(j);
+				continue;
+			}
+			if (fd < pconns_size && pconns[fd]) {
+				if (evs[i] & EV_WRITE)
+					pool_conn_output(pconns[fd]);
+				if ((evs[i] & EV_READ) && fd < pconns_size && pconns[fd])
+					pool_conn_input(pconns[fd]);
+			}
+		}
+		pool_dispatch();
+		pool_expire_idle();
+	}
+	exit(0);
+}
+
+/* called in the server for each connection if the pool is enabled.
+   Returns 0 if the connection was handed to the I/O process. */
+static int pool_connected(args_t *arg) {
+	int sv[2], res;
+	char c = 'C';
+	if (pool_master != -1) {
+		if (send_fd(pool_master, arg->s, &c, 1) == 1) {
+			closesocket(arg->s);
+			free(arg);
+			return 0;
+		}
+		close(pool_master); /* I/O process is gone, start a new one */
+		pool_master = -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	res = Rserve_prepare_child(arg);
+	if (res != 0) { /* server or error */
+		close(sv[1]);
+		if (res > 0)
+			pool_master = sv[0];
+		else
+			close(sv[0]);
+		free(arg);
+		return 0;
+	}
+	close(sv[0]);
+	pool_io_loop(arg, sv[1]);
+	return 0;
+}
+
 static void HTTP_connected(void *parg) {
 	args_t *arg = (args_t*) parg;
 
+	/* plain HTTP connections are served by the worker pool if enabled */
+	if (pool_workers > 0 && !(arg->srv->flags & SRV_TLS) && !pool_connected(arg))
+		return;
+
 	if (Rserve_prepare_child(arg) != 0) { /* parent or error */
 		free(arg);
 		return;
@@ -869,8 +3306,14 @@ static void HTTP_connected(void *parg) {
 		return;
 	}
 
-	if ((arg->srv->flags & SRV_TLS) && shared_tls(0))
+	if ((arg->srv->flags & SRV_TLS) && shared_tls(0)) {
 		add_tls(arg, shared_tls(0), 1);
+		if (http2_enabled && tls_alpn_h2(arg)) { /* h2 negotiated via ALPN */
+			http2_serve(arg, 0, 0, 0, 0, 0, 0, http2_request);
+			free_args(arg);
+			return;
+		}
+	}
 
 	while (arg->s != -1)
 		http_input_iteration(arg);
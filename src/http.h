@@ -8,4 +8,27 @@
 
 server_t *create_HTTP_server(int port, int flags);
 
+/* request bodies larger than limit (in bytes) are stored in a temporary file
+   and passed to R as a file name instead of a raw vector (0 = never) */
+void set_http_body_tmpfile(long limit);
+
+/* compression of responses: level 0..9 (0 = off) and minimal payload size
+   (in bytes) to compress, negative values leave the setting unchanged */
+void set_http_compression(int level, long min_size);
+
+/* number of pre-forked R workers serving plain HTTP connections via a
+   single I/O process (0 = fork a child for each connection) */
+void set_http_workers(int n);
+
+/* idle connections of the I/O process are closed after this many
+   seconds (0 = never) */
+void set_http_keepalive_timeout(int sec);
+
+/* size limit (in bytes) of the response cache of the I/O process (0 = off),
+   only used if workers are enabled */
+void set_http_cache(unsigned long size);
+
+/* enables HTTP/2: h2c (prior knowledge or Upgrade:) and h2 via TLS ALPN */
+void set_http_h2(int enable);
+
 #endif
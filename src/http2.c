@@ -0,0 +1,1173 @@
+/* HTTP/2 support for the HTTP server (RFC 7540 framing, RFC 7541 HPACK)
+
+   The connection is served by the child that would otherwise serve
+   the HTTP/1.1 connection. Streams are multiplexed on the wire, but
+   requests are dispatched to R one after another: each request is
+   converted to its HTTP/1.1 form and passed to the handler (which
+   runs it through the regular HTTP/1.1 parser and R handler) and the
+   HTTP/1.1 response is converted back into HEADERS and DATA frames.
+   Responses are sent subject to flow control while the next requests
+   are served, so slow readers of large responses don't block other
+   streams. Server push and priorities are not supported.
+
+   The HPACK encoder only uses literals without indexing (with static
+   table names where possible), so the peer's table size is of no
+   concern. The decoder supports the full specification including the
+   dynamic table and Huffman coding. */
+
+#include "RSserver.h"
+#include "http2.h"
+#include "rserr.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+/* debug output - change the DBG(X) X to enable debugging output */
+#ifdef RSERV_DEBUG
+#define DBG(X) X
+#else
+#define DBG(X)
+#endif
+
+struct args {
+	server_t *srv; /* server that instantiated this connection */
+	int s;
+	int ss;
+};
+
+int base64decode(const char *src, void *dst, int max_len);
+
+/* frame types */
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+/* frame flags */
+#define H2F_END_STREAM   0x01
+#define H2F_ACK          0x01
+#define H2F_END_HEADERS  0x04
+#define H2F_PADDED       0x08
+#define H2F_PRIORITY     0x20
+
+/* error codes */
+#define H2E_NO_ERROR           0x0
+#define H2E_PROTOCOL_ERROR     0x1
+#define H2E_INTERNAL_ERROR     0x2
+#define H2E_FLOW_CONTROL_ERROR 0x3
+#define H2E_STREAM_CLOSED      0x5
+#define H2E_FRAME_SIZE_ERROR   0x6
+#define H2E_REFUSED_STREAM     0x7
+#define H2E_COMPRESSION_ERROR  0x9
+
+/* settings */
+#define H2S_HEADER_TABLE_SIZE      0x1
+#define H2S_ENABLE_PUSH            0x2
+#define H2S_MAX_CONCURRENT_STREAMS 0x3
+#define H2S_INITIAL_WINDOW_SIZE    0x4
+#define H2S_MAX_FRAME_SIZE         0x5
+
+#define H2_MAX_FRAME     16384      /* largest frame we accept (the default SETTINGS_MAX_FRAME_SIZE) */
+#define H2_MAX_STREAMS   100        /* SETTINGS_MAX_CONCURRENT_STREAMS we announce */
+#define H2_TABLE_SIZE    4096       /* our SETTINGS_HEADER_TABLE_SIZE (the default) */
+#define H2_MAX_HBLOCK    (256*1024) /* largest header block we accept */
+#define H2_MAX_BODY      2147483640L
+#define H2_INIT_WINDOW   65535
+#define H2_OBUF_FLUSH    (64*1024)  /* flush output buffer when it gets this big */
+
+/* --- growing buffer --- */
+
+typedef struct h2_buf {
+	char *d;
+	unsigned long len, size;
+} h2_buf_t;
+
+static int buf_add(h2_buf_t *b, const void *data, unsigned long len) {
+	if (b->len + len > b->size) {
+		unsigned long ns = b->size ? b->size : 1024;
+		char *nd;
+		while (ns < b->len + len) ns <<= 1;
+		if (!(nd = (char*) realloc(b->d, ns)))
+			return -1;
+		b->d = nd;
+		b->size = ns;
+	}
+	if (len)
+		memcpy(b->d + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+static int buf_addc(h2_buf_t *b, const char *s) {
+	return buf_add(b, s, strlen(s));
+}
+
+static void buf_free(h2_buf_t *b) {
+	if (b->d) free(b->d);
+	b->d = 0;
+	b->len = b->size = 0;
+}
+
+/* --- HPACK --- */
+
+static const char *hp_static[62][2] = {
+	{ 0, 0 },
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+/* lengths of the Huffman codes of symbols 0..256 (256 = EOS), the code
+   is canonical so the codes themselves follow from the lengths */
+static const unsigned char huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+static unsigned int huff_first[31], huff_count[31], huff_off[31];
+static unsigned short huff_sym[257];
+
+static void huff_init() {
+	unsigned int i, l, code = 0, n = 0;
+	if (huff_count[5]) return;
+	for (i = 0; i < 257; i++)
+		huff_count[huff_len[i]]++;
+	for (l = 1; l <= 30; l++) {
+		code = (code + huff_count[l - 1]) << 1;
+		huff_first[l] = code;
+		huff_off[l] = n;
+		for (i = 0; i < 257; i++)
+			if (huff_len[i] == l)
+				huff_sym[n++] = i;
+	}
+}
+
+/* decodes a Huffman-coded string, dst must have at least len * 8 / 5 bytes.
+   Returns the decoded length or -1 on error */
+static long huff_decode(const unsigned char *src, unsigned int len, char *dst) {
+	unsigned int code = 0, cl = 0, i;
+	long n = 0;
+	huff_init();
+	for (i = 0; i < len; i++) {
+		int b;
+		for (b = 7; b >= 0; b--) {
+			code = (code << 1) | ((src[i] >> b) & 1);
+			if (++cl > 30) return -1;
+			if (code - huff_first[cl] < huff_count[cl]) {
+				unsigned int sym = huff_sym[huff_off[cl] + code - huff_first[cl]];
+				if (sym == 256) return -1; /* EOS must not appear */
+				dst[n++] = (char) sym;
+				code = cl = 0;
+			}
+		}
+	}
+	/* padding must be shorter than a byte and consist of ones (prefix of EOS) */
+	if (cl > 7 || code != (1U << cl) - 1)
+		return -1;
+	return n;
+}
+
+typedef struct hp_entry {
+	char *name, *value; /* value is in the same allocation as name */
+	unsigned int nlen, vlen;
+} hp_entry_t;
+
+/* dynamic table - ring buffer with the newest entry at first */
+typedef struct hpack {
+	hp_entry_t *ent;
+	unsigned int cap, first, n;
+	unsigned long size, max_size;
+} hpack_t;
+
+static int hp_init(hpack_t *hp) {
+	hp->cap = H2_TABLE_SIZE / 32 + 1;
+	hp->first = hp->n = 0;
+	hp->size = 0;
+	hp->max_size = H2_TABLE_SIZE;
+	return (hp->ent = (hp_entry_t*) calloc(hp->cap, sizeof(hp_entry_t))) ? 0 : -1;
+}
+
+static void hp_evict(hpack_t *hp) {
+	hp_entry_t *e = hp->ent + ((hp->first + hp->n - 1) % hp->cap);
+	hp->size -= e->nlen + e->vlen + 32;
+	free(e->name);
+	e->name = 0;
+	hp->n--;
+}
+
+static void hp_free(hpack_t *hp) {
+	if (!hp->ent) return;
+	while (hp->n) hp_evict(hp);
+	free(hp->ent);
+	hp->ent = 0;
+}
+
+static void hp_resize(hpack_t *hp, unsigned long size) {
+	hp->max_size = size;
+	while (hp->n && hp->size > hp->max_size)
+		hp_evict(hp);
+}
+
+static int hp_add(hpack_t *hp, const char *name, unsigned int nlen, const char *value, unsigned int vlen) {
+	unsigned long es = nlen + vlen + 32;
+	hp_entry_t *e;
+	while (hp->n && hp->size + es > hp->max_size)
+		hp_evict(hp);
+	if (es > hp->max_size) /* too big - the table is just emptied */
+		return 0;
+	hp->first = (hp->first + hp->cap - 1) % hp->cap;
+	e = hp->ent + hp->first;
+	if (!(e->name = (char*) malloc(nlen + vlen + 2)))
+		return -1;
+	memcpy(e->name, name, nlen);
+	e->name[nlen] = 0;
+	e->value = e->name + nlen + 1;
+	memcpy(e->value, value, vlen);
+	e->value[vlen] = 0;
+	e->nlen = nlen;
+	e->vlen = vlen;
+	hp->size += es;
+	hp->n++;
+	return 0;
+}
+
+/* looks up an entry in the static and dynamic table */
+static int hp_get(hpack_t *hp, unsigned long idx, const char **name, unsigned int *nlen, const char **value, unsigned int *vlen) {
+	if (idx == 0) return -1;
+	if (idx < 62) {
+		*name = hp_static[idx][0];
+		*value = hp_static[idx][1];
+		*nlen = strlen(*name);
+		*vlen = strlen(*value);
+		return 0;
+	}
+	idx -= 62;
+	if (idx >= hp->n) return -1;
+	{
+		hp_entry_t *e = hp->ent + ((hp->first + idx) % hp->cap);
+		*name = e->name;
+		*nlen = e->nlen;
+		*value = e->value;
+		*vlen = e->vlen;
+	}
+	return 0;
+}
+
+static int hp_int(const unsigned char **p, const unsigned char *e, int prefix, unsigned long *val) {
+	unsigned long mask = (1UL << prefix) - 1, v;
+	unsigned int shift = 0;
+	if (*p >= e) return -1;
+	v = *((*p)++) & mask;
+	if (v < mask) {
+		*val = v;
+		return 0;
+	}
+	while (*p < e) {
+		unsigned char b = *((*p)++);
+		if (shift > 21) return -1; /* we don't need anything that big */
+		v += ((unsigned long) (b & 0x7f)) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			*val = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* decodes a string literal into a newly allocated, NUL-terminated string */
+static char *hp_str(const unsigned char **p, const unsigned char *e, unsigned int *len) {
+	int huff;
+	unsigned long l;
+	char *s;
+	if (*p >= e) return 0;
+	huff = (**p & 0x80) ? 1 : 0;
+	if (hp_int(p, e, 7, &l) || l > e - *p)
+		return 0;
+	if (!(s = (char*) malloc(huff ? (l * 8 / 5 + 1) : (l + 1))))
+		return 0;
+	if (huff) {
+		long n = huff_decode(*p, l, s);
+		if (n < 0) {
+			free(s);
+			return 0;
+		}
+		*len = n;
+	} else {
+		memcpy(s, *p, l);
+		*len = l;
+	}
+	s[*len] = 0;
+	*p += l;
+	return s;
+}
+
+static int hp_enc_int(h2_buf_t *b, unsigned char first, int prefix, unsigned long v) {
+	unsigned long mask = (1UL << prefix) - 1;
+	unsigned char c;
+	if (v < mask) {
+		c = first | (unsigned char) v;
+		return buf_add(b, &c, 1);
+	}
+	c = first | (unsigned char) mask;
+	if (buf_add(b, &c, 1)) return -1;
+	v -= mask;
+	while (v >= 128) {
+		c = (unsigned char) (v & 0x7f) | 0x80;
+		if (buf_add(b, &c, 1)) return -1;
+		v >>= 7;
+	}
+	c = (unsigned char) v;
+	return buf_add(b, &c, 1);
+}
+
+/* encodes a header as literal without indexing (names are lower-cased) */
+static int hp_enc_header(h2_buf_t *b, const char *name, unsigned int nlen, const char *value, unsigned int vlen) {
+	int i, idx = 0;
+	for (i = 1; i < 62; i++)
+		if (strlen(hp_static[i][0]) == nlen && !strncasecmp(hp_static[i][0], name, nlen)) {
+			idx = i;
+			break;
+		}
+	if (hp_enc_int(b, 0x00, 4, idx)) return -1;
+	if (!idx) {
+		unsigned long pos;
+		if (hp_enc_int(b, 0x00, 7, nlen) || buf_add(b, name, nlen)) return -1;
+		for (pos = b->len - nlen; pos < b->len; pos++)
+			if (b->d[pos] >= 'A' && b->d[pos] <= 'Z')
+				b->d[pos] |= 0x20;
+	}
+	return (hp_enc_int(b, 0x00, 7, vlen) || buf_add(b, value, vlen)) ? -1 : 0;
+}
+
+/* --- streams and connection --- */
+
+#define ST_HEADERS 0 /* receiving the header block */
+#define ST_BODY    1 /* receiving the body */
+#define ST_READY   2 /* request is complete, waiting to be served */
+#define ST_SENDING 3 /* sending the response */
+
+typedef struct h2_stream {
+	struct h2_stream *next;
+	unsigned int id;
+	int state, bad, regular;
+	char *method, *path, *authority;
+	int has_host;
+	h2_buf_t head;           /* HTTP/1.1 request head (without the final empty line) */
+	h2_buf_t cookie;         /* cookie crumbs are joined into one header */
+	h2_buf_t body;           /* request body */
+	char *res;               /* HTTP/1.1 response */
+	unsigned long res_pos, res_len;
+	long win;                /* send window */
+} h2_stream_t;
+
+typedef struct h2_conn {
+	args_t *c;
+	server_t *io;            /* server whose send/recv are used for the connection */
+	http2_handler_t handler;
+	unsigned char *ibuf;
+	unsigned int ipos, ilen, isize;
+	h2_buf_t out;            /* output waiting to be sent */
+	h2_buf_t hblock;         /* header block being assembled from HEADERS and CONTINUATION */
+	unsigned int hb_id;      /* stream of the header block (0 = none) */
+	int hb_end_stream;
+	hpack_t hp;
+	long win;                /* connection send window */
+	long peer_window;        /* peer's SETTINGS_INITIAL_WINDOW_SIZE */
+	unsigned int peer_frame; /* peer's SETTINGS_MAX_FRAME_SIZE */
+	unsigned int last_id, nstreams;
+	h2_stream_t *streams;
+	int closing;             /* GOAWAY received */
+} h2_conn_t;
+
+static h2_stream_t *h2_find(h2_conn_t *h, unsigned int id) {
+	h2_stream_t *st = h->streams;
+	while (st && st->id != id) st = st->next;
+	return st;
+}
+
+static h2_stream_t *h2_new_stream(h2_conn_t *h, unsigned int id) {
+	h2_stream_t *st = (h2_stream_t*) calloc(1, sizeof(h2_stream_t)), **tail = &h->streams;
+	if (!st) return 0;
+	st->id = id;
+	st->win = h->peer_window;
+	while (*tail) tail = &((*tail)->next); /* keep them in order so requests are served in order */
+	*tail = st;
+	h->nstreams++;
+	return st;
+}
+
+static void h2_free_stream(h2_conn_t *h, h2_stream_t *st) {
+	h2_stream_t **p = &h->streams;
+	while (*p && *p != st) p = &((*p)->next);
+	if (*p) {
+		*p = st->next;
+		h->nstreams--;
+	}
+	if (st->method) free(st->method);
+	if (st->path) free(st->path);
+	if (st->authority) free(st->authority);
+	buf_free(&st->head);
+	buf_free(&st->cookie);
+	buf_free(&st->body);
+	if (st->res) free(st->res);
+	free(st);
+}
+
+static int h2_frame(h2_conn_t *h, int type, int flags, unsigned int id, const void *payload, unsigned int len) {
+	unsigned char hd[9];
+	hd[0] = (len >> 16) & 255;
+	hd[1] = (len >> 8) & 255;
+	hd[2] = len & 255;
+	hd[3] = type;
+	hd[4] = flags;
+	hd[5] = (id >> 24) & 127;
+	hd[6] = (id >> 16) & 255;
+	hd[7] = (id >> 8) & 255;
+	hd[8] = id & 255;
+	return (buf_add(&h->out, hd, 9) || buf_add(&h->out, payload, len)) ? -1 : 0;
+}
+
+static int h2_frame_u32(h2_conn_t *h, int type, unsigned int id, unsigned int v) {
+	unsigned char pl[4];
+	pl[0] = (v >> 24) & 255;
+	pl[1] = (v >> 16) & 255;
+	pl[2] = (v >> 8) & 255;
+	pl[3] = v & 255;
+	return h2_frame(h, type, 0, id, pl, 4);
+}
+
+static int h2_rst(h2_conn_t *h, unsigned int id, unsigned int code) {
+	return h2_frame_u32(h, H2_RST_STREAM, id, code);
+}
+
+static int h2_goaway(h2_conn_t *h, unsigned int code) {
+	unsigned char pl[8];
+	unsigned int id = h->last_id;
+	pl[0] = (id >> 24) & 127;
+	pl[1] = (id >> 16) & 255;
+	pl[2] = (id >> 8) & 255;
+	pl[3] = id & 255;
+	pl[4] = pl[5] = pl[6] = 0;
+	pl[7] = code;
+	return h2_frame(h, H2_GOAWAY, 0, 0, pl, 8);
+}
+
+static int h2_flush(h2_conn_t *h) {
+	unsigned long pos = 0;
+	while (pos < h->out.len) {
+		int n = h->io->send(h->c, h->out.d + pos, h->out.len - pos);
+		if (n < 1) return -1;
+		pos += n;
+	}
+	h->out.len = 0;
+	return (h->io->flush) ? h->io->flush(h->c) : 0;
+}
+
+/* makes sure there are at least need bytes in the input buffer */
+static int h2_need(h2_conn_t *h, unsigned int need) {
+	if (h->ilen - h->ipos >= need) return 0;
+	if (h->ipos) {
+		memmove(h->ibuf, h->ibuf + h->ipos, h->ilen - h->ipos);
+		h->ilen -= h->ipos;
+		h->ipos = 0;
+	}
+	while (h->ilen < need) {
+		int n = h->io->recv(h->c, h->ibuf + h->ilen, h->isize - h->ilen);
+		if (n < 1) return -1;
+		h->ilen += n;
+	}
+	return 0;
+}
+
+/* processes a header field of the request on stream st */
+static void h2_req_header(h2_stream_t *st, const char *name, unsigned int nlen, const char *value, unsigned int vlen) {
+	unsigned int i;
+	for (i = 0; i < vlen; i++) /* these would allow to inject content into the HTTP/1.1 request */
+		if (value[i] == '\r' || value[i] == '\n' || value[i] == 0) {
+			st->bad = 1;
+			return;
+		}
+	for (i = 0; i < nlen; i++)
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= ' ' || (name[i] == ':' && i)) {
+			st->bad = 1;
+			return;
+		}
+	if (nlen && *name == ':') {
+		char **dst = 0;
+		if (st->regular) { /* pseudo-headers must come first */
+			st->bad = 1;
+			return;
+		}
+		if (!strcmp(name, ":method")) dst = &st->method;
+		else if (!strcmp(name, ":path")) dst = &st->path;
+		else if (!strcmp(name, ":authority")) dst = &st->authority;
+		else if (strcmp(name, ":scheme")) {
+			st->bad = 1;
+			return;
+		}
+		if (dst) {
+			for (i = 0; i < vlen; i++)
+				if (value[i] == ' ') {
+					st->bad = 1;
+					return;
+				}
+			if (*dst) free(*dst);
+			*dst = strdup(value);
+		}
+		return;
+	}
+	st->regular = 1;
+	/* connection-specific headers are not allowed in HTTP/2 and we add content-length ourselves */
+	if (!strcmp(name, "connection") || !strcmp(name, "keep-alive") || !strcmp(name, "proxy-connection") ||
+		!strcmp(name, "transfer-encoding") || !strcmp(name, "upgrade") || !strcmp(name, "te") ||
+		!strcmp(name, "content-length") || !strcmp(name, "http2-settings"))
+		return;
+	if (!strcmp(name, "cookie")) {
+		if (st->cookie.len) buf_add(&st->cookie, "; ", 2);
+		buf_add(&st->cookie, value, vlen);
+		return;
+	}
+	if (!strcmp(name, "host"))
+		st->has_host = 1;
+	buf_add(&st->head, name, nlen);
+	buf_add(&st->head, ": ", 2);
+	buf_add(&st->head, value, vlen);
+	buf_add(&st->head, "\r\n", 2);
+	if (!st->head.d) st->bad = 1;
+}
+
+/* decodes a complete header block, st can be NULL if the block is to be
+   discarded (it still has to be decoded to keep the dynamic table in sync) */
+static int h2_decode_headers(h2_conn_t *h, h2_stream_t *st, const unsigned char *p, unsigned int len) {
+	const unsigned char *e = p + len;
+	int fields = 0;
+	while (p < e) {
+		unsigned long idx;
+		const char *n, *v;
+		char *name = 0, *value = 0;
+		unsigned int nlen, vlen;
+		int add = 0;
+		if (*p & 0x80) { /* indexed field */
+			if (hp_int(&p, e, 7, &idx) || hp_get(&h->hp, idx, &n, &nlen, &v, &vlen))
+				return -1;
+			if (st) h2_req_header(st, n, nlen, v, vlen);
+			fields++;
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) { /* dynamic table size update */
+			if (fields || hp_int(&p, e, 5, &idx) || idx > H2_TABLE_SIZE)
+				return -1;
+			hp_resize(&h->hp, idx);
+			continue;
+		}
+		if ((*p & 0xc0) == 0x40) { /* literal with incremental indexing */
+			add = 1;
+			if (hp_int(&p, e, 6, &idx)) return -1;
+		} else if (hp_int(&p, e, 4, &idx)) /* literal without indexing / never indexed */
+			return -1;
+		if (idx) {
+			if (hp_get(&h->hp, idx, &n, &nlen, &v, &vlen) || !(name = strdup(n)))
+				return -1;
+		} else if (!(name = hp_str(&p, e, &nlen)))
+			return -1;
+		if (!(value = hp_str(&p, e, &vlen))) {
+			free(name);
+			return -1;
+		}
+		if (st) h2_req_header(st, name, nlen, value, vlen);
+		fields++;
+		if (add && hp_add(&h->hp, name, nlen, value, vlen)) {
+			free(name);
+			free(value);
+			return -1;
+		}
+		free(name);
+		free(value);
+	}
+	return 0;
+}
+
+/* the header block of a stream is complete */
+static int h2_headers_done(h2_conn_t *h) {
+	h2_stream_t *st = h->hb_id ? h2_find(h, h->hb_id) : 0;
+	int trailers = (st && st->state != ST_HEADERS);
+	if (h2_decode_headers(h, trailers ? 0 : st, (const unsigned char*) h->hblock.d, h->hblock.len)) {
+		h2_goaway(h, H2E_COMPRESSION_ERROR);
+		return -1;
+	}
+	h->hblock.len = 0;
+	h->hb_id = 0;
+	if (!st) /* refused stream */
+		return 0;
+	if (trailers) { /* trailers are dropped, but they end the stream */
+		if (!h->hb_end_stream) {
+			h2_rst(h, st->id, H2E_PROTOCOL_ERROR);
+			h2_free_stream(h, st);
+		} else
+			st->state = ST_READY;
+		return 0;
+	}
+	if (st->bad || !st->method || !st->path) {
+		h2_rst(h, st->id, H2E_PROTOCOL_ERROR);
+		h2_free_stream(h, st);
+		return 0;
+	}
+	{ /* prepend the request line and append Host: and Cookie: */
+		h2_buf_t head = { 0, 0, 0 };
+		buf_addc(&head, st->method);
+		buf_add(&head, " ", 1);
+		buf_addc(&head, st->path);
+		buf_addc(&head, " HTTP/1.1\r\n");
+		if (!st->has_host) {
+			buf_addc(&head, "Host: ");
+			if (st->authority) buf_addc(&head, st->authority);
+			buf_add(&head, "\r\n", 2);
+		}
+		buf_add(&head, st->head.d, st->head.len);
+		if (st->cookie.len) {
+			buf_addc(&head, "Cookie: ");
+			buf_add(&head, st->cookie.d, st->cookie.len);
+			buf_add(&head, "\r\n", 2);
+		}
+		buf_free(&st->head);
+		st->head = head;
+		buf_free(&st->cookie);
+		if (!head.d) {
+			h2_rst(h, st->id, H2E_INTERNAL_ERROR);
+			h2_free_stream(h, st);
+			return 0;
+		}
+	}
+	st->state = h->hb_end_stream ? ST_READY : ST_BODY;
+	return 0;
+}
+
+static int h2_settings(h2_conn_t *h, const unsigned char *p, unsigned int len) {
+	if (len % 6) {
+		h2_goaway(h, H2E_FRAME_SIZE_ERROR);
+		return -1;
+	}
+	for (; len; len -= 6, p += 6) {
+		unsigned int id = (p[0] << 8) | p[1];
+		unsigned long v = (((unsigned long) p[2]) << 24) | (p[3] << 16) | (p[4] << 8) | p[5];
+		if (id == H2S_ENABLE_PUSH && v > 1) {
+			h2_goaway(h, H2E_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (id == H2S_INITIAL_WINDOW_SIZE) {
+			h2_stream_t *st;
+			if (v > 0x7fffffffUL) {
+				h2_goaway(h, H2E_FLOW_CONTROL_ERROR);
+				return -1;
+			}
+			for (st = h->streams; st; st = st->next)
+				st->win += (long) v - h->peer_window;
+			h->peer_window = v;
+		}
+		if (id == H2S_MAX_FRAME_SIZE) {
+			if (v < 16384 || v > 16777215) {
+				h2_goaway(h, H2E_PROTOCOL_ERROR);
+				return -1;
+			}
+			h->peer_frame = v;
+		}
+		/* the header table size doesn't concern us since we don't use the dynamic table for encoding */
+	}
+	return 0;
+}
+
+/* reads and processes one frame, returns -1 if the connection is to be closed */
+static int h2_read_frame(h2_conn_t *h) {
+	unsigned int len, id, type, flags;
+	const unsigned char *p;
+	h2_stream_t *st;
+
+	if (h2_need(h, 9)) return -1;
+	p = h->ibuf + h->ipos;
+	len = (p[0] << 16) | (p[1] << 8) | p[2];
+	type = p[3];
+	flags = p[4];
+	id = ((p[5] & 127) << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+	if (len > H2_MAX_FRAME) {
+		h2_goaway(h, H2E_FRAME_SIZE_ERROR);
+		return -1;
+	}
+	if (h2_need(h, 9 + len)) return -1;
+	p = h->ibuf + h->ipos + 9;
+	h->ipos += 9 + len;
+	DBG(fprintf(stderr, "HTTP/2 frame type=%u, flags=0x%x, stream=%u, len=%u\n", type, flags, id, len));
+
+	if (h->hb_id && (type != H2_CONTINUATION || id != h->hb_id)) { /* header blocks must not be interrupted */
+		h2_goaway(h, H2E_PROTOCOL_ERROR);
+		return -1;
+	}
+
+	switch (type) {
+	case H2_DATA:
+	case H2_HEADERS:
+		{
+			unsigned int pad = 0;
+			if (!id) {
+				h2_goaway(h, H2E_PROTOCOL_ERROR);
+				return -1;
+			}
+			if (flags & H2F_PADDED) {
+				if (len < 1 || p[0] >= len) {
+					h2_goaway(h, H2E_PROTOCOL_ERROR);
+					return -1;
+				}
+				pad = p[0] + 1;
+				p++;
+			}
+			if (type == H2_DATA) {
+				unsigned int dlen = len - pad;
+				/* all of the frame counts for flow control, we replenish immediately */
+				if (len)
+					h2_frame_u32(h, H2_WINDOW_UPDATE, 0, len);
+				st = h2_find(h, id);
+				if (!st) {
+					if (id > h->last_id) {
+						h2_goaway(h, H2E_PROTOCOL_ERROR);
+						return -1;
+					}
+					return h2_rst(h, id, H2E_STREAM_CLOSED);
+				}
+				if (st->state != ST_BODY) {
+					h2_rst(h, id, H2E_STREAM_CLOSED);
+					h2_free_stream(h, st);
+					return 0;
+				}
+				if (st->body.len + dlen > H2_MAX_BODY || buf_add(&st->body, p, dlen)) {
+					h2_rst(h, id, H2E_REFUSED_STREAM);
+					h2_free_stream(h, st);
+					return 0;
+				}
+				if (flags & H2F_END_STREAM)
+					st->state = ST_READY;
+				else if (len)
+					h2_frame_u32(h, H2_WINDOW_UPDATE, id, len);
+				return 0;
+			}
+			/* HEADERS */
+			if (flags & H2F_PRIORITY) {
+				if (len < pad + 5) {
+					h2_goaway(h, H2E_PROTOCOL_ERROR);
+					return -1;
+				}
+				p += 5;
+				len -= 5;
+			}
+			len -= pad;
+			st = h2_find(h, id);
+			if (!st) {
+				if ((id & 1) == 0 || id <= h->last_id) {
+					h2_goaway(h, H2E_PROTOCOL_ERROR);
+					return -1;
+				}
+				h->last_id = id;
+				if (h->closing || h->nstreams >= H2_MAX_STREAMS || !(st = h2_new_stream(h, id)))
+					h2_rst(h, id, H2E_REFUSED_STREAM); /* the block is decoded and discarded */
+			} else if (st->state != ST_BODY || !(flags & H2F_END_STREAM)) { /* only trailers are allowed */
+				h2_goaway(h, H2E_PROTOCOL_ERROR);
+				return -1;
+			}
+			h->hb_id = id;
+			h->hb_end_stream = (flags & H2F_END_STREAM) ? 1 : 0;
+			if (buf_add(&h->hblock, p, len)) {
+				h2_goaway(h, H2E_INTERNAL_ERROR);
+				return -1;
+			}
+			return (flags & H2F_END_HEADERS) ? h2_headers_done(h) : 0;
+		}
+	case H2_CONTINUATION:
+		if (!h->hb_id) {
+			h2_goaway(h, H2E_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (h->hblock.len + len > H2_MAX_HBLOCK || buf_add(&h->hblock, p, len)) {
+			h2_goaway(h, H2E_INTERNAL_ERROR);
+			return -1;
+		}
+		return (flags & H2F_END_HEADERS) ? h2_headers_done(h) : 0;
+	case H2_PRIORITY:
+		return 0;
+	case H2_RST_STREAM:
+		if (!id || len != 4) {
+			h2_goaway(h, id ? H2E_FRAME_SIZE_ERROR : H2E_PROTOCOL_ERROR);
+			return -1;
+		}
+		if ((st = h2_find(h, id)))
+			h2_free_stream(h, st);
+		return 0;
+	case H2_SETTINGS:
+		if (id) {
+			h2_goaway(h, H2E_PROTOCOL_ERROR);
+			return -1;
+		}
+		if (flags & H2F_ACK)
+			return 0;
+		if (h2_settings(h, p, len))
+			return -1;
+		return h2_frame(h, H2_SETTINGS, H2F_ACK, 0, 0, 0);
+	case H2_PING:
+		if (id || len != 8) {
+			h2_goaway(h, id ? H2E_PROTOCOL_ERROR : H2E_FRAME_SIZE_ERROR);
+			return -1;
+		}
+		return (flags & H2F_ACK) ? 0 : h2_frame(h, H2_PING, H2F_ACK, 0, p, 8);
+	case H2_GOAWAY:
+		h->closing = 1;
+		return 0;
+	case H2_WINDOW_UPDATE:
+		{
+			long inc;
+			if (len != 4) {
+				h2_goaway(h, H2E_FRAME_SIZE_ERROR);
+				return -1;
+			}
+			inc = ((p[0] & 127) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			if (!id) {
+				if (!inc || h->win + inc > 0x7fffffffL) {
+					h2_goaway(h, inc ? H2E_FLOW_CONTROL_ERROR : H2E_PROTOCOL_ERROR);
+					return -1;
+				}
+				h->win += inc;
+			} else if ((st = h2_find(h, id))) {
+				if (!inc || st->win + inc > 0x7fffffffL) {
+					h2_rst(h, id, inc ? H2E_FLOW_CONTROL_ERROR : H2E_PROTOCOL_ERROR);
+					h2_free_stream(h, st);
+				} else
+					st->win += inc;
+			}
+			return 0;
+		}
+	case H2_PUSH_PROMISE: /* clients can't push */
+		h2_goaway(h, H2E_PROTOCOL_ERROR);
+		return -1;
+	}
+	return 0; /* unknown frame types are ignored */
+}
+
+/* converts the HTTP/1.1 response into a HEADERS frame (and CONTINUATIONs),
+   the body is sent later by h2_send_data. The response is taken over. */
+static int h2_respond(h2_conn_t *h, h2_stream_t *st, char *res, unsigned long len) {
+	h2_buf_t hb = { 0, 0, 0 };
+	unsigned long pos = 0;
+	unsigned int code = 500, sent = 0;
+	int ok = 0;
+
+	if (len > 12 && !strncmp(res, "HTTP/1.", 7)) {
+		code = atoi(res + 9);
+		if (code < 100 || code > 999) code = 500;
+		while (pos < len && res[pos] != '\n') pos++;
+		pos++;
+		while (pos < len) { /* headers */
+			unsigned long eol = pos, col, ve;
+			while (eol < len && res[eol] != '\n') eol++;
+			if (eol >= len) break;
+			ve = eol;
+			if (ve > pos && res[ve - 1] == '\r') ve--;
+			if (ve == pos) { /* empty line - end of headers */
+				ok = 1;
+				pos = eol + 1;
+				break;
+			}
+			for (col = pos; col < ve && res[col] != ':'; col++) {}
+			if (col < ve) {
+				unsigned long nlen = col - pos, vs = col + 1;
+				const char *n = res + pos;
+				while (vs < ve && (res[vs] == ' ' || res[vs] == '\t')) vs++;
+				if (!(nlen == 10 && !strncasecmp(n, "connection", 10)) &&
+					!(nlen == 10 && !strncasecmp(n, "keep-alive", 10)) &&
+					!(nlen == 16 && !strncasecmp(n, "proxy-connection", 16)) &&
+					!(nlen == 17 && !strncasecmp(n, "transfer-encoding", 17)) &&
+					!(nlen == 7 && !strncasecmp(n, "upgrade", 7))) {
+					if (!hb.len) { /* :status must be first */
+						char sc[8];
+						int si;
+						for (si = 8; si < 15; si++)
+							if (atoi(hp_static[si][1]) == code) break;
+						snprintf(sc, sizeof(sc), "%u", code);
+						if (si < 15)
+							hp_enc_int(&hb, 0x80, 7, si);
+						else
+							hp_enc_header(&hb, ":status", 7, sc, 3);
+					}
+					hp_enc_header(&hb, n, nlen, res + vs, ve - vs);
+				}
+			}
+			pos = eol + 1;
+		}
+	}
+	if (!ok) { /* malformed response */
+		code = 500;
+		pos = len;
+	}
+	if (!hb.len) {
+		char sc[8];
+		snprintf(sc, sizeof(sc), "%u", code);
+		if (code == 200)
+			hp_enc_int(&hb, 0x80, 7, 8);
+		else
+			hp_enc_header(&hb, ":status", 7, sc, 3);
+	}
+	if (!hb.d) {
+		free(res);
+		return -1;
+	}
+	/* HEADERS + CONTINUATION frames as needed */
+	while (sent < hb.len || !sent) {
+		unsigned int n = (hb.len - sent > h->peer_frame) ? h->peer_frame : (hb.len - sent);
+		int flags = (sent + n == hb.len) ? H2F_END_HEADERS : 0;
+		if (!sent && pos == len)
+			flags |= H2F_END_STREAM;
+		if (h2_frame(h, sent ? H2_CONTINUATION : H2_HEADERS, flags, st->id, hb.d + sent, n)) {
+			buf_free(&hb);
+			free(res);
+			return -1;
+		}
+		sent += n;
+	}
+	buf_free(&hb);
+	if (pos == len) { /* no body, we're done */
+		free(res);
+		h2_free_stream(h, st);
+		return 0;
+	}
+	st->res = res;
+	st->res_pos = pos;
+	st->res_len = len;
+	st->state = ST_SENDING;
+	return 0;
+}
+
+/* sends as much of the pending responses as flow control allows,
+   streams take turns by frame */
+static int h2_send_data(h2_conn_t *h) {
+	int progress = 1;
+	while (progress && h->win > 0) {
+		h2_stream_t *st = h->streams;
+		progress = 0;
+		while (st && h->win > 0) {
+			h2_stream_t *next = st->next;
+			if (st->state == ST_SENDING && st->win > 0) {
+				unsigned long n = st->res_len - st->res_pos;
+				if (n > h->peer_frame) n = h->peer_frame;
+				if (n > (unsigned long) h->win) n = h->win;
+				if (n > (unsigned long) st->win) n = st->win;
+				if (h2_frame(h, H2_DATA, (st->res_pos + n == st->res_len) ? H2F_END_STREAM : 0, st->id, st->res + st->res_pos, n))
+					return -1;
+				st->res_pos += n;
+				st->win -= n;
+				h->win -= n;
+				progress = 1;
+				if (st->res_pos == st->res_len)
+					h2_free_stream(h, st);
+				if (h->out.len > H2_OBUF_FLUSH && h2_flush(h))
+					return -1;
+			}
+			st = next;
+		}
+	}
+	return 0;
+}
+
+/* serves the first request that is ready */
+static int h2_serve_next(h2_conn_t *h) {
+	h2_stream_t *st = h->streams;
+	char *res = 0;
+	unsigned long res_len = 0;
+	while (st && st->state != ST_READY) st = st->next;
+	if (!st) return 0;
+	if (st->body.len) {
+		char cl[64];
+		snprintf(cl, sizeof(cl), "Content-Length: %lu\r\n", st->body.len);
+		buf_addc(&st->head, cl);
+	}
+	buf_add(&st->head, "\r\n", 2);
+	if (buf_add(&st->head, st->body.d, st->body.len)) {
+		h2_rst(h, st->id, H2E_INTERNAL_ERROR);
+		h2_free_stream(h, st);
+		return 1;
+	}
+	buf_free(&st->body);
+	DBG(fprintf(stderr, "HTTP/2 serving stream %u\n", st->id));
+	if (h->handler(h->c, st->head.d, st->head.len, &res, &res_len) || !res) {
+		if (res) free(res);
+		h2_rst(h, st->id, H2E_INTERNAL_ERROR);
+		h2_free_stream(h, st);
+		return 1;
+	}
+	buf_free(&st->head);
+	return h2_respond(h, st, res, res_len) ? -1 : 1;
+}
+
+void http2_serve(args_t *c, const char *buf, unsigned int len, int preface,
+				 char *upgrade_res, unsigned long upgrade_res_len, const char *settings,
+				 http2_handler_t handler) {
+	h2_conn_t *h = (h2_conn_t*) calloc(1, sizeof(h2_conn_t));
+	unsigned char sp[12];
+
+	if (!h || hp_init(&h->hp)) {
+		RSEprintf("ERROR: cannot allocate HTTP/2 connection\n");
+		if (h) free(h);
+		if (upgrade_res) free(upgrade_res);
+		return;
+	}
+	h->c = c;
+	h->io = c->srv;
+	h->handler = handler;
+	h->win = H2_INIT_WINDOW;
+	h->peer_window = H2_INIT_WINDOW;
+	h->peer_frame = 16384;
+	h->isize = 9 + H2_MAX_FRAME + 1024;
+	if (h->isize < len) h->isize = len;
+	if (!(h->ibuf = (unsigned char*) malloc(h->isize))) {
+		RSEprintf("ERROR: cannot allocate HTTP/2 connection\n");
+		hp_free(&h->hp);
+		free(h);
+		if (upgrade_res) free(upgrade_res);
+		return;
+	}
+	if (len)
+		memcpy(h->ibuf, buf, len);
+	h->ilen = len;
+
+	if (settings) { /* HTTP2-Settings: of the upgrade request (base64url) */
+		char s64[256], sdec[192];
+		unsigned int i;
+		int n;
+		for (i = 0; settings[i] && i < sizeof(s64) - 1; i++)
+			s64[i] = (settings[i] == '-') ? '+' : ((settings[i] == '_') ? '/' : settings[i]);
+		s64[i] = 0;
+		n = base64decode(s64, sdec, sizeof(sdec));
+		if (n > 0)
+			h2_settings(h, (const unsigned char*) sdec, n - (n % 6));
+	}
+
+	/* server preface: our settings */
+	sp[0] = 0; sp[1] = H2S_MAX_CONCURRENT_STREAMS;
+	sp[2] = 0; sp[3] = 0; sp[4] = 0; sp[5] = H2_MAX_STREAMS;
+	sp[6] = 0; sp[7] = H2S_ENABLE_PUSH;
+	sp[8] = 0; sp[9] = 0; sp[10] = 0; sp[11] = 0;
+	h2_frame(h, H2_SETTINGS, 0, 0, sp, 12);
+
+	if (upgrade_res) { /* the upgrade request is stream 1 (half-closed) */
+		h2_stream_t *st = h2_new_stream(h, 1);
+		h->last_id = 1;
+		if (!st || h2_respond(h, st, upgrade_res, upgrade_res_len))
+			goto done;
+	}
+
+	/* client preface */
+	if (preface < HTTP2_PREFACE_LEN) {
+		if (h2_flush(h) || h2_need(h, HTTP2_PREFACE_LEN - preface) ||
+			memcmp(h->ibuf + h->ipos, HTTP2_PREFACE + preface, HTTP2_PREFACE_LEN - preface))
+			goto done;
+		h->ipos += HTTP2_PREFACE_LEN - preface;
+	}
+
+	while (1) {
+		int r;
+		if (h2_send_data(h) || h2_flush(h))
+			break;
+		if ((r = h2_serve_next(h)) < 0)
+			break;
+		if (r) continue;
+		if (h->closing && !h->streams)
+			break;
+		if (h2_read_frame(h)) {
+			h2_flush(h); /* try to send GOAWAY */
+			break;
+		}
+	}
+ done:
+	while (h->streams)
+		h2_free_stream(h, h->streams);
+	buf_free(&h->out);
+	buf_free(&h->hblock);
+	hp_free(&h->hp);
+	free(h->ibuf);
+	free(h);
+}
@@ -0,0 +1,28 @@
+#ifndef HTTP2_H__
+#define HTTP2_H__
+
+#include "RSserver.h"
+
+/* HTTP/2 connection preface sent by the client */
+#define HTTP2_PREFACE     "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+
+/* Serves one request. The request is passed in HTTP/1.1 form (request
+   line, headers, empty line and body) and the handler must return the
+   complete HTTP/1.1 response in a malloc()ed buffer which is then owned
+   by the caller. Returns 0 on success. */
+typedef int (*http2_handler_t)(args_t *c, const char *req, unsigned long req_len, char **res, unsigned long *res_len);
+
+/* Serves an HTTP/2 connection until it is closed by either side.
+   buf/len are bytes already received from the client and preface is
+   the number of bytes of the client connection preface that have been
+   consumed before buf. If upgrade_res is set, the connection was upgraded
+   from HTTP/1.1 (h2c) and upgrade_res (which is taken over) is the HTTP/1.1
+   response to the upgrade request that is to be sent as stream 1.
+   settings is the base64url-encoded HTTP2-Settings: header of the upgrade
+   request (if any). The socket is not closed. */
+void http2_serve(args_t *c, const char *buf, unsigned int len, int preface,
+				 char *upgrade_res, unsigned long upgrade_res_len, const char *settings,
+				 http2_handler_t handler);
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ *  publish/subscribe hub - the master relays encoded WebSocket frames
+ *  published to a channel to all children subscribed to that channel.
+ *
+ *  License: GPL2
+ */
+
+#include "config.h"
+#include "hub.h"
+#include "rsdebug.h"
+#include "rserr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static int hub_on = 0;
+
+void hub_enable(int enable) {
+	hub_on = enable;
+}
+
+int hub_enabled() {
+	return hub_on;
+}
+
+#ifdef unix
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* messages are never larger than this (the length comes from the
+   other side so we don't want to allocate anything it says). The
+   master holds a partially read message for each child, so this
+   also bounds the memory a child can pin without completing one */
+#define HUB_MAX_MSG   (16L * 1024L * 1024L)
+/* maximal amount of data queued for one child. If a child doesn't
+   read its frames fast enough, new messages are dropped for it
+   (whole messages, never partial frames) */
+#define HUB_MAX_QUEUE (32L * 1024L * 1024L)
+
+/* message to be sent to children: header + frame, shared by all
+   subscribers and released when the last one has sent it */
+typedef struct hub_msg {
+	int refs;
+	unsigned long len;
+	char *data;
+	char buf[1];
+} hub_msg_t;
+
+typedef struct hub_out {
+	struct hub_out *next;
+	hub_msg_t *msg;
+} hub_out_t;
+
+typedef struct hub_sub {
+	struct hub_sub *next;
+	char name[1];
+} hub_sub_t;
+
+typedef struct hub_peer {
+	struct hub_peer *next;
+	int fd;
+	pid_t pid;
+	hub_sub_t *subs;
+	hub_out_t *out, *out_tail;
+	unsigned long out_pos, out_bytes;
+	/* input is read incrementally: first the header into in_hdr,
+	   then the payload into in_msg; in_pos counts the bytes of the
+	   current part received so far */
+	long in_hdr[2];
+	hub_msg_t *in_msg;
+	unsigned long in_pos;
+} hub_peer_t;
+
+static hub_peer_t *peers;
+
+/* child side */
+static int hub_child = 0;
+static int hub_fd = -1;
+static int hub_subs = 0;
+
+static int read_all(int fd, void *buf, unsigned long len) {
+	char *c = (char*) buf;
+	while (len) {
+		ssize_t n = read(fd, c, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, unsigned long len) {
+	const char *c = (const char*) buf;
+	while (len) {
+		ssize_t n = write(fd, c, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void msg_release(hub_msg_t *msg) {
+	if (--msg->refs == 0)
+		free(msg);
+}
+
+static void free_peer(hub_peer_t *p) {
+	while (p->subs) {
+		hub_sub_t *s = p->subs;
+		p->subs = s->next;
+		free(s);
+	}
+	while (p->out) {
+		hub_out_t *o = p->out;
+		p->out = o->next;
+		msg_release(o->msg);
+		free(o);
+	}
+	if (p->in_msg)
+		free(p->in_msg);
+	free(p);
+}
+
+int hub_pair(int *sv) {
+	if (!hub_on)
+		return -1;
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ? -1 : 0;
+}
+
+void hub_add_peer(int fd, pid_t pid) {
+	hub_peer_t *p = (hub_peer_t*) calloc(1, sizeof(hub_peer_t));
+	if (!p) {
+		close(fd);
+		return;
+	}
+	p->fd = fd;
+	p->pid = pid;
+	p->next = peers;
+	peers = p;
+}
+
+static void remove_peer(hub_peer_t *p) {
+	hub_peer_t *q = peers;
+#ifdef RSERV_DEBUG
+	printf("hub: removing child %d\n", (int) p->pid);
+#endif
+	if (q == p)
+		peers = p->next;
+	else {
+		while (q && q->next != p) q = q->next;
+		if (q) q->next = p->next;
+	}
+	close(p->fd);
+	free_peer(p);
+}
+
+static int is_subscribed(hub_peer_t *p, const char *channel) {
+	hub_sub_t *s = p->subs;
+	while (s) {
+		if (!strcmp(s->name, channel))
+			return 1;
+		s = s->next;
+	}
+	return 0;
+}
+
+static void subscribe(hub_peer_t *p, const char *channel) {
+	hub_sub_t *s;
+	if (is_subscribed(p, channel))
+		return;
+	if (!(s = (hub_sub_t*) malloc(sizeof(hub_sub_t) + strlen(channel))))
+		return;
+	strcpy(s->name, channel);
+	s->next = p->subs;
+	p->subs = s;
+}
+
+static void unsubscribe(hub_peer_t *p, const char *channel) {
+	hub_sub_t **s = &p->subs;
+	while (*s) {
+		if (!*channel || !strcmp((*s)->name, channel)) {
+			hub_sub_t *n = (*s)->next;
+			free(*s);
+			*s = n;
+		} else
+			s = &(*s)->next;
+	}
+}
+
+/* sends as much of the queue as the socket takes without blocking.
+   Returns -1 if the peer is gone. */
+static int peer_flush(hub_peer_t *p) {
+	while (p->out) {
+		hub_msg_t *msg = p->out->msg;
+		ssize_t n = send(p->fd, msg->data + p->out_pos, msg->len - p->out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		p->out_pos += n;
+		if (p->out_pos == msg->len) {
+			hub_out_t *o = p->out;
+			p->out = o->next;
+			if (!p->out) p->out_tail = 0;
+			p->out_bytes -= msg->len;
+			p->out_pos = 0;
+			msg_release(msg);
+			free(o);
+		}
+	}
+	return 0;
+}
+
+/* queues msg for all peers subscribed to channel. The message is
+   released if nobody takes it */
+static void fan_out(const char *channel, hub_msg_t *msg) {
+	hub_peer_t *p = peers;
+	msg->refs = 1; /* hold the message while we are queuing */
+	while (p) {
+		if (is_subscribed(p, channel)) {
+			hub_out_t *o;
+			if (p->out_bytes + msg->len > HUB_MAX_QUEUE) {
+#ifdef RSERV_DEBUG
+				printf("hub: child %d is too slow, dropping message on '%s'\n", (int) p->pid, channel);
+#endif
+			} else if ((o = (hub_out_t*) malloc(sizeof(hub_out_t)))) {
+				o->next = 0;
+				o->msg = msg;
+				msg->refs++;
+				if (p->out_tail)
+					p->out_tail->next = o;
+				else
+					p->out = o;
+				p->out_tail = o;
+				p->out_bytes += msg->len;
+				/* a failure means the child is gone, it will be
+				   removed by hub_process() on the next turn */
+				peer_flush(p);
+			}
+		}
+		p = p->next;
+	}
+	msg_release(msg);
+}
+
+/* allocates a message with room for len bytes of frame preceded by the header */
+static hub_msg_t *new_msg(unsigned long len) {
+	hub_msg_t *msg = (hub_msg_t*) malloc(sizeof(hub_msg_t) + sizeof(long) * 2 + len);
+	if (msg) {
+		msg->refs = 0;
+		msg->len = sizeof(long) * 2 + len;
+		msg->data = msg->buf;
+	}
+	return msg;
+}
+
+static void set_msg_header(hub_msg_t *msg) {
+	long hdr[2];
+	hdr[0] = HUB_FRAME;
+	hdr[1] = msg->len - sizeof(hdr);
+	memcpy(msg->data, hdr, sizeof(hdr));
+}
+
+/* reads up to len bytes into buf without blocking. Returns the
+   number of bytes read (0 if nothing is available) or -1 if the
+   child is gone */
+static long read_some(int fd, void *buf, unsigned long len) {
+	while (1) {
+		ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		return n ? (long) n : -1;
+	}
+}
+
+/* reads whatever a child has sent and processes the command once it
+   is complete - never blocks, so a slow child cannot stall the server
+   loop. Returns -1 if the child is to be removed */
+static int peer_input(hub_peer_t *p) {
+	long n;
+	hub_msg_t *msg;
+	char *pl;
+	if (!p->in_msg) {
+		if ((n = read_some(p->fd, ((char*) p->in_hdr) + p->in_pos, sizeof(p->in_hdr) - p->in_pos)) < 0)
+			return -1;
+		if ((p->in_pos += n) < sizeof(p->in_hdr))
+			return 0;
+		if (p->in_hdr[1] < 1 || p->in_hdr[1] > HUB_MAX_MSG) {
+			RSEprintf("WARNING: invalid hub message from child %d, disconnecting\n", (int) p->pid);
+			return -1;
+		}
+		/* the payload is read right behind the space for the frame header,
+		   so for publish the channel name is the only thing that has to
+		   be moved out of the way */
+		if (!(p->in_msg = new_msg(p->in_hdr[1]))) {
+			RSEprintf("WARNING: unable to allocate %ld bytes for a hub message\n", p->in_hdr[1]);
+			return -1;
+		}
+		p->in_pos = 0;
+	}
+	msg = p->in_msg;
+	pl = msg->data + sizeof(long) * 2;
+	if ((n = read_some(p->fd, pl + p->in_pos, p->in_hdr[1] - p->in_pos)) < 0)
+		return -1;
+	if ((p->in_pos += n) < (unsigned long) p->in_hdr[1])
+		return 0;
+	/* complete - the peer is ready for the next header */
+	p->in_msg = 0;
+	p->in_pos = 0;
+	if (pl[p->in_hdr[1] - 1] && p->in_hdr[0] != HUB_PUBLISH) {
+		free(msg);
+		return -1;
+	}
+#ifdef RSERV_DEBUG
+	printf("hub: child %d, command %ld, %ld bytes\n", (int) p->pid, p->in_hdr[0], p->in_hdr[1]);
+#endif
+	switch (p->in_hdr[0]) {
+	case HUB_SUBSCRIBE:
+		subscribe(p, pl);
+		break;
+	case HUB_UNSUBSCRIBE:
+		unsubscribe(p, pl);
+		break;
+	case HUB_PUBLISH:
+		{
+			char *channel, *eoc = (char*) memchr(pl, 0, p->in_hdr[1]);
+			unsigned long cl;
+			if (!eoc) {
+				free(msg);
+				return -1;
+			}
+			cl = eoc - pl;
+			if (!(channel = strdup(pl))) {
+				free(msg);
+				return 0;
+			}
+			msg->data = pl + cl + 1 - sizeof(long) * 2;
+			msg->len = p->in_hdr[1] - cl - 1 + sizeof(long) * 2;
+			set_msg_header(msg);
+			fan_out(channel, msg);
+			free(channel);
+			return 0;
+		}
+	}
+	free(msg);
+	return 0;
+}
+
+int hub_fdset(fd_set *rfds, fd_set *wfds, int maxfd, struct timeval *timv) {
+	hub_peer_t *p = peers;
+	while (p) {
+		if (p->fd >= FD_SETSIZE) { /* cannot select on it, so check it regularly */
+			if (timv->tv_sec || timv->tv_usec > 10000) {
+				timv->tv_sec = 0;
+				timv->tv_usec = 10000;
+			}
+		} else {
+			FD_SET(p->fd, rfds);
+			if (p->out)
+				FD_SET(p->fd, wfds);
+			if (p->fd > maxfd)
+				maxfd = p->fd;
+		}
+		p = p->next;
+	}
+	return maxfd;
+}
+
+/* checks whether the peer is ready for ev (POLLIN or POLLOUT), using
+   poll() for descriptors that don't fit in an fd_set */
+static int peer_ready(hub_peer_t *p, fd_set *fds, short ev) {
+	struct pollfd pfd;
+	if (p->fd < FD_SETSIZE)
+		return (fds && FD_ISSET(p->fd, fds)) ? 1 : 0;
+	pfd.fd = p->fd;
+	pfd.events = ev;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) > 0 && pfd.revents) ? 1 : 0;
+}
+
+void hub_process(fd_set *rfds, fd_set *wfds) {
+	hub_peer_t *p = peers;
+	while (p) {
+		hub_peer_t *next = p->next;
+		if ((p->out && peer_ready(p, wfds, POLLOUT) && peer_flush(p)) ||
+			(peer_ready(p, rfds, POLLIN) && peer_input(p)))
+			remove_peer(p);
+		p = next;
+	}
+}
+
+void hub_child_init(int fd) {
+	/* the child inherits the master's peers, but they are not ours */
+	while (peers) {
+		hub_peer_t *p = peers;
+		peers = p->next;
+		close(p->fd);
+		free_peer(p);
+	}
+	hub_child = 1;
+	hub_fd = fd;
+	hub_subs = 0;
+}
+
+int hub_child_fd() {
+	return hub_fd;
+}
+
+int hub_child_active() {
+	return (hub_fd != -1 && hub_subs) ? 1 : 0;
+}
+
+void hub_child_close() {
+	if (hub_fd != -1)
+		close(hub_fd);
+	hub_fd = -1;
+	hub_subs = 0;
+}
+
+int hub_child_recv(char **frame, unsigned long *len) {
+	long cmd[2];
+	char *buf;
+	if (read_all(hub_fd, cmd, sizeof(cmd)) || cmd[0] != HUB_FRAME || cmd[1] < 1 || cmd[1] > HUB_MAX_MSG)
+		return -1;
+	if (!(buf = (char*) malloc(cmd[1])))
+		return -1;
+	if (read_all(hub_fd, buf, cmd[1])) {
+		free(buf);
+		return -1;
+	}
+	*frame = buf;
+	*len = cmd[1];
+	return 0;
+}
+
+int hub_send(int cmd, const char *channel, const char *data, unsigned long len) {
+	unsigned long cl = strlen(channel) + 1;
+	long hdr[2];
+	/* children don't take larger frames (and the master would drop
+	   a child sending a larger message) */
+	if (cl + len > HUB_MAX_MSG)
+		return -1;
+	if (cmd == HUB_PUBLISH && !hub_child) { /* master - deliver directly */
+		hub_msg_t *msg;
+		if (!hub_on || !(msg = new_msg(len)))
+			return -1;
+		memcpy(msg->data + sizeof(long) * 2, data, len);
+		set_msg_header(msg);
+		fan_out(channel, msg);
+		return 0;
+	}
+	if (hub_fd == -1)
+		return -1;
+	hdr[0] = cmd;
+	hdr[1] = cl + len;
+	if (write_all(hub_fd, hdr, sizeof(hdr)) || write_all(hub_fd, channel, cl) ||
+		(len && write_all(hub_fd, data, len))) {
+		hub_child_close();
+		return -1;
+	}
+	if (cmd == HUB_SUBSCRIBE)
+		hub_subs++;
+	else if (cmd == HUB_UNSUBSCRIBE && !*channel)
+		hub_subs = 0;
+	return 0;
+}
+
+#else /* no hub without fork() */
+
+int  hub_pair(int *sv) { return -1; }
+void hub_add_peer(int fd, pid_t pid) { }
+int  hub_fdset(fd_set *rfds, fd_set *wfds, int maxfd, struct timeval *timv) { return maxfd; }
+void hub_process(fd_set *rfds, fd_set *wfds) { }
+void hub_child_init(int fd) { }
+int  hub_child_fd() { return -1; }
+int  hub_child_active() { return 0; }
+void hub_child_close() { }
+int  hub_child_recv(char **frame, unsigned long *len) { return -1; }
+int  hub_send(int cmd, const char *channel, const char *data, unsigned long len) { return -1; }
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef HUB_H__
+#define HUB_H__
+
+/* publish/subscribe hub
+
+   Each child has a socket pair to the master. Children subscribe to
+   named channels and publish messages to them. A published message is
+   a complete, encoded WebSocket frame - the master only passes it on
+   to all children subscribed to the channel which write it to their
+   WebSocket as-is. Hence a message is encoded once regardless of the
+   number of subscribers. */
+
+#include <sys/types.h>
+#ifdef unix
+#include <sys/select.h>
+#endif
+
+#define HUB_SUBSCRIBE   1 /* child -> master, data: channel */
+#define HUB_UNSUBSCRIBE 2 /* child -> master, data: channel (empty = all) */
+#define HUB_PUBLISH     3 /* child -> master, data: channel, frame */
+#define HUB_FRAME       4 /* master -> child, data: frame */
+
+void hub_enable(int enable);
+int  hub_enabled();
+
+/* --- master side --- */
+
+/* creates the socket pair for a new child, sv[0] is the master end,
+   sv[1] the child end. Returns 0 on success or -1 if the hub is
+   disabled or the pair cannot be created */
+int  hub_pair(int *sv);
+/* registers the master end of a new child */
+void hub_add_peer(int fd, pid_t pid);
+/* adds hub descriptors to the sets used by the server loop and
+   shortens the timeout if some of them cannot be selected on.
+   Returns the new maximal fd */
+int  hub_fdset(fd_set *rfds, fd_set *wfds, int maxfd, struct timeval *timv);
+/* processes hub descriptors that are ready (the sets may be NULL if
+   select() timed out) */
+void hub_process(fd_set *rfds, fd_set *wfds);
+
+/* --- child side --- */
+
+/* sets the child end of the pair (and closes descriptors of all other peers) */
+void hub_child_init(int fd);
+/* descriptor connected to the master (-1 if not available) */
+int  hub_child_fd();
+/* returns 1 if the child has subscribed to a channel (so it may get frames) */
+int  hub_child_active();
+/* reads one frame sent by the master into a malloc()ed buffer, returns 0 on success, -1 on error */
+int  hub_child_recv(char **frame, unsigned long *len);
+/* closes the connection to the master */
+void hub_child_close();
+
+/* sends a command to the master. In the master HUB_PUBLISH is
+   processed directly. Returns 0 on success, -1 on failure */
+int  hub_send(int cmd, const char *channel, const char *data, unsigned long len);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "json_encode.h"
+
+void base64encode(const unsigned char *src, int len, char *dst);
+
+/* objects nested deeper than this are encoded as null */
+#define MAX_DEPTH 512
+
+int json_write(json_out_t *o, const char *s, rlen_t len) {
+	while (len && !o->err) {
+		rlen_t n = o->size - o->len;
+		if (!n) {
+			if (o->flush(o, o->buf, o->len))
+				o->err = 1;
+			o->len = 0;
+			continue;
+		}
+		if (n > len) n = len;
+		memcpy(o->buf + o->len, s, n);
+		o->len += n;
+		s += n;
+		len -= n;
+	}
+	return o->err;
+}
+
+static int json_putc(json_out_t *o, char c) {
+	if (o->len < o->size) {
+		o->buf[o->len++] = c;
+		return 0;
+	}
+	return json_write(o, &c, 1);
+}
+
+#define json_lit(O, S) json_write(O, S, sizeof(S) - 1)
+
+static const char *hex = "0123456789abcdef";
+
+int json_string(json_out_t *o, const char *s) {
+	const char *c = s;
+	json_putc(o, '"');
+	while (*c) {
+		const char *e = c;
+		/* copy runs of characters that don't need escaping in one go */
+		while (*e && *e != '"' && *e != '\\' && ((unsigned char) *e) >= 32) e++;
+		if (e > c)
+			json_write(o, c, e - c);
+		if (!*e) break;
+		switch (*e) {
+		case '"':  json_lit(o, "\\\""); break;
+		case '\\': json_lit(o, "\\\\"); break;
+		case '\n': json_lit(o, "\\n"); break;
+		case '\r': json_lit(o, "\\r"); break;
+		case '\t': json_lit(o, "\\t"); break;
+		default:
+			{
+				char u[6] = { '\\', 'u', '0', '0', 0, 0 };
+				u[4] = hex[((unsigned char) *e) >> 4];
+				u[5] = hex[*e & 15];
+				json_write(o, u, 6);
+			}
+		}
+		c = e + 1;
+	}
+	return json_putc(o, '"');
+}
+
+static int json_int(json_out_t *o, int v) {
+	char b[16], *c = b + sizeof(b);
+	unsigned int u = (v < 0) ? - (unsigned int) v : (unsigned int) v;
+	do {
+		*(--c) = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (v < 0) *(--c) = '-';
+	return json_write(o, c, b + sizeof(b) - c);
+}
+
+static int json_real(json_out_t *o, double v) {
+	char b[32];
+	int n;
+	if (!R_FINITE(v))
+		return json_lit(o, "null");
+	if (v > -2147483648.0 && v < 2147483648.0 && v == (double) (int) v && (v != 0.0 || 1.0 / v > 0))
+		return json_int(o, (int) v);
+	/* use the shortest representation that reads back as the same number */
+	n = snprintf(b, sizeof(b), "%.15g", v);
+	if (strtod(b, 0) != v)
+		n = snprintf(b, sizeof(b), "%.17g", v);
+	return json_write(o, b, n);
+}
+
+static int json_charsxp(json_out_t *o, SEXP s) {
+	const void *vmax;
+	if (s == R_NaString)
+		return json_lit(o, "null");
+	vmax = vmaxget();
+	json_string(o, Rf_translateCharUTF8(s));
+	vmaxset(vmax);
+	return o->err;
+}
+
+static int json_value(json_out_t *o, SEXP x, int depth);
+
+/* encodes element i of the vector x (levels are the levels if x is a factor) */
+static int json_elt(json_out_t *o, SEXP x, R_xlen_t i, SEXP levels, int depth) {
+	switch (TYPEOF(x)) {
+	case LGLSXP:
+		{
+			int v = LOGICAL(x)[i];
+			if (v == NA_LOGICAL) return json_lit(o, "null");
+			return v ? json_lit(o, "true") : json_lit(o, "false");
+		}
+	case INTSXP:
+		{
+			int v = INTEGER(x)[i];
+			if (v == NA_INTEGER) return json_lit(o, "null");
+			if (levels != R_NilValue) {
+				if (v < 1 || v > LENGTH(levels)) return json_lit(o, "null");
+				return json_charsxp(o, STRING_ELT(levels, v - 1));
+			}
+			return json_int(o, v);
+		}
+	case REALSXP:
+		return json_real(o, REAL(x)[i]);
+	case CPLXSXP:
+		{
+			Rcomplex c = COMPLEX(x)[i];
+			char b[64];
+			if (ISNAN(c.r) || ISNAN(c.i)) return json_lit(o, "null");
+			snprintf(b, sizeof(b), "%.15g%+.15gi", c.r, c.i);
+			return json_string(o, b);
+		}
+	case STRSXP:
+		return json_charsxp(o, STRING_ELT(x, i));
+	case VECSXP:
+	case EXPRSXP:
+		return json_value(o, VECTOR_ELT(x, i), depth + 1);
+	}
+	return json_lit(o, "null");
+}
+
+/* names as object keys, missing names are replaced by the index */
+static int json_key(json_out_t *o, SEXP names, R_xlen_t i) {
+	SEXP nm = (TYPEOF(names) == STRSXP) ? STRING_ELT(names, i) : R_NaString;
+	if (nm == R_NaString || !*CHAR(nm)) {
+		char b[32];
+		snprintf(b, sizeof(b), "%ld", (long) (i + 1));
+		json_string(o, b);
+	} else
+		json_charsxp(o, nm);
+	return json_putc(o, ':');
+}
+
+static int json_raw(json_out_t *o, SEXP x) {
+	const unsigned char *r = (const unsigned char*) RAW(x);
+	R_xlen_t n = XLENGTH(x);
+	char b[4097];
+	json_putc(o, '"');
+	while (n > 0 && !o->err) { /* 3072 bytes of input are 4096 bytes of output */
+		int cl = (n > 3072) ? 3072 : (int) n;
+		base64encode(r, cl, b);
+		json_write(o, b, strlen(b));
+		r += cl;
+		n -= cl;
+	}
+	return json_putc(o, '"');
+}
+
+static int json_frame(json_out_t *o, SEXP x, int depth) {
+	SEXP names = Rf_getAttrib(x, R_NamesSymbol);
+	int nc = LENGTH(x), j;
+	R_xlen_t nr = nc ? XLENGTH(VECTOR_ELT(x, 0)) : 0, i;
+	SEXP *lev = (SEXP*) R_alloc(nc + 1, sizeof(SEXP));
+	for (j = 0; j < nc; j++)
+		lev[j] = Rf_isFactor(VECTOR_ELT(x, j)) ? Rf_getAttrib(VECTOR_ELT(x, j), R_LevelsSymbol) : R_NilValue;
+	json_putc(o, '[');
+	for (i = 0; i < nr && !o->err; i++) {
+		if (i) json_putc(o, ',');
+		json_putc(o, '{');
+		for (j = 0; j < nc; j++) {
+			SEXP col = VECTOR_ELT(x, j);
+			if (j) json_putc(o, ',');
+			json_key(o, names, j);
+			if (i < XLENGTH(col))
+				json_elt(o, col, i, lev[j], depth);
+			else
+				json_lit(o, "null");
+		}
+		json_putc(o, '}');
+	}
+	return json_putc(o, ']');
+}
+
+static int json_value(json_out_t *o, SEXP x, int depth) {
+	int t = TYPEOF(x);
+	R_xlen_t i, n;
+	SEXP names, dim, levels = R_NilValue;
+
+	if (o->err)
+		return o->err;
+	if (depth > MAX_DEPTH)
+		return json_lit(o, "null");
+	switch (t) {
+	case LGLSXP:
+	case INTSXP:
+	case REALSXP:
+	case CPLXSXP:
+	case STRSXP:
+	case VECSXP:
+	case EXPRSXP:
+		break;
+	case RAWSXP:
+		return json_raw(o, x);
+	case SYMSXP:
+		return json_charsxp(o, PRINTNAME(x));
+	default:
+		return json_lit(o, "null");
+	}
+
+	if (t == VECSXP && Rf_inherits(x, "data.frame"))
+		return json_frame(o, x, depth);
+	if (t == INTSXP && Rf_isFactor(x))
+		levels = Rf_getAttrib(x, R_LevelsSymbol);
+	n = XLENGTH(x);
+	dim = Rf_getAttrib(x, R_DimSymbol);
+	if (TYPEOF(dim) == INTSXP && LENGTH(dim) == 2) { /* matrix - array of rows */
+		int nr = INTEGER(dim)[0], nc = INTEGER(dim)[1], j;
+		json_putc(o, '[');
+		for (i = 0; i < nr && !o->err; i++) {
+			if (i) json_putc(o, ',');
+			json_putc(o, '[');
+			for (j = 0; j < nc; j++) {
+				if (j) json_putc(o, ',');
+				json_elt(o, x, i + ((R_xlen_t) j) * nr, levels, depth);
+			}
+			json_putc(o, ']');
+		}
+		return json_putc(o, ']');
+	}
+	names = Rf_getAttrib(x, R_NamesSymbol);
+	if (TYPEOF(names) == STRSXP && XLENGTH(names) == n) {
+		json_putc(o, '{');
+		for (i = 0; i < n && !o->err; i++) {
+			if (i) json_putc(o, ',');
+			json_key(o, names, i);
+			json_elt(o, x, i, levels, depth);
+		}
+		return json_putc(o, '}');
+	}
+	json_putc(o, '[');
+	for (i = 0; i < n && !o->err; i++) {
+		if (i) json_putc(o, ',');
+		json_elt(o, x, i, levels, depth);
+	}
+	return json_putc(o, ']');
+}
+
+int json_encode(json_out_t *o, SEXP x) {
+	const void *vmax = vmaxget();
+	json_value(o, x, 0);
+	vmaxset(vmax);
+	return o->err;
+}
@@ -0,0 +1,39 @@
+#ifndef JSON_ENCODE_H__
+#define JSON_ENCODE_H__
+
+#include <Rinternals.h>
+#include <Rversion.h>
+
+#if R_VERSION < R_Version(3,0,0) /* no long vectors */
+#define XLENGTH(X) LENGTH(X)
+typedef int R_xlen_t;
+#endif
+
+#include "Rsrv.h"
+
+/* JSON encoder that writes into a fixed buffer and passes it on to the
+   flush callback whenever it is full, so objects of any size can be
+   encoded in constant memory */
+typedef struct json_out {
+	char *buf;
+	rlen_t len, size;
+	/* called with the content of the buffer when it is full, must return 0 on success */
+	int (*flush)(struct json_out *o, const char *buf, rlen_t len);
+	void *ctx;
+	int err; /* set if flush failed, nothing more is written */
+} json_out_t;
+
+/* encodes x: atomic vectors are arrays (objects if they have names),
+   NA and non-finite numbers are null, factors are strings, matrices are
+   arrays of rows, data frames arrays of row objects, lists arrays or
+   objects, raw vectors base64 strings and NULL or anything else null.
+   The buffer is not flushed at the end. Returns 0 on success. */
+int json_encode(json_out_t *o, SEXP x);
+
+/* appends a string (as JSON string literal) */
+int json_string(json_out_t *o, const char *s);
+
+/* writes raw content */
+int json_write(json_out_t *o, const char *s, rlen_t len);
+
+#endif
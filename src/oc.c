@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "oc.h"
 #include "sha1.h"
+#include "qap_decode.h"
 
 #ifndef NO_CONFIG_H
 #include "config.h"
@@ -17,14 +19,261 @@
 #include <unistd.h>
 #endif
 
-static SEXP oc_env;
+/* latency histogram bins: < 10us, < 100us, ..., < 10s, >= 10s */
+#define OC_HIST_BINS 8
+
+struct oc_entry {
+    SEXP what; /* preserved, NULL for capabilities of workers */
+    int worker, shared; /* see oc_location() */
+    double calls, errors, time;
+    double hist[OC_HIST_BINS];
+    char token[MAX_OC_TOKEN_LEN + 1];
+};
+
+/* capabilities are kept in an open-addressing hash table (linear
+   probing, load factor at most 1/2) keyed by the token. Capabilities
+   are never removed. */
+static oc_entry_t **oc_table;
+static unsigned int oc_table_size, oc_count;
+
+int oc_stats_enabled;
+
+void (*oc_register_hook)(const char *token);
+
+/* FNV-1a */
+static unsigned int oc_hash(const char *token) {
+    unsigned int h = 2166136261u;
+    while (*token)
+	h = (h ^ (unsigned char) *(token++)) * 16777619u;
+    return h;
+}
+
+static oc_entry_t **oc_slot(oc_entry_t **table, unsigned int size, const char *token) {
+    unsigned int mask = size - 1, i = oc_hash(token) & mask;
+    while (table[i] && strcmp(table[i]->token, token))
+	i = (i + 1) & mask;
+    return table + i;
+}
+
+oc_entry_t *oc_lookup(const char *ref) {
+    return oc_table ? *oc_slot(oc_table, oc_table_size, ref) : 0;
+}
+
+static oc_entry_t *oc_add(const char *token, SEXP what) {
+    oc_entry_t *e;
+    if ((oc_count + 1) * 2 > oc_table_size) {
+	unsigned int i, size = oc_table_size ? (oc_table_size * 2) : 64;
+	oc_entry_t **table = (oc_entry_t**) calloc(size, sizeof(oc_entry_t*));
+	if (!table) return 0;
+	for (i = 0; i < oc_table_size; i++)
+	    if (oc_table[i])
+		*oc_slot(table, size, oc_table[i]->token) = oc_table[i];
+	free(oc_table);
+	oc_table = table;
+	oc_table_size = size;
+    }
+    if (!(e = (oc_entry_t*) calloc(1, sizeof(oc_entry_t))))
+	return 0;
+    strcpy(e->token, token);
+    e->what = what;
+    e->worker = -1;
+    if (what)
+	R_PreserveObject(what);
+    *oc_slot(oc_table, oc_table_size, token) = e;
+    oc_count++;
+    return e;
+}
 
 SEXP oc_resolve(const char *ref) {
-    SEXP val;
-    if (!oc_env) return R_NilValue;
-    val = findVarInFrame(oc_env, install(ref));
-    if (val == R_UnboundValue) val = R_NilValue;
-    return val;
+    oc_entry_t *e = oc_lookup(ref);
+    return (e && e->what) ? e->what : R_NilValue;
+}
+
+int oc_location(oc_entry_t *e) {
+    return (e->worker >= 0) ? e->worker : (e->shared ? OC_SHARED : OC_LOCAL);
+}
+
+void oc_share_all() {
+    unsigned int i;
+    for (i = 0; i < oc_table_size; i++)
+	if (oc_table[i])
+	    oc_table[i]->shared = 1;
+}
+
+oc_entry_t *oc_add_remote(const char *token, int worker) {
+    oc_entry_t *e = oc_lookup(token);
+    if (e || strlen(token) > MAX_OC_TOKEN_LEN || !(e = oc_add(token, 0)))
+	return e;
+    e->worker = worker;
+    return e;
+}
+
+void oc_record(oc_entry_t *e, double time, int error) {
+    int bin = 0;
+    double lim = 0.00001;
+    e->calls += 1.0;
+    if (error) e->errors += 1.0;
+    e->time += time;
+    while (bin < OC_HIST_BINS - 1 && time >= lim) {
+	lim *= 10.0;
+	bin++;
+    }
+    e->hist[bin] += 1.0;
+}
+
+/* skips one encoded SEXP, returns NULL if it doesn't end before end */
+static unsigned int *qap_skip(unsigned int *b, unsigned int *end) {
+    unsigned int h;
+    rlen_t ln;
+    if (b >= end)
+	return 0;
+    h = ptoi(*b);
+    ln = PAR_LEN(h);
+    if (IS_LARGE(PAR_TYPE(h))) {
+	if (++b >= end)
+	    return 0;
+	ln |= ((rlen_t) (unsigned int) ptoi(*b)) << 24;
+    }
+    b++;
+    if (ln > (rlen_t) (((char*) end) - ((char*) b)))
+	return 0;
+    return (unsigned int*) (((char*) b) + ln);
+}
+
+/* Parses the header of an OC call of len bytes, i.e., XT_LANG_NOTAG or
+   XT_LANG_TAG with the token string as the first element. All elements
+   are checked to lie within the call and the token is looked up
+   directly in the encoded data, so invalid calls are rejected before
+   anything is allocated. Returns the capability (NULL if the call is
+   invalid) and sets *type, *args (first argument) and *end. */
+static oc_entry_t *oc_parse_call(unsigned int *b, rlen_t len, int *type, unsigned int **args, unsigned int **end) {
+    unsigned int h, *el, *eend, *a;
+    int ty, ety;
+    rlen_t ln, eln;
+    char *c, *ce;
+    oc_entry_t *e;
+
+    if (len < 4)
+	return 0;
+    h = ptoi(*b);
+    ty = PAR_TYPE(h);
+    ln = PAR_LEN(h);
+    if (IS_LARGE(ty)) {
+	if (len < 8)
+	    return 0;
+	ty ^= XT_LARGE;
+	b++;
+	len -= 4;
+	ln |= ((rlen_t) (unsigned int) ptoi(*b)) << 24;
+    }
+    b++;
+    if (ln > len - 4)
+	return 0;
+    *end = (unsigned int*) (((char*) b) + ln);
+    if (ty & XT_HAS_ATTR) { /* attributes of the call are not used */
+	if (!(b = qap_skip(b, *end)))
+	    return 0;
+	ty ^= XT_HAS_ATTR;
+    }
+    if ((ty != XT_LANG_NOTAG && ty != XT_LANG_TAG) || !(eend = qap_skip(b, *end)))
+	return 0;
+
+    /* the first element must be a single string (attributes such as
+       the OCref class are ignored) */
+    h = ptoi(*b);
+    ety = PAR_TYPE(h);
+    el = b + 1;
+    if (IS_LARGE(ety))
+	return 0;
+    if (ety & XT_HAS_ATTR) {
+	if (!(el = qap_skip(el, eend)))
+	    return 0;
+	ety ^= XT_HAS_ATTR;
+    }
+    c = (char*) el;
+    eln = ((char*) eend) - c;
+    ce = memchr(c, 0, (eln > MAX_OC_TOKEN_LEN + 1) ? (MAX_OC_TOKEN_LEN + 1) : eln);
+    if (!ce || ce == c)
+	return 0;
+    /* XT_ARRAY_STR must hold exactly one string (padded with 1s), in
+       XT_STR anything after the terminating NUL is padding */
+    if ((ety != XT_ARRAY_STR && ety != XT_STR) ||
+	(ety == XT_ARRAY_STR && memchr(ce + 1, 0, (c + eln) - (ce + 1))))
+	return 0;
+    b = eend;
+    if (ty == XT_LANG_TAG && !(b = qap_skip(b, *end))) /* tag of the function */
+	return 0;
+    /* arguments (and tags) */
+    for (a = b; a < *end; )
+	if (!(a = qap_skip(a, *end)))
+	    return 0;
+    if (!(e = oc_lookup(c)))
+	return 0;
+    *type = ty;
+    *args = b;
+    return e;
+}
+
+oc_entry_t *oc_call_entry(unsigned int *buf, rlen_t len) {
+    unsigned int *args, *end;
+    int ty;
+    return oc_parse_call(buf, len, &ty, &args, &end);
+}
+
+/* Argument names still have to be interned as symbols, so a string tag
+   is only accepted if it is a short syntactic name. That keeps clients
+   from filling the symbol table with arbitrary strings. */
+#define OC_MAX_TAG 64
+
+static int oc_tag_ok(const char *c) {
+    const char *s = c;
+    if ((*c >= '0' && *c <= '9') || *c == '_')
+	return 0;
+    for (; *c; c++)
+	if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+	      (*c >= '0' && *c <= '9') || *c == '.' || *c == '_') ||
+	    c - s >= OC_MAX_TAG)
+	    return 0;
+    return 1;
+}
+
+/* Decodes an OC call of len bytes. The arguments are decoded into the
+   call that has the capability as its function. Returns NULL if the
+   call is invalid (including tags rejected by oc_tag_ok) or the
+   capability lives in another process, otherwise *ent is set to the
+   capability. */
+SEXP oc_decode_call(unsigned int *buf, rlen_t len, oc_entry_t **ent) {
+    unsigned int *b, *end;
+    int ty;
+    oc_entry_t *e = oc_parse_call(buf, len, &ty, &b, &end);
+    SEXP call, tail;
+
+    if (!e || !e->what)
+	return 0;
+    call = tail = PROTECT(LCONS(e->what, R_NilValue));
+    while (b < end) {
+	SEXP arg = PROTECT(CONS(QAP_decode(&b), R_NilValue));
+	if (ty == XT_LANG_TAG) {
+	    SEXP tag = QAP_decode(&b);
+	    /* tags are encoded as strings or symbols */
+	    if (TYPEOF(tag) == STRSXP && LENGTH(tag) == 1 &&
+		STRING_ELT(tag, 0) != NA_STRING && *CHAR(STRING_ELT(tag, 0))) {
+		if (!oc_tag_ok(CHAR(STRING_ELT(tag, 0)))) {
+		    UNPROTECT(2);
+		    return 0;
+		}
+		tag = install(CHAR(STRING_ELT(tag, 0)));
+	    }
+	    if (TYPEOF(tag) == SYMSXP)
+		SET_TAG(arg, tag);
+	}
+	SETCDR(tail, arg);
+	tail = arg;
+	UNPROTECT(1);
+    }
+    UNPROTECT(1);
+    *ent = e;
+    return call;
 }
 
 /* this is where we generate tokens. The current apporach is to generate good random
@@ -36,9 +285,6 @@ static int rand_inited;
 
 static const char b64map[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_.";
 
-/* currently we use 21 bytes = 168 bits --> 28 bytes encoded */
-#define MAX_OC_TOKEN_LEN 31
-
 static void oc_new(char *dst) {
     int have_hash = 0, i;
     unsigned char hash[21];
@@ -76,15 +322,12 @@ static void oc_new(char *dst) {
 
 char *oc_register(SEXP what, char *dst, int len) {
     if (len <= MAX_OC_TOKEN_LEN) return NULL;
-    if (!oc_env) {
-	SEXP env = eval(PROTECT(lang3(install("new.env"), ScalarLogical(TRUE), R_EmptyEnv)), R_GlobalEnv);
-	UNPROTECT(1);
-	if (TYPEOF(env) != ENVSXP) return NULL;
-	oc_env = env;
-	R_PreserveObject(oc_env);
-    }
-    oc_new(dst);
-    Rf_defineVar(install(dst), what, oc_env);
+    do
+	oc_new(dst);
+    while (oc_lookup(dst));
+    if (!oc_add(dst, what)) return NULL;
+    if (oc_register_hook)
+	oc_register_hook(dst);
     return dst;
 }
 
@@ -103,3 +346,36 @@ SEXP Rserve_oc_register(SEXP what) {
     UNPROTECT(1);
     return res;
 }
+
+/* returns a matrix with calls, errors, total time and the latency
+   histogram of the given capabilities (rows of unknown tokens are NA).
+   Only capabilities the caller knows can be queried for the same reason
+   as above. */
+SEXP Rserve_oc_stats(SEXP refs) {
+    static const char *cols[] = { "calls", "errors", "time", "<10us", "<100us", "<1ms",
+				  "<10ms", "<100ms", "<1s", "<10s", ">=10s" };
+    int i, j, n, nc = 3 + OC_HIST_BINS;
+    SEXP res, dn, cn;
+    if (TYPEOF(refs) != STRSXP)
+	Rf_error("invalid capability references");
+    n = LENGTH(refs);
+    res = PROTECT(allocMatrix(REALSXP, n, nc));
+    for (i = 0; i < n; i++) {
+	oc_entry_t *e = (STRING_ELT(refs, i) == R_NaString) ? 0 : oc_lookup(CHAR(STRING_ELT(refs, i)));
+	double *r = REAL(res) + i;
+	r[0] = e ? e->calls : NA_REAL;
+	r[n] = e ? e->errors : NA_REAL;
+	r[2 * n] = e ? e->time : NA_REAL;
+	for (j = 0; j < OC_HIST_BINS; j++)
+	    r[(3 + j) * n] = e ? e->hist[j] : NA_REAL;
+    }
+    dn = allocVector(VECSXP, 2);
+    setAttrib(res, R_DimNamesSymbol, dn);
+    SET_VECTOR_ELT(dn, 0, refs);
+    cn = allocVector(STRSXP, nc);
+    SET_VECTOR_ELT(dn, 1, cn);
+    for (j = 0; j < nc; j++)
+	SET_STRING_ELT(cn, j, mkChar(cols[j]));
+    UNPROTECT(1);
+    return res;
+}
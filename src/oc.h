@@ -2,8 +2,39 @@
 #define OC_H__
 
 #include <Rinternals.h>
+#include "Rsrv.h"
+
+/* currently we use 21 bytes = 168 bits --> 28 bytes encoded */
+#define MAX_OC_TOKEN_LEN 31
+
+typedef struct oc_entry oc_entry_t;
+
+/* location of a capability as returned by oc_location(), values >= 0
+   are indices of the worker process it was registered in */
+#define OC_SHARED -1 /* registered before the workers were forked */
+#define OC_LOCAL  -2 /* registered in this process only */
+
+/* if set, oc_record() is used to collect per-capability statistics */
+extern int oc_stats_enabled;
+/* if set, it is called with the token of each new capability */
+extern void (*oc_register_hook)(const char *token);
 
 SEXP oc_resolve(const char *ref);
 char *oc_register(SEXP what, char *dst, int len);
 
+oc_entry_t *oc_lookup(const char *ref);
+/* decodes a QAP-encoded OC call of len bytes, NULL if it is invalid */
+SEXP oc_decode_call(unsigned int *buf, rlen_t len, oc_entry_t **ent);
+/* looks up the capability of a QAP-encoded OC call without decoding it */
+oc_entry_t *oc_call_entry(unsigned int *buf, rlen_t len);
+/* records a call of the capability that took time seconds */
+void oc_record(oc_entry_t *e, double time, int error);
+
+/* support for asynchronous OC calls evaluated by worker processes */
+int oc_location(oc_entry_t *e);
+/* marks all current capabilities as shared (before forking workers) */
+void oc_share_all();
+/* records a capability registered in a worker, calls of it can only be routed */
+oc_entry_t *oc_add_remote(const char *token, int worker);
+
 #endif
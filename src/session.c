@@ -1,5 +1,10 @@
 /*
- *  implements a vector of session scructures accessible by a session key.
+ *  implements a registry of session scructures accessible by a session key.
+ *
+ *  Sessions are allocated individually (so they don't move) and indexed
+ *  by an open-addressing hash table with linear probing, hence lookup,
+ *  insertion and removal are O(1). All sessions are also kept in a
+ *  doubly-linked list for walking through them.
  *
  *  Author : Simon Urbanek
  *  Created: 2005/08/30
@@ -17,60 +22,119 @@
 #endif
 #include <stdlib.h>
 
-static struct sSession *session=0;
-static int sessions=0;
-static int sessions_allocated=0;
+static struct sSession **table = 0; /* hash table (NULL = empty slot) */
+static unsigned int table_size = 0; /* always a power of 2 */
+static int sessions = 0;
+static struct sSession *first = 0, *last = 0;
 
-/* find a session */
-struct sSession *find_session(char key[16]) {
-	int i=0;
-	while (i<sessions) {
-		if (!memcmp(key,session[i].key,16))
-			return &session[i];
-		i++;
+#define initial_table_size 256
+
+/* FNV-1a */
+static unsigned int key_hash(const unsigned char *key) {
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < SESSION_KEY_LEN; i++)
+		h = (h ^ key[i]) * 16777619u;
+	return h;
+}
+
+/* returns the slot of the key or the empty slot where it belongs */
+static unsigned int find_slot(const unsigned char *key) {
+	unsigned int mask = table_size - 1, i = key_hash(key) & mask;
+	while (table[i] && memcmp(table[i]->key, key, SESSION_KEY_LEN))
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int resize_table(unsigned int size) {
+	struct sSession **old = table;
+	unsigned int old_size = table_size, i;
+	if (!(table = (struct sSession**) calloc(size, sizeof(struct sSession*)))) {
+		table = old;
+		return -1;
 	}
+	table_size = size;
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			table[find_slot(old[i]->key)] = old[i];
+	free(old);
 	return 0;
 }
 
-#define sessions_increment 128
+/* find a session */
+struct sSession *find_session(char key[SESSION_KEY_LEN]) {
+	struct sSession *s;
+	if (!sessions)
+		return 0;
+	s = table[find_slot((unsigned char*) key)];
+	if (s)
+		s->last_used = time(0);
+	return s;
+}
 
 /* create a new session */
-struct sSession *new_session(char key[16]) {
-	if (!session) {
-		sessions_allocated = sessions_increment;
-		session = (struct sSession*) calloc(sessions_allocated, sizeof(struct sSession));
-	} else if (sessions_allocated <= sessions) {
-		sessions_allocated += sessions_increment;
-		session = (struct sSession*) realloc(session, sessions_allocated * sizeof(struct sSession));
-	}
-	memset(&session[sessions], 0, sizeof(struct sSession));
-	memcpy(&session[sessions].key, key, 16);
-	return &session[sessions++];
+struct sSession *new_session(char key[SESSION_KEY_LEN]) {
+	struct sSession *s;
+	unsigned int i;
+	/* keep the load factor at most 1/2 */
+	if (!table && resize_table(initial_table_size))
+		return 0;
+	if ((sessions + 1) * 2 > table_size && resize_table(table_size * 2))
+		return 0;
+	i = find_slot((unsigned char*) key);
+	if (table[i] || !(s = (struct sSession*) calloc(1, sizeof(struct sSession))))
+		return 0;
+	memcpy(s->key, key, SESSION_KEY_LEN);
+	s->created = s->last_used = time(0);
+	s->prev = last;
+	if (last)
+		last->next = s;
+	else
+		first = s;
+	last = s;
+	table[i] = s;
+	sessions++;
+	return s;
 }
 
 /* remove session */
-void free_session(char key[16]) {
-	int i=0;
-	while (i<sessions) {
-		if (!memcmp(key,session[i].key,16)) {
-			if (i<sessions-1)
-				memmove(session+i, session+i+1, sizeof(struct sSession)*(sessions-i-1));
-			sessions--;
-			if (sessions_allocated>128 && sessions < sessions_allocated/2) {
-				sessions_allocated = sessions_allocated/2 + 64;
-				session = (struct sSession*) realloc(session, sessions_allocated * sizeof(struct sSession));
-			}
-			return;
-		}
-		i++;
+void free_session(char key[SESSION_KEY_LEN]) {
+	unsigned int mask = table_size - 1, i, j;
+	struct sSession *s;
+	if (!sessions)
+		return;
+	i = find_slot((unsigned char*) key);
+	if (!(s = table[i]))
+		return;
+	/* close the gap by moving back entries of the same probe
+	   sequence, so no tombstones are needed */
+	j = i;
+	while (1) {
+		unsigned int h;
+		table[i] = 0;
+		do {
+			j = (j + 1) & mask;
+			if (!table[j])
+				goto removed;
+			h = key_hash(table[j]->key) & mask;
+			/* table[j] can fill the gap at i unless its home slot h lies cyclically in (i, j] */
+		} while ((i <= j) ? (i < h && h <= j) : (i < h || h <= j));
+		table[i] = table[j];
+		i = j;
 	}
+ removed:
+	if (s->prev) s->prev->next = s->next; else first = s->next;
+	if (s->next) s->next->prev = s->prev; else last = s->prev;
+	free(s);
+	sessions--;
+	if (table_size > initial_table_size && sessions * 8 < table_size)
+		resize_table(table_size / 2);
 }
 
 int total_sessions() { return sessions; }
-struct sSession *first_session() { return session; }
+struct sSession *first_session() { return first; }
 struct sSession *next_session(struct sSession* current) {
-	if (current<session || current>=session+sessions-1) return 0;
-	return current+1;
+	return current ? current->next : 0;
 }
 
 /*--- The following makes the indenting behavior of emacs compatible
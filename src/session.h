@@ -1,20 +1,33 @@
 #ifndef SESSION_H__
 #define SESSION_H__
 
+#include <time.h>
+
+#define SESSION_KEY_LEN 32
+
 struct sSession {
-	unsigned char key[16];
+	unsigned char key[SESSION_KEY_LEN];
 	int s;
+	unsigned int peer; /* IPv4 address of the client that detached the session (0 = any) */
+	time_t created;   /* time the session was created */
+	time_t last_used; /* time of the last find_session (or creation) */
+	int job;          /* job state for asynchronous jobs, 0 for detached sessions */
+	double started, finished; /* when the job was started and finished */
+	double cpu;       /* CPU time used by the finished job */
+	struct sSession *prev, *next; /* list of all sessions (in order of creation) */
 };
 
-struct sSession *new_session(char key[16]);
-struct sSession *find_session(char key[16]);
-void free_session(char key[16]);
+/* creates a new session, returns NULL if the key exists already or on allocation error */
+struct sSession *new_session(char key[SESSION_KEY_LEN]);
+/* finds a session and updates its last_used time */
+struct sSession *find_session(char key[SESSION_KEY_LEN]);
+void free_session(char key[SESSION_KEY_LEN]);
+int total_sessions();
 
-/* functions for walking thorugh sessions.
-   warning: next_session becomes invalid if new_session or
-            free_session is called between first_session and
-	    and any subsequent next_session
-*/
+/* functions for walking through sessions. Sessions don't move in
+   memory, so walking is not affected by new_session or by free_session
+   of other sessions than the current one. Sessions created during the
+   walk are visited at its end. */
 struct sSession *first_session();
 struct sSession *next_session(struct sSession* current);
 
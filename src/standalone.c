@@ -11,6 +11,7 @@ extern int Rf_initEmbeddedR(int, char**);
 
 /* R API from oc.c */
 SEXP Rserve_oc_register(SEXP what);
+SEXP Rserve_oc_stats(SEXP refs);
 
 /* main function - start Rserve */
 int main(int argc, char **argv)
@@ -195,6 +196,11 @@ int main(int argc, char **argv)
 			{"Rserve_oobSend", (DL_FUNC) &Rserve_oobSend, 2},
 			{"Rserve_oobMsg", (DL_FUNC) &Rserve_oobMsg, 2},
 			{"Rserve_oc_register", (DL_FUNC) &Rserve_oc_register, 1},
+			{"Rserve_oc_stats", (DL_FUNC) &Rserve_oc_stats, 1},
+			{"Rserve_subscribe", (DL_FUNC) &Rserve_subscribe, 1},
+			{"Rserve_unsubscribe", (DL_FUNC) &Rserve_unsubscribe, 1},
+			{"Rserve_publish", (DL_FUNC) &Rserve_publish, 3},
+			{"Rserve_tlsStats", (DL_FUNC) &Rserve_tlsStats, 0},
 			{NULL, NULL, 0}
 		};
 		R_registerRoutines(R_getEmbeddingDllInfo(), 0, mainCallMethods, 0, 0);
@@ -7,17 +7,318 @@
 #ifdef HAVE_TLS
 
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #ifdef RSERV_DEBUG
 #include <openssl/err.h>
 #endif
+#ifdef unix
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <errno.h>
+#endif
 
 struct tls {
     SSL_CTX *ctx;
-    SSL_METHOD *method;
+    const SSL_METHOD *method;
+    unsigned char ticket_secret[32]; /* ticket keys are derived from this */
+    int ticket_lifetime; /* in seconds, also the key rotation period */
+};
+
+/* Session resumption across children. Each connection is handled by a
+   forked child, so the in-process session cache of OpenSSL is of no
+   use. Instead, ticket keys are derived from a secret created in the
+   server (or loaded from a file) and the current time period, so every
+   child computes the same keys without any communication, keys rotate
+   every ticket_lifetime seconds and tickets from the previous period
+   are still accepted (and renewed). Clients without ticket support can
+   use the optional session cache in memory shared by all children.
+   Statistics are kept in shared memory as well. */
+
+#define TLS_CACHE_ID_LEN  32
+#define TLS_CACHE_DER_LEN 2048 /* larger sessions (e.g. with client certs) are not cached */
+
+typedef struct tls_cache_entry {
+    unsigned int id_len, der_len;
+    time_t expires;
+    unsigned char id[TLS_CACHE_ID_LEN];
+    unsigned char der[TLS_CACHE_DER_LEN];
+} tls_cache_entry_t;
+
+#define TS_HANDSHAKES     0
+#define TS_RESUMED        1
+#define TS_TICKETS_NEW    2
+#define TS_TICKETS_RENEW  3
+#define TS_TICKETS_UNKNOWN 4
+#define TS_CACHE_STORED   5
+#define TS_CACHE_HITS     6
+#define TS_CACHE_MISSES   7
+#define TS_KTLS_SEND      8
+#define TS_KTLS_RECV      9
+#define TS_COUNT          10
+
+static const char *tls_stat_names[TS_COUNT] = {
+    "handshakes", "resumed", "tickets.new", "tickets.renewed", "tickets.unknown",
+    "cache.stored", "cache.hits", "cache.misses", "ktls.send", "ktls.recv"
 };
 
+typedef struct tls_shm {
+    volatile int lock; /* spinlock protecting the cache */
+    unsigned int entries;
+    unsigned long stats[TS_COUNT];
+    tls_cache_entry_t cache[1];
+} tls_shm_t;
+
+static tls_shm_t *shm;
+
+static tls_shm_t *alloc_shm(unsigned int entries) {
+    tls_shm_t *m;
+    size_t sz = sizeof(tls_shm_t) + sizeof(tls_cache_entry_t) * entries;
+#if defined unix && defined MAP_ANONYMOUS
+    m = (tls_shm_t*) mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == (tls_shm_t*) MAP_FAILED)
+	return 0;
+    memset(m, 0, sz);
+#else /* no sharing, but at least the counts of the process */
+    m = (tls_shm_t*) calloc(1, sz);
+#endif
+    if (m) m->entries = entries;
+    return m;
+}
+
+#define stat_add(I) do { if (shm) __sync_fetch_and_add(&shm->stats[I], 1); } while (0)
+
+static void shm_lock() {
+    while (__sync_lock_test_and_set(&shm->lock, 1))
+#ifdef unix
+	sched_yield();
+#else
+	;
+#endif
+}
+
+static void shm_unlock() {
+    __sync_lock_release(&shm->lock);
+}
+
+static tls_cache_entry_t *cache_slot(const unsigned char *id, unsigned int len) {
+    unsigned int h = 2166136261u, i; /* FNV-1a */
+    for (i = 0; i < len; i++)
+	h = (h ^ id[i]) * 16777619u;
+    return &shm->cache[h % shm->entries];
+}
+
+static int cache_new_cb(SSL *ssl, SSL_SESSION *sess) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    unsigned char der[TLS_CACHE_DER_LEN], *d = der;
+    int der_len = i2d_SSL_SESSION(sess, 0);
+    if (der_len <= 0 || der_len > TLS_CACHE_DER_LEN || !id_len || id_len > TLS_CACHE_ID_LEN)
+	return 0;
+    i2d_SSL_SESSION(sess, &d);
+    shm_lock();
+    {
+	tls_cache_entry_t *e = cache_slot(id, id_len);
+	e->id_len = id_len;
+	memcpy(e->id, id, id_len);
+	e->der_len = der_len;
+	memcpy(e->der, der, der_len);
+	e->expires = time(0) + SSL_SESSION_get_timeout(sess);
+    }
+    shm_unlock();
+    stat_add(TS_CACHE_STORED);
+    return 0; /* we don't keep a reference */
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *cache_get_cb(SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+#else
+static SSL_SESSION *cache_get_cb(SSL *ssl, unsigned char *id, int id_len, int *copy) {
+#endif
+    unsigned char der[TLS_CACHE_DER_LEN];
+    const unsigned char *d = der;
+    int der_len = 0;
+    *copy = 0;
+    if (id_len <= 0 || id_len > TLS_CACHE_ID_LEN)
+	return 0;
+    shm_lock();
+    {
+	tls_cache_entry_t *e = cache_slot(id, id_len);
+	if (e->id_len == id_len && !memcmp(e->id, id, id_len) && e->expires > time(0)) {
+	    der_len = e->der_len;
+	    memcpy(der, e->der, der_len);
+	}
+    }
+    shm_unlock();
+    if (!der_len) {
+	stat_add(TS_CACHE_MISSES);
+	return 0;
+    }
+    stat_add(TS_CACHE_HITS);
+    return d2i_SSL_SESSION(0, &d, der_len);
+}
+
+static void cache_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    if (!id_len || id_len > TLS_CACHE_ID_LEN)
+	return;
+    shm_lock();
+    {
+	tls_cache_entry_t *e = cache_slot(id, id_len);
+	if (e->id_len == id_len && !memcmp(e->id, id, id_len))
+	    e->id_len = 0;
+    }
+    shm_unlock();
+}
+
+/* derives the key name, AES key and HMAC key of a time period */
+static void ticket_keys(tls_t *t, unsigned long period, unsigned char *name, unsigned char *aes, unsigned char *mac) {
+    unsigned char in[12], out[32];
+    unsigned int ol = sizeof(out);
+    int i;
+    for (i = 0; i < 8; i++)
+	in[4 + i] = (unsigned char) (period >> ((7 - i) * 8));
+    memcpy(in, "name", 4);
+    HMAC(EVP_sha256(), t->ticket_secret, sizeof(t->ticket_secret), in, sizeof(in), out, &ol);
+    memcpy(name, out, 16);
+    memcpy(in, "aesk", 4);
+    HMAC(EVP_sha256(), t->ticket_secret, sizeof(t->ticket_secret), in, sizeof(in), aes, &ol);
+    memcpy(in, "hmac", 4);
+    HMAC(EVP_sha256(), t->ticket_secret, sizeof(t->ticket_secret), in, sizeof(in), mac, &ol);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_t;
+static int ticket_mac_init(ticket_mac_t *hctx, unsigned char *key) {
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, 32);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX ticket_mac_t;
+static int ticket_mac_init(ticket_mac_t *hctx, unsigned char *key) {
+    return HMAC_Init_ex(hctx, key, 32, EVP_sha256(), 0);
+}
+#endif
+
+/* ticket key callback: encrypt with the key of the current period,
+   decrypt with the current or the previous one (and ask for renewal) */
+static int ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ectx, ticket_mac_t *hctx, int enc) {
+    tls_t *t = (tls_t*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    unsigned long period = ((unsigned long) time(0)) / (unsigned long) t->ticket_lifetime;
+    unsigned char name[16], aes[32], mac[32];
+    if (enc) {
+	ticket_keys(t, period, name, aes, mac);
+	if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+	    return -1;
+	memcpy(key_name, name, 16);
+	if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), 0, aes, iv) || !ticket_mac_init(hctx, mac))
+	    return -1;
+	stat_add(TS_TICKETS_NEW);
+	return 1;
+    } else {
+	int i;
+	for (i = 0; i < 2; i++) {
+	    ticket_keys(t, period - i, name, aes, mac);
+	    if (!memcmp(key_name, name, 16)) {
+		if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), 0, aes, iv) || !ticket_mac_init(hctx, mac))
+		    return -1;
+		if (i)
+		    stat_add(TS_TICKETS_RENEW);
+		return i ? 2 : 1;
+	    }
+	}
+	stat_add(TS_TICKETS_UNKNOWN);
+	return 0; /* unknown or expired key - full handshake */
+    }
+}
+
 static int first_tls = 1;
 
+static int alpn_h2 = 0;
+/* protocols set by the user in wire format (length-prefixed names),
+   the second list leaves out h2 and is used if HTTP/2 is disabled
+   (h2 is only spoken if the HTTP server has it enabled) */
+static unsigned char *alpn_protos, *alpn_protos_h1;
+static unsigned int alpn_len, alpn_len_h1;
+
+void set_tls_alpn_h2(int h2) {
+    alpn_h2 = h2;
+}
+
+int set_tls_alpn(const char *list) {
+    const char *c = list;
+    unsigned char *w, *w1;
+    if (alpn_protos) {
+	free(alpn_protos);
+	alpn_protos = alpn_protos_h1 = 0;
+	alpn_len = alpn_len_h1 = 0;
+    }
+    if (!*list) /* back to the default */
+	return 0;
+    if (!(w = alpn_protos = (unsigned char*) malloc(2 * (strlen(list) + 2))))
+	return -1;
+    w1 = alpn_protos_h1 = alpn_protos + strlen(list) + 2;
+    while (*c) {
+	const char *e = c, *n;
+	while (*e && *e != ',') e++;
+	n = *e ? e + 1 : e; /* start of the next entry */
+	while (c < e && (*c == ' ' || *c == '\t')) c++;
+	while (e > c && (e[-1] == ' ' || e[-1] == '\t')) e--;
+	if (e == c || e - c > 255) { /* empty or too long entry */
+	    free(alpn_protos);
+	    alpn_protos = alpn_protos_h1 = 0;
+	    return -1;
+	}
+	*(w++) = (unsigned char) (e - c);
+	memcpy(w, c, e - c);
+	w += e - c;
+	if (e - c != 2 || memcmp(c, "h2", 2)) {
+	    *(w1++) = (unsigned char) (e - c);
+	    memcpy(w1, c, e - c);
+	    w1 += e - c;
+	}
+	c = n;
+    }
+    alpn_len = w - alpn_protos;
+    alpn_len_h1 = w1 - alpn_protos_h1;
+    return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L /* ALPN is supported since 1.0.2 */
+#define HAVE_ALPN 1
+
+/* ALPN: we speak http/1.1 and h2 if enabled (preferred) */
+static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		       const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    const unsigned char *srv = alpn_h2 ? protos : (protos + 3);
+    unsigned int srvlen = alpn_h2 ? 12 : 9;
+    if (alpn_h2 && alpn_len) {
+	srv = alpn_protos;
+	srvlen = alpn_len;
+    } else if (!alpn_h2 && alpn_len_h1) {
+	srv = alpn_protos_h1;
+	srvlen = alpn_len_h1;
+    }
+    if (SSL_select_next_proto((unsigned char**) out, outlen, srv, srvlen, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+	return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
 static tls_t *tls;
 
 tls_t *shared_tls(tls_t *new_tls) {
@@ -38,17 +339,178 @@ tls_t *new_tls() {
 	tls = t;
     }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    t->method = TLS_server_method(); /* negotiates the highest version both sides support */
+#else
     t->method = SSLv23_server_method();
+#endif
     t->ctx = SSL_CTX_new(t->method);
+#ifdef SSL_OP_PRIORITIZE_CHACHA
+    /* with server preference: use ChaCha20 if the client prefers it
+       (i.e., it has no AES hardware support) and AES-GCM otherwise */
+    SSL_CTX_set_options(t->ctx, SSL_OP_PRIORITIZE_CHACHA);
+#endif
+#ifdef HAVE_ALPN
+    SSL_CTX_set_alpn_select_cb(t->ctx, alpn_select, 0);
+#endif
+    /* session resumption, see above */
+    SSL_CTX_set_app_data(t->ctx, t);
+    SSL_CTX_set_session_id_context(t->ctx, (const unsigned char*) "Rserve", 6);
+    SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_OFF);
+    if (RAND_bytes(t->ticket_secret, sizeof(t->ticket_secret)) == 1) {
+	set_tls_ticket_lifetime(t, 3600);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(t->ctx, ticket_key_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(t->ctx, ticket_key_cb);
+#endif
+    } else
+	SSL_CTX_set_options(t->ctx, SSL_OP_NO_TICKET);
+    if (!shm)
+	shm = alloc_shm(0);
     return t;
 }
 
+void set_tls_tickets(tls_t *tls, int enable) {
+    if (enable)
+	SSL_CTX_clear_options(tls->ctx, SSL_OP_NO_TICKET);
+    else
+	SSL_CTX_set_options(tls->ctx, SSL_OP_NO_TICKET);
+}
+
+int set_tls_ticket_key(tls_t *tls, const char *fn) {
+    unsigned char buf[256];
+    unsigned int ol = sizeof(tls->ticket_secret);
+    size_t n;
+    FILE *f = fopen(fn, "rb");
+    if (!f)
+	return -1;
+    n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (n < 32) /* too short to be a secret */
+	return -1;
+    /* the file can be in any format, we use its hash as the secret */
+    HMAC(EVP_sha256(), "Rserve ticket secret", 20, buf, n, tls->ticket_secret, &ol);
+    return 0;
+}
+
+void set_tls_ticket_lifetime(tls_t *tls, int sec) {
+    if (sec < 1)
+	return;
+    tls->ticket_lifetime = sec;
+    /* the key of a ticket is valid for up to two periods */
+    SSL_CTX_set_timeout(tls->ctx, 2 * sec);
+}
+
+int set_tls_cache(tls_t *tls, int entries) {
+    tls_shm_t *m;
+    if (entries < 1) {
+	SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+	return 0;
+    }
+    if (shm && shm->entries) /* the cache can only be created once */
+	return (shm->entries == entries) ? 0 : -1;
+    if (!(m = alloc_shm(entries)))
+	return -1;
+    if (shm) { /* keep the counts */
+	memcpy(m->stats, shm->stats, sizeof(m->stats));
+#if defined unix && defined MAP_ANONYMOUS
+	munmap(shm, sizeof(tls_shm_t));
+#else
+	free(shm);
+#endif
+    }
+    shm = m;
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(tls->ctx, cache_new_cb);
+    SSL_CTX_sess_set_get_cb(tls->ctx, cache_get_cb);
+    SSL_CTX_sess_set_remove_cb(tls->ctx, cache_remove_cb);
+    return 0;
+}
+
+int set_tls_ktls(tls_t *tls, int enable) {
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable)
+	SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+    else
+	SSL_CTX_clear_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+    return 0;
+#else
+    return enable ? -1 : 0;
+#endif
+}
+
+int tls_stats(double *val, const char **names, int max) {
+    int i;
+    for (i = 0; i < TS_COUNT && i < max; i++) {
+	val[i] = shm ? (double) shm->stats[i] : 0.0;
+	names[i] = tls_stat_names[i];
+    }
+    return i;
+}
+
 int set_tls_pk(tls_t *tls, const char *fn) {
     return SSL_CTX_use_PrivateKey_file(tls->ctx, fn, SSL_FILETYPE_PEM);
 }
 
+/* the file can contain the chain (certificate first). Certificates
+   with different key types (e.g. RSA and ECDSA) can be set up side by
+   side, the one matching the client's capabilities is used */
 int set_tls_cert(tls_t *tls, const char *fn) {
-    return SSL_CTX_use_certificate_file(tls->ctx, fn, SSL_FILETYPE_PEM);
+    return SSL_CTX_use_certificate_chain_file(tls->ctx, fn);
+}
+
+/* "1.2", "TLSv1.2" etc., returns 0 if unknown */
+static int tls_version(const char *v) {
+    if (!strncmp(v, "TLSv", 4) || !strncmp(v, "tlsv", 4))
+	v += 4;
+    if (!strcmp(v, "1") || !strcmp(v, "1.0")) return TLS1_VERSION;
+    if (!strcmp(v, "1.1")) return TLS1_1_VERSION;
+    if (!strcmp(v, "1.2")) return TLS1_2_VERSION;
+#ifdef TLS1_3_VERSION
+    if (!strcmp(v, "1.3")) return TLS1_3_VERSION;
+#endif
+    return 0;
+}
+
+int set_tls_version(tls_t *tls, const char *ver, int max) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    int v = tls_version(ver);
+    if (!v)
+	return -1;
+    return ((max ? SSL_CTX_set_max_proto_version(tls->ctx, v) : SSL_CTX_set_min_proto_version(tls->ctx, v)) == 1) ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int set_tls_ciphers(tls_t *tls, const char *list) {
+    return (SSL_CTX_set_cipher_list(tls->ctx, list) == 1) ? 0 : -1;
+}
+
+int set_tls_ciphersuites(tls_t *tls, const char *list) {
+#ifdef TLS1_3_VERSION
+    return (SSL_CTX_set_ciphersuites(tls->ctx, list) == 1) ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int set_tls_groups(tls_t *tls, const char *list) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    return (SSL_CTX_set1_groups_list(tls->ctx, list) == 1) ? 0 : -1;
+#elif OPENSSL_VERSION_NUMBER >= 0x10002000L
+    return (SSL_CTX_set1_curves_list(tls->ctx, list) == 1) ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+void set_tls_server_preference(tls_t *tls, int enable) {
+    if (enable)
+	SSL_CTX_set_options(tls->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    else
+	SSL_CTX_clear_options(tls->ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 }
 
 int set_tls_ca(tls_t *tls, const char *fn_ca, const char *path_ca) {
@@ -63,27 +525,164 @@ struct args {
     void *res2;
 };
 
+/* Small writes (QAP headers, HTTP header lines, ...) are coalesced
+   into records of up to tls_record_size bytes which are sent when full
+   or when the server flushes at the end of a message. Pending output is
+   also flushed before reading, so a peer is never left waiting for a
+   response sitting in the buffer. */
+static int tls_record_size = 16384;
+
+typedef struct tls_wbuf {
+    int len, size;
+    char d[1];
+} tls_wbuf_t;
+
+void set_tls_record_size(int size) {
+    tls_record_size = (size > 0) ? size : 0;
+}
+
+/* sends all of buf, returns 0 on success, -1 on error */
+static int tls_write(args_t *c, const char *buf, rlen_t len) {
+#ifdef SSL_OP_ENABLE_KTLS
+    /* the kernel encrypts, so we can bypass OpenSSL altogether. Reads
+       still go through SSL_read() since non-application records
+       (alerts, post-handshake messages) need to be handled by OpenSSL */
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl))) {
+	while (len) {
+	    ssize_t n = send(c->s, buf, len, 0);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		return -1;
+	    buf += n;
+	    len -= n;
+	}
+	return 0;
+    }
+#endif
+    while (len) { /* SSL_write is limited to int */
+	int n = SSL_write(c->ssl, buf, (len > 1048576) ? 1048576 : (int) len);
+	if (n <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static int tls_flush(args_t *c) {
+    tls_wbuf_t *wb = (tls_wbuf_t*) SSL_get_app_data(c->ssl);
+    if (wb && wb->len) {
+	int n = wb->len;
+	wb->len = 0;
+	return tls_write(c, wb->d, n);
+    }
+    return 0;
+}
+
 static int tls_recv(args_t *c, void *buf, rlen_t len) {
+    if (tls_flush(c))
+	return -1;
     return SSL_read(c->ssl, buf, len);
 }
 
 static int tls_send(args_t *c, const void *buf, rlen_t len) {
-    return SSL_write(c->ssl, buf, len);
+    tls_wbuf_t *wb = (tls_wbuf_t*) SSL_get_app_data(c->ssl);
+    const char *b = (const char*) buf;
+    rlen_t left = len;
+    if (!wb) /* no coalescing */
+	return tls_write(c, b, len) ? -1 : len;
+    if (wb->len + len <= wb->size) {
+	memcpy(wb->d + wb->len, b, len);
+	wb->len += len;
+	return len;
+    }
+    if (wb->len) { /* complete the pending record */
+	int n = wb->size - wb->len;
+	memcpy(wb->d + wb->len, b, n);
+	wb->len += n;
+	b += n;
+	left -= n;
+	if (tls_flush(c))
+	    return -1;
+    }
+    /* full records are sent directly, the rest is kept */
+    if (left >= wb->size) {
+	rlen_t n = left - left % wb->size;
+	if (tls_write(c, b, n))
+	    return -1;
+	b += n;
+	left -= n;
+    }
+    memcpy(wb->d, b, left);
+    wb->len = left;
+    return len;
 }
 
 int add_tls(args_t *c, tls_t *tls, int server) {
     c->ssl = SSL_new(tls->ctx);
     c->srv->send = tls_send;
     c->srv->recv = tls_recv;
+    c->srv->flush = tls_flush;
+    if (tls_record_size) {
+	tls_wbuf_t *wb = (tls_wbuf_t*) malloc(sizeof(tls_wbuf_t) + tls_record_size);
+	if (wb) {
+	    wb->len = 0;
+	    wb->size = tls_record_size;
+	    SSL_set_app_data(c->ssl, wb);
+	}
+    }
     SSL_set_fd(c->ssl, c->s);
-    if (server) 
-	return SSL_accept(c->ssl);
-    else
+    if (server) {
+	int res = SSL_accept(c->ssl);
+	if (res == 1) {
+	    stat_add(TS_HANDSHAKES);
+	    if (SSL_session_reused(c->ssl))
+		stat_add(TS_RESUMED);
+#ifdef SSL_OP_ENABLE_KTLS
+	    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl)))
+		stat_add(TS_KTLS_SEND);
+	    if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl)))
+		stat_add(TS_KTLS_RECV);
+#endif
+	}
+	return res;
+    } else
 	return SSL_connect(c->ssl);
 }
 
+int tls_alpn_h2(args_t *c) {
+#ifdef HAVE_ALPN
+    const unsigned char *proto = 0;
+    unsigned int len = 0;
+    if (c->ssl)
+	SSL_get0_alpn_selected(c->ssl, &proto, &len);
+    return (len == 2 && !memcmp(proto, "h2", 2)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+int tls_pending(args_t *c) {
+    return c->ssl ? SSL_pending(c->ssl) : 0;
+}
+
+int tls_ktls_send(args_t *c) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return (c->ssl && BIO_get_ktls_send(SSL_get_wbio(c->ssl))) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
 void close_tls(args_t *c) {
     if (c->ssl) {
+	tls_wbuf_t *wb = (tls_wbuf_t*) SSL_get_app_data(c->ssl);
+	tls_flush(c);
+	if (wb) {
+	    SSL_set_app_data(c->ssl, 0);
+	    free(wb);
+	}
 	SSL_shutdown(c->ssl);
 	SSL_free(c->ssl);
 	c->ssl = 0;
@@ -100,10 +699,27 @@ tls_t *shared_tls(tls_t *new_tls) { return 0; }
 tls_t *new_tls() { return 0; }
 int set_tls_pk(tls_t *tls, const char *fn) { return -1; }
 int set_tls_cert(tls_t *tls, const char *fn) { return -1; }
+int set_tls_version(tls_t *tls, const char *ver, int max) { return -1; }
+int set_tls_ciphers(tls_t *tls, const char *list) { return -1; }
+int set_tls_ciphersuites(tls_t *tls, const char *list) { return -1; }
+int set_tls_groups(tls_t *tls, const char *list) { return -1; }
+void set_tls_server_preference(tls_t *tls, int enable) { }
+int set_tls_alpn(const char *list) { return -1; }
 int set_tls_ca(tls_t *tls, const char *fn_ca, const char *path_ca) { return -1; }
 void free_tls(tls_t *tls) { }
 
 int add_tls(args_t *c, tls_t *tls, int server) { return -1; }
 void close_tls(args_t *c) { }
+void set_tls_alpn_h2(int h2) { }
+int tls_alpn_h2(args_t *c) { return 0; }
+int tls_pending(args_t *c) { return 0; }
+void set_tls_tickets(tls_t *tls, int enable) { }
+int set_tls_ticket_key(tls_t *tls, const char *fn) { return -1; }
+void set_tls_ticket_lifetime(tls_t *tls, int sec) { }
+int set_tls_cache(tls_t *tls, int entries) { return -1; }
+int tls_stats(double *val, const char **names, int max) { return 0; }
+int set_tls_ktls(tls_t *tls, int enable) { return enable ? -1 : 0; }
+int tls_ktls_send(args_t *c) { return 0; }
+void set_tls_record_size(int size) { }
 
 #endif
@@ -15,7 +15,59 @@ int set_tls_cert(tls_t *tls, const char *fn);
 int set_tls_ca(tls_t *tls, const char *fn_ca, const char *path_ca);
 void free_tls(tls_t *tls);
 
+/* protocol configuration, all return 0 on success and -1 on failure
+   (including features not supported by the OpenSSL version). */
+/* minimal (max = 0) or maximal (max = 1) version such as "1.2" or "TLSv1.3" */
+int set_tls_version(tls_t *tls, const char *ver, int max);
+/* cipher list for TLS up to 1.2 (OpenSSL syntax) */
+int set_tls_ciphers(tls_t *tls, const char *list);
+/* cipher suites for TLS 1.3 */
+int set_tls_ciphersuites(tls_t *tls, const char *list);
+/* key exchange groups (curves) such as "X25519:P-256" */
+int set_tls_groups(tls_t *tls, const char *list);
+/* use the order of the server rather than the client when selecting
+   a cipher, but ChaCha20 is used if the client prefers it */
+void set_tls_server_preference(tls_t *tls, int enable);
+/* ALPN protocols offered by the server (comma-separated, in the order
+   of preference) instead of http/1.1 and h2, "" restores the default */
+int set_tls_alpn(const char *list);
+
+/* session resumption across children: session tickets (enabled by
+   default) with keys derived from a secret that is either random or
+   read from a file, rotated every lifetime seconds. Optionally a session
+   cache with the given number of entries shared by all children. Must
+   be set up before children are forked. */
+void set_tls_tickets(tls_t *tls, int enable);
+int set_tls_ticket_key(tls_t *tls, const char *fn);
+void set_tls_ticket_lifetime(tls_t *tls, int sec);
+int set_tls_cache(tls_t *tls, int entries);
+
+/* statistics of all processes (handshakes, resumed sessions, tickets,
+   cache use), stores up to max values and their names, returns the count */
+int tls_stats(double *val, const char **names, int max);
+
+/* kernel TLS: once the handshake is done the record layer is moved to
+   the kernel (if supported by the OS, OpenSSL and the cipher) so
+   connections can send directly on the socket. Returns -1 if OpenSSL
+   has no kTLS support. */
+int set_tls_ktls(tls_t *tls, int enable);
+
+/* small writes are coalesced into records of up to size bytes which
+   are sent when full or when srv->flush is called (0 = no coalescing).
+   Applies to connections created afterwards. */
+void set_tls_record_size(int size);
+
 int add_tls(args_t *c, tls_t *tls, int server);
 void close_tls(args_t *c);
+/* number of bytes already decrypted and available for reading */
+int tls_pending(args_t *c);
+/* returns 1 if records sent on the connection are encrypted by the
+   kernel, i.e., plain writes to the socket are allowed */
+int tls_ktls_send(args_t *c);
+
+/* ALPN: offer h2 in addition to http/1.1 */
+void set_tls_alpn_h2(int h2);
+/* returns 1 if h2 was negotiated via ALPN on the connection */
+int tls_alpn_h2(args_t *c);
 
 #endif
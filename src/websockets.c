@@ -3,6 +3,7 @@
 #include "md5.h"
 #include "sha1.h"
 #include "tls.h"
+#include "hub.h"
 
 #include "rsdebug.h"
 #include "rserr.h"
@@ -11,6 +12,20 @@
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef unix
+#include <sys/uio.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if defined __AVX2__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct args {
 	server_t *srv; /* server that instantiated this connection */
@@ -25,13 +40,119 @@ struct args {
 };
 
 static int  WS_recv_data(args_t *arg, void *buf, rlen_t read_len);
+static int  WS_recv_frames(args_t *arg, void *buf, rlen_t read_len);
 static void WS_send_resp(args_t *arg, int rsp, rlen_t len, const void *buf);
 static int  WS_send_data(args_t *arg, const void *buf, rlen_t len);
 
 static int WS_wire_send(args_t *arg, const void *buf, rlen_t len) {
 	return (arg->tls_arg) ? arg->tls_arg->srv->send(arg->tls_arg, buf, len) : send(arg->s, buf, len, 0);
 }
+/* sends output buffered by the TLS layer, called at the end of each message */
+static int WS_wire_flush(args_t *arg) {
+	return (arg->tls_arg) ? server_flush(arg->tls_arg) : 0;
+}
+/* sends the header and the payload as one WebSocket frame without
+   copying the payload. Plain sockets (and TLS with kernel encryption)
+   use scatter-gather I/O, other TLS connections send the header with
+   the first piece of the payload (to avoid a tiny record) and the rest
+   directly from buf. Returns 0 on success, -1 on failure. */
+static int WS_wire_send_frame(args_t *arg, const char *hdr, int hl, const char *buf, rlen_t len) {
+#ifdef unix
+	if (!arg->tls_arg || tls_ktls_send(arg->tls_arg)) {
+		int s = arg->tls_arg ? arg->tls_arg->s : arg->s;
+		struct iovec iov[2];
+		int iovs = 0;
+		if (arg->tls_arg && server_flush(arg->tls_arg)) /* buffered output goes first */
+			return -1;
+		iov[0].iov_base = (void*) hdr;
+		iov[0].iov_len = hl;
+		iov[1].iov_base = (void*) buf;
+		iov[1].iov_len = len;
+		while (iovs < 2) {
+			ssize_t n = writev(s, iov + iovs, 2 - iovs);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			while (iovs < 2 && n >= iov[iovs].iov_len)
+				n -= iov[iovs++].iov_len;
+			if (iovs < 2) {
+				iov[iovs].iov_base = ((char*) iov[iovs].iov_base) + n;
+				iov[iovs].iov_len -= n;
+			}
+		}
+		return 0;
+	}
+#endif
+	{
+		int n, first = (len + hl > arg->sl) ? (arg->sl - hl) : len;
+		if (hdr != arg->sbuf)
+			memcpy(arg->sbuf, hdr, hl);
+		memcpy(arg->sbuf + hl, buf, first);
+		n = WS_wire_send(arg, arg->sbuf, hl + first);
+		if (n != hl + first)
+			return -1;
+		buf += first;
+		len -= first;
+		while (len) { /* TLS send is limited to int */
+			int send_here = (len > 1048576) ? 1048576 : len;
+			n = WS_wire_send(arg, buf, send_here);
+			if (n <= 0)
+				return -1;
+			buf += n;
+			len -= n;
+		}
+	}
+	return 0;
+}
+
+/* reads from the connection. If the child has subscribed to hub
+   channels, frames relayed by the master are sent to the client while
+   we are waiting for input. The same applies to results of
+   asynchronous OC calls evaluated by workers. */
 static int WS_wire_recv(args_t *arg, void *buf, rlen_t len) {
+#ifdef unix
+	args_t *ta = arg->tls_arg;
+	struct pollfd pfd[2 + OC_MAX_WORKERS];
+	int nw, hub;
+	while (!(ta && tls_pending(ta))) {
+		hub = (arg->ver >= 4 && hub_child_active());
+		nw = oc_async_fds(pfd + 2, OC_MAX_WORKERS);
+		if (!hub && !nw)
+			break;
+		if (WS_wire_flush(arg)) /* we may be waiting for a long time */
+			return -1;
+		pfd[0].fd = ta ? ta->s : arg->s;
+		pfd[1].fd = hub ? hub_child_fd() : -1;
+		pfd[0].events = pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+		if (poll(pfd, 2 + nw, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[0].revents) /* input (or an error which recv will report) */
+			break;
+		if (nw) {
+			oc_async_forward(arg, pfd + 2, nw);
+			if (WS_wire_flush(arg))
+				return -1;
+		}
+		if (pfd[1].revents) {
+			char *fr;
+			unsigned long fl;
+			int err;
+			if (hub_child_recv(&fr, &fl)) { /* the master is gone */
+				hub_child_close();
+				continue;
+			}
+			err = WS_wire_send_frame(arg, fr, 0, fr, fl) || WS_wire_flush(arg);
+			free(fr);
+			if (err)
+				return -1;
+		}
+	}
+#endif
 	return (arg->tls_arg) ? arg->tls_arg->srv->recv(arg->tls_arg, buf, len) : recv(arg->s, buf, len, 0);
 }
 static void WS_wire_close(args_t *arg) {
@@ -48,15 +169,186 @@ static void WS_wire_close(args_t *arg) {
 	arg->s = -1;
 }
 
+/* unmask len bytes of msg in place. koff is the offset of msg[0] in the
+   key (frames can be received in several pieces), returns the key
+   offset following the last byte. Most of the data is processed in
+   words (or vectors if the compiler targets SSE2/AVX2) using the key
+   rotated by koff so it lines up with the data. */
 static int do_mask(char *msg, int len, int koff, char *key) {
+	unsigned char rk[4];
+	uint64_t k64;
 	int i = 0;
-	while (i < len) {
-		msg[i] ^= key[(i + koff) & 3];
-		i++;
-    }
+	/* rotate the key so that rk[0] applies to msg[0] */
+	rk[0] = key[koff & 3];
+	rk[1] = key[(koff + 1) & 3];
+	rk[2] = key[(koff + 2) & 3];
+	rk[3] = key[(koff + 3) & 3];
+	/* process leading bytes up to an 8-byte boundary so wide loads are aligned */
+	while (i < len && (((uintptr_t) (msg + i)) & 7))
+		msg[i] ^= rk[i & 3], i++;
+	if (len - i >= 8) {
+		unsigned char k8[8];
+		/* i is now the offset of the aligned pointer, so the key pattern starts at i & 3 */
+		k8[0] = k8[4] = rk[i & 3];
+		k8[1] = k8[5] = rk[(i + 1) & 3];
+		k8[2] = k8[6] = rk[(i + 2) & 3];
+		k8[3] = k8[7] = rk[(i + 3) & 3];
+		memcpy(&k64, k8, 8);
+#if defined __AVX2__
+		{
+			__m256i kv = _mm256_set1_epi64x((long long) k64);
+			while (len - i >= 32) {
+				__m256i *p = (__m256i*) (msg + i);
+				_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), kv));
+				i += 32;
+			}
+		}
+#endif
+#if defined __SSE2__
+		{
+			__m128i kv = _mm_set1_epi64x((long long) k64);
+			while (len - i >= 16) {
+				__m128i *p = (__m128i*) (msg + i);
+				_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), kv));
+				i += 16;
+			}
+		}
+#endif
+		while (len - i >= 8) {
+			uint64_t w;
+			memcpy(&w, msg + i, 8);
+			w ^= k64;
+			memcpy(msg + i, &w, 8);
+			i += 8;
+		}
+	}
+	while (i < len)
+		msg[i] ^= rk[i & 3], i++;
 	return (i + koff) & 3;
 }
 
+#ifdef HAVE_ZLIB
+/* permessage-deflate extension (RFC 7692). Compression level (0 = the
+   extension is not offered) and the minimal size of a message to be
+   compressed - smaller messages are sent uncompressed */
+static int  ws_deflate_level = 0;
+static long ws_deflate_min = 256;
+
+#define WSD_SERVER_NCT  1 /* server_no_context_takeover */
+#define WSD_CLIENT_NCT  2 /* client_no_context_takeover */
+
+#define WSD_BUF_SIZE 65536
+
+/* per-connection compression state, stored in arg->res2 */
+typedef struct ws_deflate {
+	z_stream zo, zi;       /* deflate (outgoing), inflate (incoming) */
+	int flags;             /* WSD_* */
+	int in_msg;            /* receiving a compressed message: 1 = data, 2 = inflated entirely */
+	int in_eom;            /* last frame of the message has been read */
+	int raw_inframe;       /* F_INFRAME of the frame layer (while in_msg) */
+	char *ibuf, *obuf;     /* compressed input, inflated output */
+	unsigned int opos, olen;
+} ws_deflate_t;
+#endif
+
+void set_ws_deflate(int level, long min_size) {
+#ifdef HAVE_ZLIB
+	if (level >= 0)
+		ws_deflate_level = (level > 9) ? 9 : level;
+	if (min_size >= 0)
+		ws_deflate_min = min_size;
+#endif
+}
+
+/* checks the Sec-WebSocket-Extensions: header of the client for an
+   acceptable permessage-deflate offer. If there is one, the compression
+   state is attached to arg and the response header line is written to
+   res, otherwise res is an empty string. */
+static void ws_deflate_negotiate(args_t *arg, const char *ext, char *res, int res_len) {
+#ifdef HAVE_ZLIB
+	const char *c = ext;
+	*res = 0;
+	if (!ws_deflate_level || !ext || arg->ver < 13)
+		return;
+	while (*c) { /* offers are separated by commas, parameters by semicolons */
+		int ok = 1, flags = 0, sbits = 0, cbits = 0;
+		const char *e;
+		while (*c == ' ' || *c == '\t' || *c == ',') c++;
+		e = c;
+		while (*e && *e != ';' && *e != ',' && *e != ' ' && *e != '\t') e++;
+		if (e - c != 18 || strncasecmp(c, "permessage-deflate", 18))
+			ok = 0;
+		c = e;
+		while (*c && *c != ',') {
+			char pn[32], pv[16];
+			int pl = 0, vl = 0, has_v = 0;
+			while (*c == ' ' || *c == '\t' || *c == ';') c++;
+			while (*c && *c != '=' && *c != ';' && *c != ',' && *c != ' ' && *c != '\t') {
+				if (pl < sizeof(pn) - 1) pn[pl++] = *c;
+				c++;
+			}
+			pn[pl] = 0;
+			while (*c == ' ' || *c == '\t') c++;
+			if (*c == '=') {
+				has_v = 1;
+				c++;
+				while (*c == ' ' || *c == '\t') c++;
+				if (*c == '"') c++;
+				while (*c && *c != '"' && *c != ';' && *c != ',' && *c != ' ' && *c != '\t') {
+					if (vl < sizeof(pv) - 1) pv[vl++] = *c;
+					c++;
+				}
+				if (*c == '"') c++;
+			}
+			pv[vl] = 0;
+			if (!pl) continue;
+			if (!strcasecmp(pn, "server_no_context_takeover") && !has_v)
+				flags |= WSD_SERVER_NCT;
+			else if (!strcasecmp(pn, "client_no_context_takeover") && !has_v)
+				flags |= WSD_CLIENT_NCT;
+			else if (!strcasecmp(pn, "server_max_window_bits") && has_v) {
+				sbits = atoi(pv);
+				/* zlib doesn't support 8-bit windows for raw deflate */
+				if (sbits < 9 || sbits > 15) ok = 0;
+			} else if (!strcasecmp(pn, "client_max_window_bits")) {
+				cbits = has_v ? atoi(pv) : 15;
+				if (cbits < 8 || cbits > 15) ok = 0;
+			} else /* unknown parameter - the offer cannot be accepted */
+				ok = 0;
+		}
+		if (ok) {
+			ws_deflate_t *wd = (ws_deflate_t*) calloc(1, sizeof(ws_deflate_t));
+			if (!wd) return;
+			if (deflateInit2(&wd->zo, ws_deflate_level, Z_DEFLATED, -(sbits ? sbits : 15), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				free(wd);
+				return;
+			}
+			if (inflateInit2(&wd->zi, -(cbits ? cbits : 15)) != Z_OK ||
+				!(wd->ibuf = (char*) malloc(WSD_BUF_SIZE)) ||
+				!(wd->obuf = (char*) malloc(WSD_BUF_SIZE))) {
+				deflateEnd(&wd->zo);
+				inflateEnd(&wd->zi);
+				if (wd->ibuf) free(wd->ibuf);
+				free(wd);
+				return;
+			}
+			wd->flags = flags;
+			arg->res2 = wd;
+			snprintf(res, res_len, "Sec-WebSocket-Extensions: permessage-deflate%s%s", (flags & WSD_SERVER_NCT) ? "; server_no_context_takeover" : "",
+					 (flags & WSD_CLIENT_NCT) ? "; client_no_context_takeover" : "");
+			if (sbits)
+				snprintf(res + strlen(res), res_len - strlen(res), "; server_max_window_bits=%d", sbits);
+			if (cbits) /* we can inflate any window size so we just confirm the client's choice */
+				snprintf(res + strlen(res), res_len - strlen(res), "; client_max_window_bits=%d", cbits);
+			snprintf(res + strlen(res), res_len - strlen(res), "\r\n");
+			return;
+		}
+	}
+#else
+	*res = 0;
+#endif
+}
+
 /* due to very large cookies the lines may be very long, using 128kB for now */
 #define LINE_BUF_SIZE (128*1024)
 
@@ -70,6 +362,7 @@ struct header_info {
 	char *path;
 	char *query;
 	char *protocol;
+	char *extensions;
 };
 
 static void free_header(struct header_info *h) {
@@ -81,6 +374,7 @@ static void free_header(struct header_info *h) {
 	if (h->path) free(h->path);
 	if (h->query) free(h->query);
 	if (h->protocol) free(h->protocol);
+	if (h->extensions) free(h->extensions);
 }
 
 static unsigned long count_spaces(const char *c) {
@@ -209,6 +503,10 @@ static void WS_connected(void *parg) {
 					if (!strcmp(kc, "sec-websocket-key1")) h.key1 = strdup(dc);
 					if (!strcmp(kc, "sec-websocket-key2")) h.key2 = strdup(dc);
 					if (!strcmp(kc, "sec-websocket-key")) h.key = strdup(dc);
+					if (!strcmp(kc, "sec-websocket-extensions")) {
+						if (h.extensions) free(h.extensions);
+						h.extensions = strdup(dc);
+					}
 				} else if (!*kc && ++empty_lines) break;
 			}
 		}
@@ -302,14 +600,15 @@ static void WS_connected(void *parg) {
 #endif
 	} else {
 		unsigned char hash[21];
-		char b64[40];
+		char b64[40], ext[256];
+		ws_deflate_negotiate(arg, h.extensions, ext, sizeof(ext));
 		strcpy(buf, h.key);
 		strcat(buf, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
 		sha1hash(buf, strlen(buf), hash);
 		hash[20] = 0; /* base64encode needs NUL sentinel */
 		base64encode(hash, sizeof(hash) - 1, b64);
 		/* FIXME: if the client requests multiple protocols, we should be picking one but we don't */
-		snprintf(buf, LINE_BUF_SIZE, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s\r\n", b64, h.protocol ? "Sec-WebSocket-Protocol: " : "", h.protocol ? h.protocol : "", h.protocol ? "\r\n" : "");
+		snprintf(buf, LINE_BUF_SIZE, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s%s\r\n", b64, h.protocol ? "Sec-WebSocket-Protocol: " : "", h.protocol ? h.protocol : "", h.protocol ? "\r\n" : "", ext);
 		WS_wire_send(arg, buf, strlen(buf));
 #ifdef RSERV_DEBUG
 		printf("Responded with WebSockets.04+ handshake (version = %02d)\n", h.version);
@@ -318,7 +617,7 @@ static void WS_connected(void *parg) {
 	free(buf);
 
 	arg->bl = FRAME_BUFFER_SIZE;
-	arg->bp = 0;
+	arg->bp = arg->sp = 0;
 	arg->buf = (char*) malloc(FRAME_BUFFER_SIZE);
 	arg->sl = FRAME_BUFFER_SIZE;
 	arg->sbuf = (char*) malloc(FRAME_BUFFER_SIZE);
@@ -343,8 +642,8 @@ static server_t *ws_upgrade_srv; /* virtual server that represents the WS layer
 /* IMPORTANT: it mangles the arg structure, so the caller should make sure it releases any obejcts from
               the structure that may leak */
 /* FIXME: it only works on connections that have a direct socket since we don't have a stack to do TLS <-> WS <-> QAP */
-void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char *version) {
-	char buf[512];
+void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char *version, const char *extensions) {
+	char buf[768], ext[256];
 	unsigned char hash[21];
 	char b64[44];
 	server_t *srv;
@@ -354,6 +653,7 @@ void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char
 		if (!ws_upgrade_srv) {
 			snprintf(buf, sizeof(buf), "HTTP/1.1 511 Allocation error\r\n\r\n");
 			arg->srv->send(arg, buf, strlen(buf));
+			server_flush(arg);
 			return;
 		}
 		srv->parent    = arg->srv;
@@ -368,20 +668,22 @@ void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char
 	sha1hash(buf, strlen(buf), hash);
 	hash[20] = 0; /* base64encode needs NUL sentinel */
 	base64encode(hash, sizeof(hash) - 1, b64);
+	arg->ver = version ? atoi(version) : 13; /* let's assume 13 if not present */
+	ws_deflate_negotiate(arg, extensions, ext, sizeof(ext));
 	/* FIXME: if the client requests multiple protocols, we should be picking one but we don't */
-	snprintf(buf, sizeof(buf), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s\r\n", b64, protocol ? "Sec-WebSocket-Protocol: " : "", protocol ? protocol : "", protocol ? "\r\n" : "");
+	snprintf(buf, sizeof(buf), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s%s%s%s\r\n", b64, protocol ? "Sec-WebSocket-Protocol: " : "", protocol ? protocol : "", protocol ? "\r\n" : "", ext);
 	arg->srv->send(arg, buf, strlen(buf));
+	server_flush(arg); /* srv is replaced below */
 #ifdef RSERV_DEBUG
 	printf("Responded with WebSockets.04+ handshake (version = %02d)\n", version ? atoi(version) : 0);
 #endif
 
 	arg->bl = FRAME_BUFFER_SIZE;
-	arg->bp = 0;
+	arg->bp = arg->sp = 0;
 	arg->buf = (char*) malloc(FRAME_BUFFER_SIZE);
 	arg->sl = FRAME_BUFFER_SIZE;
 	arg->sbuf = (char*) malloc(FRAME_BUFFER_SIZE);
 	arg->srv = srv;
-	arg->ver = version ? atoi(version) : 13; /* let's assume 13 if not present */
 
 	/* textual protocol */
 	if (protocol && strstr(protocol, "text")) {
@@ -393,6 +695,92 @@ void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char
 	Rserve_QAP1_connected(arg);
 }
 
+#ifdef HAVE_ZLIB
+/* compresses hdr followed by buf as (a part of) a message with
+   permessage-deflate. The output is sent as it is produced, so the
+   message may be fragmented into several frames, each at most the size
+   of the send buffer. If fin is not set, the compressed data that
+   doesn't fill a frame is kept in the send buffer and the message is
+   continued by the next call (F_OUT_Z is set in the meantime).
+   Returns 0 on success, -1 on failure. */
+static int WS_deflate_part(args_t *arg, int opcode, const char *hdr, int hl, const char *buf, rlen_t len, int fin_msg) {
+	ws_deflate_t *wd = (ws_deflate_t*) arg->res2;
+	unsigned char *sbuf = (unsigned char*) arg->sbuf;
+	unsigned int cap = arg->sl - 10; /* leave space for the longest frame header */
+	z_stream *zs = &wd->zo;
+
+	if (!(arg->flags & F_OUT_Z)) { /* new message */
+		zs->next_out = sbuf + 10;
+		zs->avail_out = cap;
+		arg->flags |= F_OUT_Z;
+	}
+	zs->avail_in = 0;
+	while (1) {
+		int flush = Z_NO_FLUSH, fin = 0;
+		unsigned int have, fl, h;
+		unsigned char *f;
+		if (!zs->avail_in) {
+			if (hl) {
+				zs->next_in = (Bytef*) hdr;
+				zs->avail_in = hl;
+				hl = 0;
+			} else if (len) {
+				uInt n = (len > 1073741824) ? 1073741824 : len;
+				zs->next_in = (Bytef*) buf;
+				zs->avail_in = n;
+				buf += n;
+				len -= n;
+			} else if (!fin_msg) /* the rest will come with the next part */
+				return 0;
+			else
+				flush = Z_SYNC_FLUSH;
+		}
+		if (deflate(zs, flush) == Z_STREAM_ERROR)
+			return -1;
+		if (zs->avail_out) {
+			if (flush == Z_NO_FLUSH) continue;
+			fin = 1; /* all flushed */
+		}
+		/* the message must not include the final 00 00 ff ff of the
+		   sync flush, so we keep the last four bytes until the end */
+		have = cap - zs->avail_out;
+		fl = have - 4;
+		h = (fl < 126) ? 2 : ((fl < 65536) ? 4 : 10);
+		f = sbuf + 10 - h;
+		f[0] = (fin ? 0x80 : 0) | ((arg->flags & F_OUT_FRAG) ? 0 : (0x40 | opcode));
+		if (fl < 126)
+			f[1] = fl;
+		else if (fl < 65536) {
+			f[1] = 126;
+			f[2] = fl >> 8;
+			f[3] = fl & 255;
+		} else {
+			int i = 8;
+			unsigned long l = fl;
+			f[1] = 127;
+			while (i--) { f[2 + i] = l & 255; l >>= 8; }
+		}
+		if (WS_wire_send(arg, f, fl + h) != fl + h)
+			return -1;
+		if (fin)
+			break;
+		memmove(sbuf + 10, sbuf + 10 + fl, 4);
+		zs->next_out = sbuf + 14;
+		zs->avail_out = cap - 4;
+		arg->flags |= F_OUT_FRAG;
+	}
+	arg->flags &= ~ (F_OUT_Z | F_OUT_FRAG);
+	if (wd->flags & WSD_SERVER_NCT)
+		deflateReset(zs);
+	return 0;
+}
+
+/* sends a complete message (hdr followed by buf) compressed with permessage-deflate */
+static int WS_send_deflated(args_t *arg, int opcode, const char *hdr, int hl, const char *buf, rlen_t len) {
+	return WS_deflate_part(arg, opcode, hdr, hl, buf, len, 1);
+}
+#endif
+
 static void WS_send_resp(args_t *arg, int rsp, rlen_t len, const void *buf) {
 	unsigned char *sbuf = (unsigned char*) arg->sbuf;
 	if (arg->ver == 0) {
@@ -427,6 +815,17 @@ static void WS_send_resp(args_t *arg, int rsp, rlen_t len, const void *buf) {
 		}
 #endif
 
+#ifdef HAVE_ZLIB
+		if (arg->res2 && flen >= ws_deflate_min) {
+			if (WS_send_deflated(arg, (arg->flags & F_OUT_BIN) ? 2 : 1, (const char*) &ph, sizeof(ph), (const char*) buf, len)) {
+#ifdef RSERV_DEBUG
+				fprintf(stderr, "WS_send_resp: write failed\n");
+#endif
+			}
+			return;
+		}
+#endif
+
 		sbuf[pl++] = ((arg->flags & F_OUT_BIN) ? 1 : 0) + ((arg->ver < 4) ? 0x04 : 0x81); /* text/binary, 4+ has inverted FIN bit */
 		if (flen < 126) /* short length */
 			sbuf[pl++] = flen;
@@ -441,186 +840,266 @@ static void WS_send_resp(args_t *arg, int rsp, rlen_t len, const void *buf) {
 		}	
 		memcpy(sbuf + pl, &ph, sizeof(ph));
 		pl += sizeof(ph);
-		while (len + pl) {
-			int n, send_here = (len + pl > arg->sl) ? arg->sl : (len + pl);
-			if (send_here > pl)
-				memcpy(sbuf + pl, buf, send_here - pl);
-			n = WS_wire_send(arg, sbuf, send_here);
+		/* the payload is sent directly from the caller's buffer */
 #ifdef RSERV_DEBUG
-			if (pl) {
-				fprintf(stderr, "WS_send_resp: sending 4+ frame (ver %02d), n = %d / %d (of total %ld)\n", arg->ver, n, send_here, flen);
-				{ int i, m = send_here; if (m > 100) m = 100; for (i = 0; i < m; i++) fprintf(stderr, " %02x", (int) sbuf[i]); fprintf(stderr,"\n"); }
-			} else
-				fprintf(stderr, "WS_send_resp: continuation (%d bytes)\n", n);
+		fprintf(stderr, "WS_send_resp: sending 4+ frame (ver %02d), %d + %ld bytes\n", arg->ver, pl, (long) len);
+		{ int i; for (i = 0; i < pl; i++) fprintf(stderr, " %02x", (int) sbuf[i]); fprintf(stderr,"\n"); }
 #endif
-			if (n != send_here) {
+		if (WS_wire_send_frame(arg, (const char*) sbuf, pl, (const char*) buf, len)) {
 #ifdef RSERV_DEBUG
-				fprintf(stderr, "WS_send_resp: write failed (%d expected, got %d)\n", send_here, n);
+			fprintf(stderr, "WS_send_resp: write failed\n");
 #endif
-				return;
-			}
-			buf = ((char*)buf) + send_here - pl;
-			len -= send_here - pl;
-			pl = 0;
+			return;
+		}
+	}
+}
+
+static int WS_send_frag(args_t *arg, const void *buf, rlen_t len, int fin) {
+	unsigned char hdr[10];
+	int hl = 0, more = (arg->flags & F_OUT_FRAG) ? 1 : 0;
+	if (!len && !fin) /* nothing to do */
+		return 0;
+	if (arg->ver == 0) { /* 00 frames are delimited so we can just stream the content */
+		if (!more) {
+			hdr[hl++] = 0;
+			arg->flags |= F_OUT_FRAG;
 		}
+		if ((hl && WS_wire_send(arg, hdr, hl) != hl) ||
+			(len && WS_wire_send_frame(arg, (const char*) hdr, 0, (const char*) buf, len)))
+			return -1;
+		if (fin) {
+			hdr[0] = 0xff;
+			arg->flags &= ~ F_OUT_FRAG;
+			if (WS_wire_send(arg, hdr, 1) != 1)
+				return -1;
+		}
+		return 0;
+	}
+#ifdef HAVE_ZLIB
+	/* the message is compressed unless it is known to be small */
+	if (arg->res2 && ((arg->flags & F_OUT_Z) || (!more && (!fin || len >= ws_deflate_min))))
+		return WS_deflate_part(arg, (arg->flags & F_OUT_BIN) ? 2 : 1, 0, 0, (const char*) buf, len, fin);
+#endif
+	if (arg->ver < 4) /* inverted FIN bit, text/binary opcodes are 4/5 */
+		hdr[hl++] = (fin ? 0 : 0x80) | (more ? 0 : (((arg->flags & F_OUT_BIN) ? 1 : 0) + 0x04));
+	else
+		hdr[hl++] = (fin ? 0x80 : 0) | (more ? 0 : (((arg->flags & F_OUT_BIN) ? 1 : 0) + 0x01));
+	if (len < 126)
+		hdr[hl++] = len;
+	else if (len < 65536) {
+		hdr[hl++] = 126;
+		hdr[hl++] = len >> 8;
+		hdr[hl++] = len & 255;
+	} else {
+		int i;
+		hdr[hl++] = 127;
+		for (i = 7; i >= 0; i--)
+			hdr[hl++] = (unsigned char) (((unsigned long long) len) >> (i * 8));
 	}
+	if (fin)
+		arg->flags &= ~ F_OUT_FRAG;
+	else
+		arg->flags |= F_OUT_FRAG;
+	return WS_wire_send_frame(arg, (const char*) hdr, hl, (const char*) buf, len);
 }
 
-/* we use send_data only to send the ID string so we don't bother supporting frames bigger than the buffer */
+int WS_send_fragment(args_t *arg, const void *buf, rlen_t len, int fin) {
+	int res = WS_send_frag(arg, buf, len, fin);
+	if (!res && fin) /* end of the message */
+		res = WS_wire_flush(arg);
+	return res;
+}
+
+/* sends buf as one complete message */
 static int  WS_send_data(args_t *arg, const void *buf, rlen_t len) {
-	unsigned char *sbuf = (unsigned char*) arg->sbuf;
-	if (arg->ver == 0) {
-		if (len < arg->sl - 2) {
-			int n;
-			sbuf[0] = 0;
-			memcpy(sbuf + 1, buf, len);
-			sbuf[len + 1] = 0xff;
-			n = WS_wire_send(arg, sbuf, len + 2);
+	if (WS_send_fragment(arg, buf, len, 1)) {
 #ifdef RSERV_DEBUG
-			fprintf(stderr, "WS_send_data: sending 00 frame, n = %d / %d\n", n, (int) len + 2);
+		fprintf(stderr, "ERROR in WS_send_data: write failed\n");
 #endif
-			if (n == len + 2) return len;
-			if (n < len + 2 && n >= len) return len - 1;
-			return n;
-		} else {
+		return -1;
+	}
+	return len;
+}
+
+#ifdef HAVE_ZLIB
+/* reads more compressed content of the current message into the input buffer */
+static int WS_inflate_input(args_t *arg, ws_deflate_t *wd, int n) {
+	wd->zi.next_in = (Bytef*) wd->ibuf;
+	wd->zi.avail_in = n;
+	wd->raw_inframe = arg->flags & F_INFRAME;
+	if (!wd->raw_inframe && (arg->flags & F_FIN)) { /* end of message - append the removed trailer */
+		memcpy(wd->ibuf + n, "\0\0\xff\xff", 4);
+		wd->zi.avail_in += 4;
+		wd->in_eom = 1;
+	}
+	return n;
+}
+
+/* delivers content of a compressed message. F_INFRAME is set until all
+   of the message has been delivered, so the callers see the message as
+   if it was one uncompressed frame. The last inflated byte is held back
+   until we know whether the message continues, because the final frame
+   may not produce any output and we cannot return 0 for it. */
+static int WS_recv_inflated(args_t *arg, ws_deflate_t *wd, void *buf, rlen_t read_len) {
+	while (wd->olen - wd->opos < 2 && wd->in_msg == 1) {
+		unsigned int keep = wd->olen - wd->opos;
+		int r;
+		if (!wd->zi.avail_in && !wd->in_eom) {
+			int n;
+			/* restore the state of the frame layer */
+			if (wd->raw_inframe) arg->flags |= F_INFRAME; else arg->flags &= ~F_INFRAME;
+			/* the frame layer returns 0 for empty frames (e.g. the final
+			   frame of a fragmented message), we recognize them by the
+			   frame type being set (15 is not a valid type) */
+			SET_F_FT(arg->flags, 15);
+			n = WS_recv_frames(arg, wd->ibuf, WSD_BUF_SIZE - 4);
+			if (n < 0 || (n == 0 && GET_F_FT(arg->flags) == 15)) return n;
+			WS_inflate_input(arg, wd, n);
+		}
+		if (keep)
+			wd->obuf[0] = wd->obuf[wd->opos];
+		wd->opos = 0;
+		wd->olen = keep;
+		wd->zi.next_out = (Bytef*) wd->obuf + keep;
+		wd->zi.avail_out = WSD_BUF_SIZE - keep;
+		r = inflate(&wd->zi, Z_SYNC_FLUSH);
+		if (r == Z_STREAM_END) /* the client used BFINAL, the rest starts a new stream */
+			r = inflateReset(&wd->zi);
+		if (r != Z_OK && r != Z_BUF_ERROR) {
 #ifdef RSERV_DEBUG
-			fprintf(stderr, "ERROR in WS_send_data: data too large\n");
+			fprintf(stderr, "WS_recv_data: inflate failed (%d)\n", r);
 #endif
 			return -1;
 		}
-	} else {
-		if (len < arg->sl - 8 && len < 65536) {
-			int n, pl = 0;
-			sbuf[pl++] =  ((arg->flags & F_OUT_BIN) ? 1 : 0) + ((arg->ver < 4) ? 0x04 : 0x81); /* text, 4+ has inverted FIN bit */
-			if (len < 126) /* short length */
-				sbuf[pl++] = len;
-			else if (len < 65536) { /* 16-bit */
-				sbuf[pl++] = 126;
-				sbuf[pl++] = len >> 8;
-				sbuf[pl++] = len & 255;
-			}
-			/* no masking or other stuff */
-			memcpy(sbuf + pl, buf, len);
-			n = WS_wire_send(arg, sbuf, len + pl);
-#ifdef RSERV_DEBUG
-			fprintf(stderr, "WS_send_data: sending 4+ frame (ver %02d), n = %d / %d\n", arg->ver, n, (int) len + pl);
+		wd->olen = WSD_BUF_SIZE - wd->zi.avail_out;
+		if (wd->in_eom && !wd->zi.avail_in && wd->zi.avail_out) /* nothing more to come */
+			wd->in_msg = 2;
+	}
+	if (read_len > wd->olen - wd->opos - ((wd->in_msg == 1) ? 1 : 0))
+		read_len = wd->olen - wd->opos - ((wd->in_msg == 1) ? 1 : 0);
+	memcpy(buf, wd->obuf + wd->opos, read_len);
+	wd->opos += read_len;
+	if (wd->in_msg == 2 && wd->opos == wd->olen) { /* the whole message has been delivered */
+		wd->in_msg = 0;
+		if (wd->flags & WSD_CLIENT_NCT)
+			inflateReset(&wd->zi);
+		arg->flags &= ~F_INFRAME;
+	} else
+		arg->flags |= F_INFRAME;
+	return read_len;
+}
 #endif
-			if (n == len + pl) return len;
-			if (n < len + pl && n >= len) return len - 1;
-			return n;
-		} else {
+
+/* receives payload of data frames. If permessage-deflate is used,
+   compressed messages are inflated */
+static int WS_recv_data(args_t *arg, void *buf, rlen_t read_len) {
+#ifdef HAVE_ZLIB
+	ws_deflate_t *wd = (ws_deflate_t*) arg->res2;
+	if (wd) {
+		if (!wd->in_msg) {
+			/* we don't know whether the next message is compressed until
+			   we see its header, so read into buf and copy if it is */
+			int n = WS_recv_frames(arg, buf, (read_len > WSD_BUF_SIZE - 4) ? (WSD_BUF_SIZE - 4) : read_len);
+			if (n < 1 || !(arg->flags & F_RSV1))
+				return n;
+			memcpy(wd->ibuf, buf, n);
+			wd->in_msg = 1;
+			wd->in_eom = 0;
+			wd->opos = wd->olen = 0;
+			WS_inflate_input(arg, wd, n);
+		}
+		return WS_recv_inflated(arg, wd, buf, read_len);
+	}
+#endif
+	return WS_recv_frames(arg, buf, read_len);
+}
+
+/* frame layer: delivers payload of the incoming frames.
+
+   arg->buf holds received data that has not been consumed yet in
+   [sp, bp), so consuming data only advances sp. Frames are not
+   buffered as a whole: once a frame header has been parsed, arg->l1
+   is the remaining payload of the frame (and arg->l2 the mask key)
+   and the payload is streamed to the caller - from the buffer as far
+   as it has been received and then, for reads of at least
+   WS_DIRECT_MIN bytes, received directly into the caller's buffer. */
+
+#define WS_DIRECT_MIN 4096
+
+/* makes sure that at least n bytes are in the buffer. Returns 1 on
+   success or the result of the failed recv (0 or -1) */
+static int WS_fill(args_t *arg, int n) {
+	if (arg->bp - arg->sp >= n)
+		return 1;
+	if (arg->sp == arg->bp)
+		arg->sp = arg->bp = 0;
+	else if (arg->bl - arg->sp < n) { /* not enough space behind the few bytes we have */
+		memmove(arg->buf, arg->buf + arg->sp, arg->bp - arg->sp);
+		arg->bp -= arg->sp;
+		arg->sp = 0;
+	}
+	while (arg->bp - arg->sp < n) {
+		int r = WS_wire_recv(arg, arg->buf + arg->bp, arg->bl - arg->bp);
 #ifdef RSERV_DEBUG
-			fprintf(stderr, "ERROR in WS_send_data: data too large\n");
+		fprintf(stderr, "INFO: WS_recv_data: read %d bytes in addition to %d (need %d)\n", r, arg->bp - arg->sp, n);
 #endif
-			return -1;
-		}		
+		if (r < 1) return r;
+		arg->bp += r;
 	}
-	return 0;
+	return 1;
 }
 
-static int  WS_recv_data(args_t *arg, void *buf, rlen_t read_len) {
+static int  WS_recv_frames(args_t *arg, void *buf, rlen_t read_len) {
 #ifdef RSERV_DEBUG
-	fprintf(stderr, "WS_recv_data for %d (bp = %d)\n", (int) read_len, arg->bp);
+	fprintf(stderr, "WS_recv_data for %d (bp = %d, sp = %d)\n", (int) read_len, arg->bp, arg->sp);
 #endif
+	if (read_len > 1073741824) /* we return int so limit the size of one read */
+		read_len = 1073741824;
 	if (arg->ver == 0) {
+		unsigned char *b;
+		int i = 0, avail;
 		/* make sure we have at least one (in frame) or two (oof) bytes in the buffer */
-		int min_size = (arg->flags & F_INFRAME) ? 1 : 2;
-		while (arg->bp < min_size) {
-			int n = WS_wire_recv(arg, arg->buf + arg->bp, arg->bl - arg->bp);
-#ifdef RSERV_DEBUG
-			fprintf(stderr, "WS_recv_data: needs ver 00 frame, reading %d bytes in addition to %d\n", n, arg->bp);
-			{ int i; fprintf(stderr, "Buffer: "); for (i = 0; i < n; i++) fprintf(stderr, " %02x", (int) (unsigned char) arg->buf[i]); fprintf(stderr,"\n"); }
-#endif
-			if (n < 1) return n;
-			arg->bp += n;
-		}
+		int n = WS_fill(arg, (arg->flags & F_INFRAME) ? 1 : 2);
+		if (n < 1) return n;
 
 		if (!(arg->flags & F_INFRAME)) {
-			if (arg->buf[0] != 0x00) {
+			if (arg->buf[arg->sp] != 0x00) {
 #ifdef RSERV_DEBUG
-				fprintf(stderr, "ERROR: WS_recv_data: ver0 yet not a text frame (0x%02x)\n", (int) (unsigned char) arg->buf[0]);
+				fprintf(stderr, "ERROR: WS_recv_data: ver0 yet not a text frame (0x%02x)\n", (int) (unsigned char) arg->buf[arg->sp]);
 #endif
 				return -1;
 			}
-			/* now we're in-frame - this is silly but makes the processing easier */
 			arg->flags |= F_INFRAME;
-			memmove(arg->buf, arg->buf + 1, arg->bp - 1);
+			arg->sp++;
 		}
 
-		/* first check if we can satify any need by using contents of the buffer */
-		/* NOTE: this is actually always true since we guarantee both F_INFRAME and bp > 0 above */
-	    if ((arg->flags & F_INFRAME) && arg->bp > 0) {
-			unsigned char *b = (unsigned char*) arg->buf;
-			int i = 0;
-#ifdef RSERV_DEBUG
-			fprintf(stderr, "WS_recv_data: have %d bytes of a frame, requested %d, returning what we have\n", arg->bp, (int) read_len);
-#endif
-			while (i < arg->bp && i < read_len && b[i] != 0xff) i++;
-			if (i >= arg->bp) { /* end of buffer, still in frame */
-				memcpy(buf, arg->buf, i);
-				arg->bp = 0;
-				return i;
-			}
-			if (b[i] == 0xff) { /* reached end of frame */
-				if (i) memcpy(buf, arg->buf, i);
-				arg->bp -= i + 1;
-				if (arg->bp > 0)
-					memmove(arg->buf, arg->buf + i + 1, arg->bp);
-				arg->flags ^= F_INFRAME;
-				return i;
-			}
-			/* read_len was less than the buffer and did not even reach the end of frame */
-			memcpy(buf, arg->buf, i);
-			arg->bp -= i;
-			memmove(arg->buf, arg->buf + i, arg->bp);
-			return i;
+		/* deliver the frame content up to the 0xff terminator */
+		b = (unsigned char*) arg->buf + arg->sp;
+		avail = arg->bp - arg->sp;
+		while (i < avail && i < read_len && b[i] != 0xff) i++;
+		memcpy(buf, b, i);
+		arg->sp += i;
+		if (i < avail && b[i] == 0xff) { /* reached end of frame */
+			arg->sp++;
+			arg->flags ^= F_INFRAME;
 		}
+		if (arg->sp == arg->bp)
+			arg->sp = arg->bp = 0;
+		return i;
 	} /* ver 00 always returns before this */
 
-	if ((arg->flags & F_INFRAME) && arg->bp > 0) { /* do we have content of a frame what has not been picked up yet? */
-#ifdef RSERV_DEBUG
-		fprintf(stderr, "WS_recv_data: have %d bytes of a frame, requested %d, returning what we have\n", arg->bp, (int) read_len);
-#endif
-		if (read_len > arg->bp) read_len = arg->bp; /* at most all buffer */
-		if (read_len > arg->l1) read_len = arg->l1; /* and not beyond the current frame */
-		memcpy(buf, arg->buf, read_len);
-		if (arg->bp > read_len)
-			memmove(arg->buf, arg->buf + read_len, arg->bp - read_len);
-		arg->bp -= read_len;
-		arg->l1 -= read_len;
-		/* if the whole frame was consumed, flag out-of-frame for the next run */
-		if (arg->l1 == 0)
-			arg->flags ^= F_INFRAME;
-		return read_len;
-	}
-	/* make sure we have at least one byte in the buffer */
-	if (arg->bp == 0) {
-		int n = WS_wire_recv(arg, arg->buf, arg->bl);
+	if (!(arg->flags & F_INFRAME)) { /* not in frame - interpret a new frame */
+		unsigned char *fr;
+		int more, mask = 0, need, ct;
+		long len;
+		int n = WS_fill(arg, 2);
 		if (n < 1) return n;
-		arg->bp = n;
-#ifdef RSERV_DEBUG
-		fprintf(stderr, "INFO: WS_recv_data: read %d bytes:\n", n);
-		{ int i; for (i = 0; i < n; i++) fprintf(stderr, " %02x", (int) (unsigned char) arg->buf[i]); fprintf(stderr,"\n"); }
-#endif
-	}
-	if (arg->flags & F_INFRAME) { /* in frame with new content */
-		if (read_len > arg->l1) /* we can do at most the end of the frame */
-			read_len = arg->l1;
-		if (read_len > arg->bp) /* and at most what we got in the buffer */
-			read_len = arg->bp;
-		memcpy(buf, arg->buf, read_len);
-		if (arg->flags & F_MASK)
-			SET_F_MASK(arg->flags, do_mask(buf, read_len, GET_MASK_ID(arg->flags), (char*)&arg->l2));
-		arg->bp -= read_len;
-		arg->l1 -= read_len;
-		if (arg->l1 == 0) /* was that the entire frame? */
-			arg->flags ^= F_INFRAME;
-		return read_len;
-	} else { /* not in frame - interpret a new frame */
-		unsigned char *fr = (unsigned char*) arg->buf;
-		int more = (arg->ver < 4) ? ((fr[0] & 0x80) == 0x80) : ((fr[0] & 0x80) == 0), mask = 0;
-		int need = 0, ct = fr[0] & 127, at_least, payload;
-		long len = 0;
+		fr = (unsigned char*) arg->buf + arg->sp;
+		more = (arg->ver < 4) ? ((fr[0] & 0x80) == 0x80) : ((fr[0] & 0x80) == 0);
+		ct = fr[0] & ((arg->ver < 4) ? 127 : 15);
+		/* final frame of a message and RSV1 (compressed message if permessage-deflate is used) */
+		if (more) arg->flags &= ~ F_FIN; else arg->flags |= F_FIN;
+		if (arg->ver >= 4 && (fr[0] & 0x40)) arg->flags |= F_RSV1; else arg->flags &= ~ F_RSV1;
 		/* set the F_IN_BIN flag according to the frame type */
 		if ((arg->ver < 4 && ct == 5) ||
 			(arg->ver >= 4 && ct == 2))
@@ -628,19 +1107,11 @@ static int  WS_recv_data(args_t *arg, void *buf, rlen_t read_len) {
 		else
 			arg->flags &= ~ F_IN_BIN;
 		SET_F_FT(arg->flags, ct);
-		if (arg->bp == 1) {
-			int n = WS_wire_recv(arg, arg->buf + 1, arg->bl - 1);
-			if (n < 1) return n;
-			arg->bp = n + 1;
-		}
 		if (arg->ver > 6 && fr[1] & 0x80) mask = 1;
 		len = fr[1] & 127;
 		need = 2 + (mask ? 4 : 0) + ((len < 126) ? 0 : ((len == 126) ? 2 : 8));
-		while (arg->bp < need) {
-			int n = WS_wire_recv(arg, arg->buf + arg->bp, arg->bl - arg->bp);
-			if (n < 1) return n;
-			arg->bp += n;
-		}
+		if ((n = WS_fill(arg, need)) < 1) return n;
+		fr = (unsigned char*) arg->buf + arg->sp; /* the buffer content may have moved */
 		if (len == 126)
 			len = (fr[2] << 8) | fr[3];
 		else if (len == 127) {
@@ -651,64 +1122,82 @@ static int  WS_recv_data(args_t *arg, void *buf, rlen_t read_len) {
 				return -1;
 			}
 #define SH(X,Y) (((long)X) << Y)
-			len = SH(fr[4], 48) | SH(fr[5], 40) | SH(fr[5], 32) | SH(fr[6], 24) | SH(fr[7], 16) | SH(fr[8], 8) | (long)fr[9];
+			len = SH(fr[4], 40) | SH(fr[5], 32) | SH(fr[6], 24) | SH(fr[7], 16) | SH(fr[8], 8) | (long)fr[9];
 		}
 #ifdef RSERV_DEBUG
-		fprintf(stderr, "INFO: WS_recv_data frame type=%02x, len=%d, more=%d, mask=%d (need=%d)\n", ct, (int) len, more, mask, need);
-#endif
-		at_least = need + len;
-		if (at_least > arg->bl)
-			at_least = arg->bl;
-		payload = at_least - need;
-		
-		while (arg->bp < at_least) {
-			int n = WS_wire_recv(arg, arg->buf + arg->bp, at_least - arg->bp);
-#ifdef RSERV_DEBUG
-			fprintf(stderr, "INFO: read extra %d bytes in addition to %d (need %d)\n", n, arg->bp, need);
+		fprintf(stderr, "INFO: WS_recv_data frame type=%02x, len=%ld, more=%d, mask=%d (need=%d)\n", ct, len, more, mask, need);
 #endif
-			if (n < 1) return n;
-			arg->bp += n;
-		}
 		/* FIXME: more recent protocols require MASK at all times */
 		if (mask) {
-#ifdef RSERV_DEBUG
-			{ int i; for (i = 0; i < payload; i++) fprintf(stderr, " %02x", (int) (unsigned char) arg->buf[need + i]); fprintf(stderr,"\n"); }
-#endif
-			SET_F_MASK(arg->flags, do_mask(arg->buf + need, payload, 0, arg->buf + need - 4));
-			memcpy(&arg->l2, arg->buf + need - 4, 4);
-#ifdef RSERV_DEBUG
-			{ int i; for (i = 0; i < payload; i++) fprintf(stderr, " %02x", (int) (unsigned char) arg->buf[need + i]); fprintf(stderr,"\n"); }
-#endif
-		} else arg->flags &= ~ F_MASK;
-		
-		/* if the frame fits in the buffer (payload == len) and the read will read it all, we can deliver the whole frame */
-		if (payload == len && read_len >= payload) {
-#ifdef RSERV_DEBUG
-			fprintf(stderr, "INFO: WS_recv_data frame has %d bytes, requested %d, returning entire frame\n", (int) len, (int) read_len);
-#endif
-			memcpy(buf, arg->buf + need, len);
-			if (arg->bp > at_least) { /* this is unlikely but possible if we got multiple frames in the first read */
-				memmove(arg->buf, arg->buf + at_least, arg->bp - at_least);
-				arg->bp -= at_least;
-			} else arg->bp = 0;
-			return len;
-		}
-		
-		/* left-over */
-#ifdef RSERV_DEBUG
-		fprintf(stderr, "INFO: WS_recv_data frame has %d bytes (of %ld frame), requested %d, returning partial frame\n", payload, len, (int) read_len);
-#endif
-		/* we can only read all we got */
-		if (read_len > payload) read_len = payload;
-		memcpy(buf, arg->buf + need, read_len);
-		if (arg->bp > need + read_len) /* if there is any data beyond what we will deliver, we need to move it */
-			memmove(arg->buf, arg->buf + need + read_len, arg->bp - need - read_len);
-		len -= read_len; /* left in the frame is total minus delivered - we only get here if the frame did not fit, so len > 0 */
+			memcpy(&arg->l2, fr + need - 4, 4);
+			SET_F_MASK(arg->flags, 0);
+		} else
+			arg->flags &= ~ F_MASK;
+		arg->sp += need;
+		if (arg->sp == arg->bp)
+			arg->sp = arg->bp = 0;
+		if (!len) /* empty frame */
+			return 0;
 		arg->l1 = len;
 		arg->flags |= F_INFRAME;
-		arg->bp -= need + read_len;
-		return read_len;
-	} /* in frame */
+	}
+
+	/* in frame - deliver as much of the payload as we can */
+	if (read_len > arg->l1) /* we can do at most the end of the frame */
+		read_len = arg->l1;
+	if (arg->bp > arg->sp) { /* content in the buffer */
+		if (read_len > arg->bp - arg->sp)
+			read_len = arg->bp - arg->sp;
+		memcpy(buf, arg->buf + arg->sp, read_len);
+		arg->sp += read_len;
+		if (arg->sp == arg->bp)
+			arg->sp = arg->bp = 0;
+	} else if (read_len >= WS_DIRECT_MIN) { /* large read - receive directly into the caller's buffer */
+		int n = WS_wire_recv(arg, buf, read_len);
+		if (n < 1) return n;
+		read_len = n;
+	} else { /* small read - fill the buffer so we don't recv tiny pieces */
+		int n = WS_wire_recv(arg, arg->buf, arg->bl);
+		if (n < 1) return n;
+		arg->bp = n;
+		if (read_len > n)
+			read_len = n;
+		memcpy(buf, arg->buf, read_len);
+		arg->sp = read_len;
+		if (arg->sp == arg->bp)
+			arg->sp = arg->bp = 0;
+	}
+	if (arg->flags & F_MASK)
+		SET_F_MASK(arg->flags, do_mask(buf, read_len, GET_MASK_ID(arg->flags), (char*)&arg->l2));
+#ifdef RSERV_DEBUG
+	fprintf(stderr, "INFO: WS_recv_data delivering %d bytes, %ld left in the frame\n", (int) read_len, arg->l1 - (long) read_len);
+#endif
+	arg->l1 -= read_len;
+	if (arg->l1 == 0) /* was that the entire frame? */
+		arg->flags ^= F_INFRAME;
+	return read_len;
+}
+
+int WS_is_connection(args_t *arg) {
+	return (arg && arg->srv && arg->srv->send_resp == WS_send_resp && arg->ver >= 4) ? 1 : 0;
+}
+
+int WS_frame_header(unsigned char *hdr, int opcode, rlen_t len) {
+	int hl = 0;
+	hdr[hl++] = 0x80 | (opcode & 15);
+	if (len < 126)
+		hdr[hl++] = (unsigned char) len;
+	else if (len < 65536) {
+		hdr[hl++] = 126;
+		hdr[hl++] = (unsigned char) (len >> 8);
+		hdr[hl++] = (unsigned char) len;
+	} else {
+		int i;
+		hdr[hl++] = 127;
+		for (i = 7; i >= 0; i--)
+			hdr[hl++] = (unsigned char) (((unsigned long long) len) >> (i * 8));
+	}
+	return hl;
 }
 
 server_t *create_WS_server(int port, int flags) {
@@ -16,13 +16,36 @@ server_t *create_WS_server(int port, int protocols);
 
 /* upgrade HTTP connection to WS - assumes that the HTTP server has parsed the request already
    only WS 13+ handshake is supported by this function */
-void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char *version);
+void WS13_upgrade(args_t *arg, const char *key, const char *protocol, const char *version, const char *extensions);
+
+/* permessage-deflate: compression level 0..9 (0 = off) and minimal
+   message size (in bytes) to compress, negative values leave the setting
+   unchanged */
+void set_ws_deflate(int level, long min_size);
+
+/* returns 1 if arg is a WebSocket (version 4+) connection */
+int WS_is_connection(args_t *arg);
+
+/* writes the header of a final, unmasked frame with the given opcode
+   and payload length into hdr (which must have space for 10 bytes),
+   returns the length of the header */
+int WS_frame_header(unsigned char *hdr, int opcode, rlen_t len);
+
+/* sends a part of a text (or binary if F_OUT_BIN is set) message.
+   The message is started by the first call and finished by the call
+   with fin set, so the caller doesn't need to know its size in advance.
+   Returns 0 on success, -1 on failure. */
+int WS_send_fragment(args_t *arg, const void *buf, rlen_t len, int fin);
 
 /* flags used in args_t.flags */
 #define F_INFRAME 0x010
 #define F_MASK    0x020
 #define F_IN_BIN  0x040
 #define F_OUT_BIN 0x080
+#define F_RSV1    0x100 /* RSV1 bit of the current message (permessage-deflate) */
+#define F_FIN     0x200 /* current frame is the last of the message */
+#define F_OUT_FRAG 0x400 /* a fragmented message is being sent */
+#define F_OUT_Z   0x800 /* the message being sent is compressed */
 
 #define SET_F_FT(X, FT) X = (((X) & 0xfff) | (((FT) & 15) << 12))
 #define GET_F_FT(X) (((X) >> 12) & 15)